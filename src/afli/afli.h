@@ -1,29 +1,40 @@
 #ifndef AFLI_H
 #define AFLI_H
 
+#include "afli/afli_file.h"
 #include "afli/afli_nodes.h"
 
 namespace nfl {
 
-template <typename KT, typename VT>
+// Alloc is the NodeAllocator policy that holds all memory of the index, 
+// Stats is the running statistics policy, see run_stats.h, and Equal is the 
+// key equality of the lookups, see buckets.h
+template <typename KT, typename VT, typename Alloc = ArenaAllocator, 
+          typename Stats = NoRunStat, typename Equal = ApproxKeys>
 class AFLI {
 typedef std::pair<KT, VT> KVT;
 private:
+  Alloc alloc_;
   TNode<KT, VT>* root_;
+  MappedAFLI<KT, VT>* image_;   // The mapped index file of a read-only index
   HyperParameter hyper_para_;
+
+  friend class ConcurrentAFLI<KT, VT>;
 public:
-  AFLI() : root_(nullptr) { }
+  AFLI() : root_(nullptr), image_(nullptr) { }
 
   ~AFLI() {
-    if (root_ != nullptr) {
-      delete root_;
+    delete image_;
+    // An allocator that releases in bulk frees the tree with itself
+    if (root_ != nullptr && !alloc_.bulk_release()) {
+      TNode<KT, VT>::destroy(root_);
     }
   }
 
   void bulk_load(const KVT* kvs, uint32_t size, int32_t bucket_size=-1, 
                 uint32_t aggregate_size=0) {
     assert_p(root_ == nullptr, "The index must be empty before bulk loading");
-    root_ = new TNode<KT, VT>();
+    root_ = TNode<KT, VT>::create(&alloc_);
     if (bucket_size == -1) {
       hyper_para_.max_bucket_size_ = compute_bucket_size(kvs, size);
     } else {
@@ -33,47 +44,162 @@ public:
                                       hyper_para_.kMaxBucketSize);
     }
     hyper_para_.aggregate_size_ = aggregate_size;
+    // One thread starts the build and the team runs the tasks it spawns for 
+    // large subtrees and for fitting large nodes
+    uint32_t num_threads = size < kParallelFitSize ? 1 : omp_get_max_threads();
+    alloc_.reserve_threads(num_threads);
+    #pragma omp parallel num_threads(num_threads)
+    #pragma omp single
     root_->build(kvs, size, 1, hyper_para_);
   }
 
+  // Write the index to a file that open_mmap serves without loading it
+  void save(const std::string& path) {
+    assert_p(root_ != nullptr, "Only a loaded index can be saved");
+    AFLIFileWriter<KT, VT>(path).write(root_, hyper_para_);
+  }
+
+  // Serve lookups straight from a file written by save. The file is mapped 
+  // read-only and shared, so replicas on one machine share its pages. The 
+  // index only supports find, find_batch, size and the counted sizes 
+  // afterwards, and the other calls stop the process.
+  void open_mmap(const std::string& path) {
+    assert_p(root_ == nullptr && image_ == nullptr, 
+              "The index must be empty before opening a file");
+    image_ = new MappedAFLI<KT, VT>();
+    image_->open(path);
+    hyper_para_.max_bucket_size_ = image_->header().max_bucket_size_;
+    hyper_para_.aggregate_size_ = image_->header().aggregate_size_;
+  }
+
   ResultIterator<KT, VT> find(KT key) {
-    return root_->find(key);
+    if (image_ != nullptr) {
+      return image_->template find<Equal>(key);
+    }
+    return root_->template find<Stats, Equal>(key);
+  }
+
+  // Look up n keys with interleaved, prefetching descents. The result of 
+  // keys[i] is stored in results[i].
+  void find_batch(const KT* keys, uint32_t n, ResultIterator<KT, VT>* results) {
+    if (image_ != nullptr) {
+      for (uint32_t i = 0; i < n; ++ i) {
+        results[i] = image_->template find<Equal>(keys[i]);
+      }
+      return;
+    }
+    root_->template find_batch<Stats, Equal>(keys, n, results);
+  }
+
+  // Return an iterator at the first key that is not less than the given key
+  ForwardIterator<KT, VT> lower_bound(KT key) {
+    assert_not_mapped("lower_bound");
+    return root_->lower_bound(key);
+  }
+
+  ForwardIterator<KT, VT> begin() {
+    assert_not_mapped("begin");
+    return root_->begin();
+  }
+
+  // Append all key-value pairs in [lo, hi) to out and return their number
+  uint32_t scan(KT lo, KT hi, std::vector<KVT>& out) {
+    assert_not_mapped("scan");
+    uint32_t cnt = 0;
+    for (auto it = root_->lower_bound(lo); !it.is_end() && it.key() < hi; 
+          ++ it, ++ cnt) {
+      out.push_back(it.kv());
+    }
+    return cnt;
   }
 
   bool update(KVT kv) {
-    return root_->update(kv);
+    assert_not_mapped("update");
+    return root_->template update<Stats, Equal>(kv);
   }
 
   uint32_t remove(KT key) {
-    return root_->remove(key);
+    assert_not_mapped("remove");
+    return root_->template remove<Stats, Equal>(key, 1, hyper_para_);
   }
     
   void insert(KVT kv) {
-    root_->insert(kv, 1, hyper_para_);
+    assert_not_mapped("insert");
+    root_->template insert<Stats>(kv, 1, hyper_para_);
   }
 
   void print_stats() {
+    assert_not_mapped("print_stats");
     TreeStat ts;
     ts.bucket_size_ = hyper_para_.max_bucket_size_;
     collect_tree_statistics(root_, 1, ts);
     ts.show();
   }
 
-  uint64_t model_size() {
-    TreeStat ts;
-    ts.bucket_size_ = hyper_para_.max_bucket_size_;
-    collect_tree_statistics(root_, 1, ts);
-    return ts.model_size_;
+  // The running statistics of all indexes with this Stats policy since the 
+  // last reset. Empty unless the policy records them.
+  RunStat run_stats() {
+    RunStat rs = Stats::collect();
+    rs.bucket_threshold_ = hyper_para_.max_bucket_size_;
+    rs.num_data_ = image_ != nullptr ? image_->header().num_keys_ 
+                                      : root_->size_sub_tree_;
+    return rs;
   }
 
-  uint64_t index_size() {
-    TreeStat ts;
-    ts.bucket_size_ = hyper_para_.max_bucket_size_;
-    collect_tree_statistics(root_, 1, ts);
-    return ts.index_size_;
+  // The expected number of levels that a lookup of a stored key visits, which 
+  // grows with the conflicts of inserts. The root keeps it up to date, so it 
+  // takes constant time.
+  double lookup_cost() const {
+    assert_not_mapped("lookup_cost");
+    return root_->lookup_cost();
+  }
+
+  uint32_t size() const {
+    if (image_ != nullptr) {
+      return static_cast<uint32_t>(image_->header().num_keys_);
+    }
+    return root_->size_sub_tree();
+  }
+
+  // The sizes come from the counters that the nodes keep up to date, so they 
+  // take constant time and may be polled while the index is modified. A deep 
+  // query walks the tree instead, e.g., to verify the counters.
+  uint64_t model_size(bool deep=false) {
+    if (deep) {
+      assert_not_mapped("model_size");
+      TreeStat ts;
+      ts.bucket_size_ = hyper_para_.max_bucket_size_;
+      collect_tree_statistics(root_, 1, ts);
+      return ts.model_size_;
+    }
+    const SizeCounters& counters = alloc_.counters_;
+    return counters.num_nodes_.load(std::memory_order_relaxed) 
+            * sizeof(TNode<KT, VT>) 
+          + counters.num_models_.load(std::memory_order_relaxed) 
+            * sizeof(LinearModel<KT>) 
+          + counters.num_buckets_.load(std::memory_order_relaxed) 
+            * sizeof(Bucket<KT, VT>);
+  }
+
+  // The bytes of the live blocks. The heap footprint of an ArenaAllocator 
+  // also counts its free slab space, see allocated_size.
+  uint64_t index_size(bool deep=false) {
+    if (deep) {
+      assert_not_mapped("index_size");
+      TreeStat ts;
+      ts.bucket_size_ = hyper_para_.max_bucket_size_;
+      collect_tree_statistics(root_, 1, ts);
+      return ts.index_size_;
+    }
+    return alloc_.counters_.bytes_.load(std::memory_order_relaxed);
   }
 
 private:
+  // The calls that walk or modify the tree need the nodes in memory
+  void assert_not_mapped(const std::string& op) const {
+    assert_p(image_ == nullptr, op + " is not supported on a read-only mapped index");
+  }
+
   uint8_t compute_bucket_size(const KVT* kvs, uint32_t size) {
     uint32_t tail_conflicts = compute_tail_conflicts<KT, VT>(kvs, size, 
                                                 hyper_para_.kSizeAmplification, 
@@ -112,8 +238,8 @@ private:
           ts.num_buckets_ ++;
           ts.num_data_bucket_ += node->entries_[i].bucket_->size_;
           ts.model_size_ += sizeof(Bucket<KT, VT>);
-          ts.index_size_ += sizeof(Bucket<KT, VT>) 
-                          + sizeof(KVT) * hyper_para_.max_bucket_size_;
+          ts.index_size_ += Bucket<KT, VT>::block_size(
+                              hyper_para_.max_bucket_size_);
           ts.sum_depth_ += (depth + 1) * node->entries_[i].bucket_->size_;
           tot_kvs += node->entries_[i].bucket_->size_;
           tot_conflicts += node->entries_[i].bucket_->size_ - 1;
@@ -127,7 +253,7 @@ private:
           is_leaf_node = false;
           // Find the duplicated child node pointers
           uint32_t j = i + 1;
-          for (; j < node->size_; ++ j, num_conflicts ++) {
+          for (; j < node->capacity_; ++ j, num_conflicts ++) {
             uint8_t type_j = node->entry_type(j);
             if (type_j != kNode 
                 || node->entries_[j].child_ != node->entries_[i].child_) {
@@ -147,11 +273,17 @@ private:
     } else {
       // Dense node
       ts.num_dense_nodes_ ++;
-      ts.num_data_dense_ ++;
       uint32_t tot_conflicts = 0;
-      for (uint32_t i = 1; i < node->size_; ++ i) {
-        if (!compare(node->entries_[i].kv_.first, 
-                      node->entries_[i - 1].kv_.first)) {
+      // Count the distinct keys in the occupied slots
+      for (uint32_t i = TNode<KT, VT>::dense_next(node->bitmap0_, 
+                          node->capacity_, 0), last = node->capacity_; 
+            i < node->capacity_; last = i, 
+            i = TNode<KT, VT>::dense_next(node->bitmap0_, node->capacity_, 
+                                          i + 1)) {
+        if (last == node->capacity_) {
+          ts.num_data_dense_ ++;
+        } else if (!compare(node->entries_[i].kv_.first, 
+                            node->entries_[last].kv_.first)) {
           ts.num_data_dense_ ++;
           tot_conflicts ++;
         }
@@ -160,6 +292,7 @@ private:
       ts.node_conflicts_ += tot_conflicts;
       ts.model_size_ += sizeof(TNode<KT, VT>);
       ts.index_size_ += sizeof(TNode<KT, VT>) 
+                      + sizeof(BIT_TYPE) * 2 * BIT_LEN(node->capacity_) 
                       + sizeof(Entry<KT, VT>) * node->capacity_;
       ts.num_leaf_nodes_ ++;
       ts.sum_depth_ += depth;
@@ -0,0 +1,251 @@
+#ifndef AFLI_FILE_H
+#define AFLI_FILE_H
+
+#include "afli/afli_nodes.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nfl {
+
+// The on-disk image of an AFLI. Every pointer of the tree is stored as the
+// byte offset of its target from the start of the file, so that the image is
+// served in place from a read-only mapping at any address and its pages are
+// shared by all processes that map it. Records are written in post-order and
+// the header at offset 0 holds the offset of the root record.
+const char kAFLIFileMagic[8] = {'A', 'F', 'L', 'I', 'M', 'A', 'P', '1'};
+// Every record starts at a multiple of kAFLIFileAlign bytes
+const uint64_t kAFLIFileAlign = 64;
+
+struct AFLIFileHeader {
+  char      magic_[8];
+  uint32_t  key_size_;
+  uint32_t  value_size_;
+  uint32_t  key_integer_;       // Whether the keys are integers and signed, 
+  uint32_t  key_signed_;        // which the key size alone does not tell.
+  uint32_t  max_bucket_size_;
+  uint32_t  aggregate_size_;
+  uint64_t  root_;              // The offset of the root record.
+  uint64_t  file_size_;
+  uint64_t  num_keys_;
+};
+
+template<typename KT, typename VT>
+union FileEntry {
+  uint64_t            offset_;  // The offset of a bucket or child record.
+  std::pair<KT, VT>   kv_;
+
+  FileEntry() { }
+};
+
+// A model node or a gapped dense node. Buckets are stored as their in-memory
+// blocks, which only address their keys and values relative to themselves.
+template<typename KT>
+struct FileNode {
+  LinearModel<KT>   model_;     // Unused by dense nodes.
+  uint32_t          is_model_;
+  uint32_t          size_;
+  uint32_t          capacity_;
+  uint32_t          size_sub_tree_;
+  uint64_t          bitmaps_;   // The offset of both bitmaps, 0 if none.
+  uint64_t          entries_;   // The offset of the entry array.
+};
+
+template<typename KT, typename VT>
+class AFLIFileWriter {
+typedef std::pair<KT, VT> KVT;
+private:
+  std::ofstream out_;
+  uint64_t      offset_;
+
+public:
+  explicit AFLIFileWriter(const std::string& path)
+    : out_(path, std::ios::binary | std::ios::trunc), offset_(0) {
+    assert_p(out_.is_open(), "Fail to open " + path);
+  }
+
+  void write(TNode<KT, VT>* root, const HyperParameter& hyper_para) {
+    AFLIFileHeader header;
+    std::memset(&header, 0, sizeof(AFLIFileHeader));
+    // Reserve the header, which is completed once the root is written
+    append(&header, sizeof(AFLIFileHeader));
+    std::memcpy(header.magic_, kAFLIFileMagic, sizeof(kAFLIFileMagic));
+    header.key_size_ = sizeof(KT);
+    header.value_size_ = sizeof(VT);
+    header.key_integer_ = std::numeric_limits<KT>::is_integer;
+    header.key_signed_ = std::numeric_limits<KT>::is_signed;
+    header.max_bucket_size_ = hyper_para.max_bucket_size_;
+    header.aggregate_size_ = hyper_para.aggregate_size_;
+    header.root_ = write_node(root);
+    header.file_size_ = offset_;
+    header.num_keys_ = root->size_sub_tree_;
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char*>(&header), sizeof(AFLIFileHeader));
+    out_.flush();
+    assert_p(out_.good(), "Fail to write the index file");
+  }
+
+private:
+  // Write the data at the next aligned offset and return that offset
+  uint64_t append(const void* data, uint64_t size) {
+    static const char zeros[kAFLIFileAlign] = { 0 };
+    uint64_t padding = (kAFLIFileAlign - offset_ % kAFLIFileAlign)
+                        % kAFLIFileAlign;
+    out_.write(zeros, padding);
+    offset_ += padding;
+    uint64_t start = offset_;
+    out_.write(static_cast<const char*>(data), size);
+    offset_ += size;
+    return start;
+  }
+
+  uint64_t write_node(TNode<KT, VT>* node) {
+    FileNode<KT> record;
+    std::memset(&record, 0, sizeof(FileNode<KT>));
+    record.size_ = node->size_;
+    record.capacity_ = node->capacity_;
+    record.size_sub_tree_ = node->size_sub_tree_;
+    std::vector<FileEntry<KT, VT>> entries(node->capacity_);
+    std::memset(entries.data(), 0, sizeof(FileEntry<KT, VT>) * node->capacity_);
+    if (node->model_ != nullptr) {
+      record.model_ = *node->model_;
+      record.is_model_ = 1;
+      for (uint32_t i = 0; i < node->capacity_; ++ i) {
+        uint8_t type = node->entry_type(i);
+        if (type == kData) {
+          entries[i].kv_ = node->entries_[i].kv_;
+        } else if (type == kBucket) {
+          Bucket<KT, VT>* bucket = node->entries_[i].bucket_;
+          entries[i].offset_ = append(bucket,
+                          Bucket<KT, VT>::block_size(bucket->capacity_));
+        } else if (type == kNode) {
+          // The slots of an aggregated run share one child record
+          if (i > 0 && node->entry_type(i - 1) == kNode
+              && node->entries_[i - 1].child_ == node->entries_[i].child_) {
+            entries[i].offset_ = entries[i - 1].offset_;
+          } else {
+            entries[i].offset_ = write_node(node->entries_[i].child_);
+          }
+        }
+      }
+    } else {
+      // The gaps hold the next key and are copied as they are
+      for (uint32_t i = 0; i < node->capacity_; ++ i) {
+        entries[i].kv_ = node->entries_[i].kv_;
+      }
+    }
+    if (node->bitmap0_ != nullptr) {
+      record.bitmaps_ = append(node->bitmap0_,
+                          sizeof(BIT_TYPE) * 2 * BIT_LEN(node->capacity_));
+    }
+    record.entries_ = append(entries.data(),
+                        sizeof(FileEntry<KT, VT>) * node->capacity_);
+    return append(&record, sizeof(FileNode<KT>));
+  }
+};
+
+// A read-only AFLI served from a mapped index file. Lookups read the mapping
+// directly, so nothing is deserialized when the file is opened and only the
+// pages on the lookup paths are ever loaded. The results point into the
+// mapping and must not be written through.
+template<typename KT, typename VT>
+class MappedAFLI {
+typedef std::pair<KT, VT> KVT;
+private:
+  const char*             base_;
+  uint64_t                length_;
+  const AFLIFileHeader*   header_;
+  const FileNode<KT>*     root_;
+
+public:
+  MappedAFLI() : base_(nullptr), length_(0), header_(nullptr),
+                  root_(nullptr) { }
+
+  ~MappedAFLI() {
+    if (base_ != nullptr) {
+      munmap(const_cast<char*>(base_), length_);
+    }
+  }
+
+  void open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    assert_p(fd >= 0, "Fail to open " + path);
+    struct stat st;
+    assert_p(fstat(fd, &st) == 0, "Fail to stat " + path);
+    length_ = st.st_size;
+    assert_p(length_ >= sizeof(AFLIFileHeader),
+              path + " is not an AFLI index file");
+    void* addr = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file open
+    ::close(fd);
+    assert_p(addr != MAP_FAILED, "Fail to map " + path);
+    // Lookups touch the pages at random, so read-ahead only wastes memory
+    madvise(addr, length_, MADV_RANDOM);
+    base_ = static_cast<const char*>(addr);
+    header_ = at<AFLIFileHeader>(0);
+    assert_p(std::memcmp(header_->magic_, kAFLIFileMagic,
+                          sizeof(kAFLIFileMagic)) == 0,
+              path + " is not an AFLI index file");
+    assert_p(header_->key_size_ == sizeof(KT)
+              && header_->value_size_ == sizeof(VT)
+              && header_->key_integer_ == std::numeric_limits<KT>::is_integer
+              && header_->key_signed_ == std::numeric_limits<KT>::is_signed,
+              "The key or value type does not match " + path);
+    assert_p(header_->file_size_ == length_, path + " is truncated");
+    root_ = at<FileNode<KT>>(header_->root_);
+  }
+
+  const AFLIFileHeader& header() const { return *header_; }
+
+  template<typename Equal = ApproxKeys>
+  ResultIterator<KT, VT> find(KT key) const {
+    const FileNode<KT>* node = root_;
+    while (node->is_model_) {
+      uint32_t idx = std::min(std::max(node->model_.predict(key), 0L),
+                              static_cast<int64_t>(node->capacity_ - 1));
+      uint32_t bit_len = BIT_LEN(node->capacity_);
+      const BIT_TYPE* bitmap0 = at<BIT_TYPE>(node->bitmaps_);
+      const BIT_TYPE* bitmap1 = bitmap0 + bit_len;
+      uint8_t type = (GET_BIT(bitmap1[BIT_IDX(idx)], BIT_POS(idx)) << 1)
+                      | GET_BIT(bitmap0[BIT_IDX(idx)], BIT_POS(idx));
+      const FileEntry<KT, VT>& entry =
+                                at<FileEntry<KT, VT>>(node->entries_)[idx];
+      if (type == kData && Equal::equal(entry.kv_.first, key)) {
+        return {const_cast<KVT*>(&entry.kv_)};
+      } else if (type == kBucket) {
+        return const_cast<Bucket<KT, VT>*>(
+                at<Bucket<KT, VT>>(entry.offset_))->template find<Equal>(key);
+      } else if (type == kNode) {
+        node = at<FileNode<KT>>(entry.offset_);
+      } else {
+        return {};
+      }
+    }
+    // A gapped dense node
+    if (node->capacity_ == 0) {
+      return {};
+    }
+    const FileEntry<KT, VT>* entries = at<FileEntry<KT, VT>>(node->entries_);
+    uint32_t idx = std::lower_bound(entries, entries + node->capacity_, key,
+                    [](const FileEntry<KT, VT>& kk, const KT k) {
+                      return kk.kv_.first < k;
+                    }) - entries;
+    idx = TNode<KT, VT>::dense_next(at<BIT_TYPE>(node->bitmaps_),
+                                    node->capacity_, idx);
+    if (idx < node->capacity_ && Equal::equal(entries[idx].kv_.first, key)) {
+      return {const_cast<KVT*>(&entries[idx].kv_)};
+    }
+    return {};
+  }
+
+private:
+  template<typename T>
+  inline const T* at(uint64_t offset) const {
+    return reinterpret_cast<const T*>(base_ + offset);
+  }
+};
+
+}
+#endif
@@ -1,8 +1,10 @@
 #ifndef AFLI_NODES_H
 #define AFLI_NODES_H
 
+#include "afli/allocator.h"
 #include "afli/buckets.h"
 #include "afli/conflicts.h"
+#include "afli/run_stats.h"
 #include "models/linear_model.h"
 #include "util/common.h"
 
@@ -21,6 +23,9 @@ namespace nfl {
 template<typename KT, typename VT>
 class TNode;
 
+template<typename KT, typename VT>
+class ConcurrentAFLI;
+
 struct HyperParameter {
   // Parameters
   uint32_t max_bucket_size_ = 6;
@@ -30,8 +35,28 @@ struct HyperParameter {
   const uint32_t kMinBucketSize = 1;
   const double kSizeAmplification = 2;
   const double kTailPercent = 0.99;
+  // A model node is retrained once it has seen kRetrainMinInserts inserts 
+  // and at least kRetrainInsertRatio of its keys since it was built, and its 
+  // expected lookup cost exceeds the one after the build by kRetrainCostRatio
+  const uint32_t kRetrainMinInserts = 64;
+  const double kRetrainInsertRatio = 0.25;
+  const double kRetrainCostRatio = 1.5;
+  // A model node with at least kCompactMinCapacity slots is rebuilt once its 
+  // capacity exceeds kCompactCapacityRatio times its keys
+  const uint32_t kCompactMinCapacity = 64;
+  const double kCompactCapacityRatio = 8;
+  // The share of occupied slots in a dense node after it is built and the 
+  // share above which it is rebuilt instead of inserting into a gap
+  const double kDenseInitDensity = 0.5;
+  const double kDenseMaxDensity = 0.8;
 };
 
+// The number of lookups whose descents find_batch interleaves
+const uint32_t kFindGroupSize = 16;
+// Child nodes with at least this many keys are built by their own OpenMP 
+// tasks during a parallel bulk load
+const uint32_t kParallelBuildSize = 1 << 12;
+
 enum EntryType {
   kNone = 0,
   kData = 1,
@@ -56,23 +81,47 @@ public:
   uint32_t            size_;
   uint32_t            capacity_;
   uint32_t            size_sub_tree_;
+  uint32_t            num_inserts_; // The inserts into the subtree since the 
+                                    // node was built.
+  uint64_t            depth_sum_;   // The sum of the levels of the keys in the 
+                                    // subtree relative to the node. Keys in 
+                                    // the node are at level 1, keys in its 
+                                    // buckets at level 2.
+  double              build_cost_;  // The average level after the build.
   uint8_t*            bitmap0_;     // The i-th bit indicates whether the i-th 
                                     // position has a bucket or a child node.
   uint8_t*            bitmap1_;     // The i-th bit indicates whether the i-th 
                                     // position is a bucket.
   Entry<KT, VT>*      entries_;     // The pointer array that stores the pointer 
                                     // of buckets or child nodes.
+  std::atomic<uint64_t> version_;   // The version for optimistic lock coupling 
+                                    // in ConcurrentAFLI. Odd if locked.
+  NodeAllocator*      alloc_;       // The allocator of the owning index.
 
 public:
   // Constructor and deconstructor
-  explicit TNode() : model_(nullptr), size_(0), capacity_(0), 
-                      size_sub_tree_(0), bitmap0_(nullptr), 
-                      bitmap1_(nullptr), entries_(nullptr) { }
+  explicit TNode(NodeAllocator* alloc) : model_(nullptr), size_(0), 
+                      capacity_(0), size_sub_tree_(0), num_inserts_(0), 
+                      depth_sum_(0), build_cost_(0), bitmap0_(nullptr), 
+                      bitmap1_(nullptr), entries_(nullptr), version_(0), 
+                      alloc_(alloc) { }
 
   ~TNode() {
     destory_self();
   }
 
+  static TNode<KT, VT>* create(NodeAllocator* alloc) {
+    SizeCounters::add(alloc->counters_.num_nodes_, 1);
+    return new (alloc->allocate(sizeof(TNode<KT, VT>))) TNode<KT, VT>(alloc);
+  }
+
+  static void destroy(TNode<KT, VT>* node) {
+    NodeAllocator* alloc = node->alloc_;
+    node->~TNode();
+    SizeCounters::add(alloc->counters_.num_nodes_, -1);
+    alloc->deallocate(node, sizeof(TNode<KT, VT>));
+  }
+
   // Get functions
   inline uint32_t size() const { return size_; }
 
@@ -80,6 +129,11 @@ public:
 
   inline uint32_t size_sub_tree() const { return size_sub_tree_; }
 
+  // The expected number of levels a lookup of a stored key visits
+  inline double lookup_cost() const {
+    return size_sub_tree_ == 0 ? 0 : depth_sum_ * 1. / size_sub_tree_;
+  }
+
   uint8_t entry_type(uint32_t idx) {
     uint32_t bit_idx = BIT_IDX(idx);
     uint32_t bit_pos = BIT_POS(idx);
@@ -89,6 +143,8 @@ public:
   }
 
 private:
+  friend class ConcurrentAFLI<KT, VT>;
+
   void set_entry_type(uint32_t idx, uint8_t type) {
     uint32_t bit_idx = BIT_IDX(idx);
     uint32_t bit_pos = BIT_POS(idx);
@@ -101,27 +157,37 @@ private:
   }
 
 public:
-  // User API interfaces
-  ResultIterator<KT, VT> find(KT key) {
+  // User API interfaces. The operations report their paths to the Stats 
+  // policy of the index, see run_stats.h.
+  template<typename Stats = NoRunStat, typename Equal = ApproxKeys>
+  ResultIterator<KT, VT> find(KT key, uint32_t depth=1) {
     if (model_ != nullptr) {
+      Stats::on_prediction();
       uint32_t idx = std::min(std::max(model_->predict(key), 0L), 
                               static_cast<int64_t>(capacity_ - 1));
       uint8_t type = entry_type(idx);
-      if (type == kData && compare(entries_[idx].kv_.first, key)) {
+      if (type == kData && Equal::equal(entries_[idx].kv_.first, key)) {
+        Stats::on_comparisons(1);
+        Stats::on_query(kAtModel, depth);
         return {&entries_[idx].kv_};
       } else if (type == kBucket) {
-        return entries_[idx].bucket_->find(key);
+        Bucket<KT, VT>* bucket = entries_[idx].bucket_;
+        Stats::on_comparisons(bucket->size_);
+        Stats::on_query(kAtBucket, depth + 1);
+        return bucket->template find<Equal>(key);
       } else if (type == kNode) {
-        return entries_[idx].child_->find(key);
+        return entries_[idx].child_->template find<Stats, Equal>(key, 
+                                                                depth + 1);
       } else {
+        Stats::on_comparisons(type == kData);
+        Stats::on_query(kAtModel, depth);
         return {};
       }
     } else {
-      uint32_t idx = std::lower_bound(entries_, entries_ + size_, key, 
-                      [](const Entry<KT, VT>& kk, const KT k) {
-                        return kk.kv_.first < k;
-                      }) - entries_;
-      if (idx < size_ && compare(entries_[idx].kv_.first, key)) {
+      Stats::on_comparisons(dense_comparisons(capacity_));
+      Stats::on_query(kAtDense, depth);
+      uint32_t idx = dense_lower_bound(entries_, bitmap0_, capacity_, key);
+      if (idx < capacity_ && Equal::equal(entries_[idx].kv_.first, key)) {
         return {&entries_[idx].kv_};
       } else {
         return {};
@@ -129,27 +195,140 @@ public:
     }
   }
 
+  // Look up n keys at once and store their results in order. The descents 
+  // of a group of keys run as interleaved state machines: every step issues 
+  // a prefetch for the memory that the next step of its key reads, and then 
+  // switches to another key, so that the cache misses of the group overlap.
+  template<typename Stats = NoRunStat, typename Equal = ApproxKeys>
+  void find_batch(const KT* keys, uint32_t n, ResultIterator<KT, VT>* results) {
+    enum Stage : uint8_t {
+      kLoadNode,      // The node is prefetched; prefetch its model.
+      kPredict,       // The model is prefetched; prefetch the slot.
+      kInspect,       // The slot is prefetched; dispatch on its type.
+      kProbeBucket,   // The bucket is prefetched; probe it.
+      kIdle
+    };
+    struct State {
+      TNode<KT, VT>*  node_;
+      uint32_t        key_idx_;
+      uint32_t        idx_;
+      uint32_t        depth_;
+      Stage           stage_;
+    };
+    State states[kFindGroupSize];
+    uint32_t num_states = std::min(n, kFindGroupSize);
+    uint32_t next_key = 0;
+    for (uint32_t i = 0; i < num_states; ++ i) {
+      states[i] = {this, next_key ++, 0, 1, kLoadNode};
+    }
+    uint32_t num_active = num_states;
+    while (num_active > 0) {
+      for (uint32_t i = 0; i < num_states; ++ i) {
+        State& st = states[i];
+        if (st.stage_ == kIdle) {
+          continue;
+        }
+        TNode<KT, VT>* node = st.node_;
+        KT key = keys[st.key_idx_];
+        bool done = false;
+        switch (st.stage_) {
+          case kLoadNode: {
+            if (node->model_ == nullptr) {
+              results[st.key_idx_] = node->template find<Stats, Equal>(
+                                                        key, st.depth_);
+              done = true;
+            } else {
+              __builtin_prefetch(node->model_);
+              st.stage_ = kPredict;
+            }
+            break;
+          }
+          case kPredict: {
+            Stats::on_prediction();
+            st.idx_ = std::min(std::max(node->model_->predict(key), 0L), 
+                              static_cast<int64_t>(node->capacity_ - 1));
+            __builtin_prefetch(&node->bitmap0_[BIT_IDX(st.idx_)]);
+            __builtin_prefetch(&node->bitmap1_[BIT_IDX(st.idx_)]);
+            __builtin_prefetch(&node->entries_[st.idx_]);
+            st.stage_ = kInspect;
+            break;
+          }
+          case kInspect: {
+            uint8_t type = node->entry_type(st.idx_);
+            Entry<KT, VT>& entry = node->entries_[st.idx_];
+            if (type == kData && Equal::equal(entry.kv_.first, key)) {
+              Stats::on_comparisons(1);
+              Stats::on_query(kAtModel, st.depth_);
+              results[st.key_idx_] = {&entry.kv_};
+              done = true;
+            } else if (type == kBucket) {
+              __builtin_prefetch(entry.bucket_);
+              st.stage_ = kProbeBucket;
+            } else if (type == kNode) {
+              __builtin_prefetch(entry.child_);
+              st.node_ = entry.child_;
+              st.depth_ ++;
+              st.stage_ = kLoadNode;
+            } else {
+              Stats::on_comparisons(type == kData);
+              Stats::on_query(kAtModel, st.depth_);
+              results[st.key_idx_] = {};
+              done = true;
+            }
+            break;
+          }
+          case kProbeBucket: {
+            Bucket<KT, VT>* bucket = node->entries_[st.idx_].bucket_;
+            Stats::on_comparisons(bucket->size_);
+            Stats::on_query(kAtBucket, st.depth_ + 1);
+            results[st.key_idx_] = bucket->template find<Equal>(key);
+            done = true;
+            break;
+          }
+          default:
+            break;
+        }
+        if (done) {
+          // Reuse the state for the next key that has not been looked up
+          if (next_key < n) {
+            st = {this, next_key ++, 0, 1, kLoadNode};
+          } else {
+            st.stage_ = kIdle;
+            num_active --;
+          }
+        }
+      }
+    }
+  }
+
+  template<typename Stats = NoRunStat, typename Equal = ApproxKeys>
   bool update(KVT kv) {
     if (model_ != nullptr) {
+      Stats::on_prediction();
       uint32_t idx = std::min(std::max(model_->predict(kv.first), 0L), 
-                              static_cast<int64_t>(size_ - 1));
+                              static_cast<int64_t>(capacity_ - 1));
       uint8_t type = entry_type(idx);
-      if (type == kData && compare(entries_[idx].kv_.first, kv.first)) {
+      if (type == kData && Equal::equal(entries_[idx].kv_.first, kv.first)) {
+        Stats::on_comparisons(1);
+        Stats::on_update(kAtModel);
         entries_[idx].kv_ = kv;
         return true;
       } else if (type == kBucket) {
-        return entries_[idx].bucket_->update(kv);
+        Stats::on_comparisons(entries_[idx].bucket_->size_);
+        Stats::on_update(kAtBucket);
+        return entries_[idx].bucket_->template update<Equal>(kv);
       } else if (type == kNode) {
-        return entries_[idx].child_->update(kv);
+        return entries_[idx].child_->template update<Stats, Equal>(kv);
       } else {
+        Stats::on_comparisons(type == kData);
+        Stats::on_update(kAtModel);
         return false;
       }
     } else {
-      uint32_t idx = std::lower_bound(entries_, entries_ + size_, kv.first, 
-                      [](const Entry<KT, VT>& kk, const KT k) {
-                        return kk.kv_.first < k;
-                      }) - entries_;
-      if (idx < size_ && compare(entries_[idx].kv_.first, kv.first)) {
+      Stats::on_comparisons(dense_comparisons(capacity_));
+      Stats::on_update(kAtDense);
+      uint32_t idx = dense_lower_bound(entries_, bitmap0_, capacity_, kv.first);
+      if (idx < capacity_ && Equal::equal(entries_[idx].kv_.first, kv.first)) {
         entries_[idx].kv_ = kv;
         return true;
       } else {
@@ -158,67 +337,44 @@ public:
     }
   }
 
-  uint32_t remove(KT key) {
-    if (model_ != nullptr) {
-      uint32_t idx = std::min(std::max(model_->predict(key), 0L), 
-                              static_cast<int64_t>(size_ - 1));
-      uint8_t type = entry_type(idx);
-      if (type == kData && compare(entries_[idx].kv_.first, key)) {
-        set_entry_type(idx, kNone);
-        size_ --;
-        size_sub_tree_ --;
-        return 1;
-      } else if (type == kBucket) {
-        uint32_t res = entries_[idx].bucket_->remove(key);
-        size_sub_tree_ -= res;
-        return res;
-      } else if (type == kNode) {
-        uint32_t res = entries_[idx].child_->remove(key);
-        size_sub_tree_ -= res;
-        return res;
-      } else {
-        return 0;
-      }
-    } else {
-      uint32_t idx = std::lower_bound(entries_, entries_ + size_, key, 
-                      [](const Entry<KT, VT>& kk, const KT k) {
-                        return kk.kv_.first < k;
-                      }) - entries_;
-      if (idx < size_ && compare(entries_[idx].kv_.first, key)) {
-        if (size_ > 1) {
-          for (uint32_t i = idx; i < size_ - 1; ++ i) {
-            if (entries_[i].kv_.first != key) {
-              break;
-            }
-            entries_[i].kv_ = entries_[i + 1].kv_;
-          }
-        }
-        size_ --;
-        size_sub_tree_ --;
-        return 1;
-      } else {
-        return 0;
-      }
-    }
+  template<typename Stats = NoRunStat, typename Equal = ApproxKeys>
+  uint32_t remove(KT key, uint32_t depth, const HyperParameter& hyper_para) {
+    int64_t delta;
+    return remove<Stats, Equal>(key, depth, hyper_para, delta);
   }
 
-  void insert(KVT kv, uint32_t depth, const HyperParameter& hyper_para) {
+  // Return how much the insert changed depth_sum_
+  template<typename Stats = NoRunStat>
+  int64_t insert(KVT kv, uint32_t depth, const HyperParameter& hyper_para) {
     size_sub_tree_ ++;
+    num_inserts_ ++;
     if (model_ != nullptr) {
+      if (need_retrain(hyper_para)) {
+        Stats::on_insert(kAtModel);
+        Stats::on_rebuild(size_sub_tree_);
+        return retrain(kv, depth, hyper_para);
+      }
+      Stats::on_prediction();
       uint32_t idx = std::min(std::max(model_->predict(kv.first), 0L), 
                               static_cast<int64_t>(capacity_ - 1));
       uint8_t type = entry_type(idx);
+      int64_t delta = 0;
       if (type == kNone) {
+        Stats::on_insert(kAtModel);
         set_entry_type(idx, kData);
         entries_[idx].kv_ = kv;
         size_ ++;
+        delta = 1;
       } else if (type == kData || type == kBucket) {
+        Stats::on_insert(kAtBucket);
         if (type == kData) {
           set_entry_type(idx, kBucket);
           KVT stored_kv = entries_[idx].kv_;
-          entries_[idx].bucket_ = new Bucket<KT, VT>(&stored_kv, 1, 
+          entries_[idx].bucket_ = Bucket<KT, VT>::create(alloc_, &stored_kv, 1, 
                                                   hyper_para.max_bucket_size_);
           size_ --;
+          // The stored key moves into the bucket
+          delta = 1;
         }
         bool success = entries_[idx].bucket_->insert(kv, 
                                                   hyper_para.max_bucket_size_);
@@ -227,65 +383,356 @@ public:
           uint32_t bucket_size = entries_[idx].bucket_->size_;
           KVT* kvs = new KVT[bucket_size + 1];
           for (uint32_t i = 0; i < bucket_size; ++ i) {
-            kvs[i] = entries_[idx].bucket_->data_[i];
+            kvs[i] = entries_[idx].bucket_->kv(i);
           }
           kvs[bucket_size] = kv;
           std::sort(kvs, kvs + bucket_size + 1, 
             [](auto const& a, auto const& b) {
               return a.first < b.first;
             });
+          Stats::on_rebuild(bucket_size + 1);
           // Clear entry
-          delete entries_[idx].bucket_;
+          Bucket<KT, VT>::destroy(alloc_, entries_[idx].bucket_);
           // Create child node
           set_entry_type(idx, kNode);
-          entries_[idx].child_ = new TNode<KT, VT>();
-          entries_[idx].child_->build(kvs, bucket_size + 1, depth + 1, 
-                                      hyper_para);
+          TNode<KT, VT>* child = TNode<KT, VT>::create(alloc_);
+          entries_[idx].child_ = child;
+          child->build(kvs, bucket_size + 1, depth + 1, hyper_para);
           delete[] kvs;
+          delta += static_cast<int64_t>(child->depth_sum_ + bucket_size + 1) 
+                    - 2 * bucket_size;
+        } else {
+          delta += 2;
         }
       } else {
-        entries_[idx].child_->insert(kv, depth + 1, hyper_para);
+        delta = entries_[idx].child_->template insert<Stats>(kv, depth + 1, 
+                                                              hyper_para) + 1;
       }
+      depth_sum_ += delta;
+      return delta;
     } else {
-      if (size_ < capacity_) {
-        uint32_t idx = std::lower_bound(entries_, entries_ + size_, kv.first, 
-                    [](const Entry<KT, VT>& kk, KT k) {
-                      return kk.kv_.first < k;
-                    }) - entries_;
-        for (int32_t i = size_; i > idx; -- i) {
-          entries_[i].kv_ = entries_[i - 1].kv_;
+      Stats::on_insert(kAtDense);
+      if (size_ + 1 <= capacity_ * hyper_para.kDenseMaxDensity) {
+        Stats::on_comparisons(dense_comparisons(capacity_));
+        dense_insert(kv);
+        size_ ++;
+        depth_sum_ ++;
+        return 1;
+      } else {
+        // Rebuild from the keys, which are already ordered. The node becomes 
+        // a model node if the keys admit a model, or a larger dense node.
+        Stats::on_rebuild(size_sub_tree_);
+        return retrain(kv, depth, hyper_para);
+      }
+    }
+  }
+
+private:
+  // Remove the key and set delta to how much depth_sum_ changed. Children 
+  // that drop to the bucket threshold are folded back into this node, and 
+  // sparse nodes are rebuilt to release their unused capacity.
+  template<typename Stats, typename Equal>
+  uint32_t remove(KT key, uint32_t depth, const HyperParameter& hyper_para, 
+                  int64_t& delta) {
+    uint32_t res = 0;
+    delta = 0;
+    if (model_ != nullptr) {
+      Stats::on_prediction();
+      uint32_t idx = std::min(std::max(model_->predict(key), 0L), 
+                              static_cast<int64_t>(capacity_ - 1));
+      uint8_t type = entry_type(idx);
+      if (type == kData && Equal::equal(entries_[idx].kv_.first, key)) {
+        Stats::on_comparisons(1);
+        Stats::on_remove(kAtModel);
+        set_entry_type(idx, kNone);
+        size_ --;
+        res = 1;
+        delta = -1;
+      } else if (type == kBucket) {
+        Bucket<KT, VT>* bucket = entries_[idx].bucket_;
+        Stats::on_comparisons(bucket->size_);
+        Stats::on_remove(kAtBucket);
+        res = bucket->template remove<Equal>(key);
+        if (res > 0) {
+          delta = -2;
+          if (bucket->size_ <= 1) {
+            // Turn the bucket back into a data slot or an empty one
+            if (bucket->size_ == 1) {
+              set_entry_type(idx, kData);
+              entries_[idx].kv_ = bucket->kv(0);
+              size_ ++;
+              delta -= 1;
+            } else {
+              set_entry_type(idx, kNone);
+            }
+            Bucket<KT, VT>::destroy(alloc_, bucket);
+          }
         }
-        entries_[idx].kv_ = kv;
+      } else if (type == kNode) {
+        TNode<KT, VT>* child = entries_[idx].child_;
+        res = child->template remove<Stats, Equal>(key, depth + 1, 
+                                                    hyper_para, delta);
+        if (res > 0) {
+          delta -= 1;
+          if (child->size_sub_tree_ <= hyper_para.max_bucket_size_) {
+            Stats::on_rebuild(child->size_sub_tree_);
+            delta += fold_child(idx, hyper_para);
+            alloc_->release_unused();
+          }
+        }
+      } else {
+        Stats::on_comparisons(type == kData);
+        Stats::on_remove(kAtModel);
+      }
+    } else {
+      Stats::on_comparisons(dense_comparisons(capacity_));
+      Stats::on_remove(kAtDense);
+      uint32_t idx = dense_lower_bound(entries_, bitmap0_, capacity_, key);
+      if (idx < capacity_ && Equal::equal(entries_[idx].kv_.first, key)) {
+        // The key stays in the gap, which keeps the array ordered
+        SET_BIT_ZERO(bitmap0_[BIT_IDX(idx)], BIT_POS(idx));
+        size_ --;
+        res = 1;
+        delta = -1;
+      }
+    }
+    if (res > 0) {
+      size_sub_tree_ --;
+      depth_sum_ += delta;
+      if (need_compact(hyper_para)) {
+        Stats::on_rebuild(size_sub_tree_);
+        delta += compact(depth, hyper_para);
+        alloc_->release_unused();
+      }
+    }
+    return res;
+  }
+
+  // Move the keys of the child at slot idx into the run of slots that share 
+  // it, as data entries and buckets. The parent's model routed every key of 
+  // the child through one of these slots, so they fit there, and no slot 
+  // gets more than max_bucket_size_ keys. Return how much depth_sum_ changed.
+  int64_t fold_child(uint32_t idx, const HyperParameter& hyper_para) {
+    TNode<KT, VT>* child = entries_[idx].child_;
+    uint32_t lo = idx;
+    uint32_t hi = idx + 1;
+    while (lo > 0 && entry_type(lo - 1) == kNode 
+          && entries_[lo - 1].child_ == child) {
+      lo --;
+    }
+    while (hi < capacity_ && entry_type(hi) == kNode 
+          && entries_[hi].child_ == child) {
+      hi ++;
+    }
+    std::vector<KVT> kvs;
+    child->collect(kvs);
+    int64_t old_sum = child->depth_sum_ + child->size_sub_tree_;
+    TNode<KT, VT>::destroy(child);
+    for (uint32_t i = lo; i < hi; ++ i) {
+      set_entry_type(i, kNone);
+    }
+    int64_t new_sum = 0;
+    for (const KVT& kv : kvs) {
+      uint32_t p = std::min(std::max(model_->predict(kv.first), 0L), 
+                            static_cast<int64_t>(capacity_ - 1));
+      uint8_t type = entry_type(p);
+      if (type == kNone) {
+        set_entry_type(p, kData);
+        entries_[p].kv_ = kv;
         size_ ++;
+        new_sum += 1;
       } else {
-        // Copy data for rebuilding
-        uint32_t node_size = size_;
-        KVT* kvs = new KVT[node_size + 1];
-        for (uint32_t i = 0; i < size_; ++ i) {
-          kvs[i] = entries_[i].kv_;
+        if (type == kData) {
+          set_entry_type(p, kBucket);
+          KVT stored_kv = entries_[p].kv_;
+          entries_[p].bucket_ = Bucket<KT, VT>::create(alloc_, &stored_kv, 1, 
+                                                  hyper_para.max_bucket_size_);
+          size_ --;
+          new_sum += 1;
         }
-        kvs[node_size] = kv;
-        std::sort(kvs, kvs + node_size + 1, 
-          [](auto const& a, auto const& b) {
-            return a.first < b.first;
-          });
-        // Clear entry
-        destory_self();
-        // Create child node
-        build(kvs, node_size + 1, depth, hyper_para);
-        delete[] kvs;
+        entries_[p].bucket_->insert(kv, hyper_para.max_bucket_size_);
+        new_sum += 2;
       }
     }
+    return new_sum - old_sum;
+  }
+
+  // Whether the keys left in the node are too few for its capacity
+  bool need_compact(const HyperParameter& hyper_para) const {
+    return capacity_ >= hyper_para.kCompactMinCapacity 
+          && capacity_ > size_sub_tree_ * hyper_para.kCompactCapacityRatio;
+  }
+
+  // Rebuild the node for its remaining keys. Return how much depth_sum_ 
+  // changed.
+  int64_t compact(uint32_t depth, const HyperParameter& hyper_para) {
+    uint64_t depth_sum = depth_sum_;
+    std::vector<KVT> kvs;
+    collect(kvs);
+    destory_self();
+    if (kvs.empty()) {
+      build_dense_node(nullptr, 0, depth, hyper_para);
+    } else {
+      build(kvs.data(), kvs.size(), depth, hyper_para);
+    }
+    return static_cast<int64_t>(depth_sum_) - depth_sum;
   }
 
+  // Append the key-value pairs of the subtree to kvs in key order
+  void collect(std::vector<KVT>& kvs) {
+    kvs.reserve(kvs.size() + size_sub_tree_);
+    std::vector<typename ForwardIterator<KT, VT>::Frame> path;
+    for (auto it = first(path); !it.is_end(); it = next(path)) {
+      kvs.push_back(it.kv());
+    }
+  }
+
+  // Whether the inserts since the last build made the expected lookup cost 
+  // of the subtree grow enough to pay for rebuilding it
+  bool need_retrain(const HyperParameter& hyper_para) const {
+    return num_inserts_ >= hyper_para.kRetrainMinInserts 
+          && num_inserts_ >= size_sub_tree_ * hyper_para.kRetrainInsertRatio 
+          && depth_sum_ > size_sub_tree_ * build_cost_ 
+                          * hyper_para.kRetrainCostRatio;
+  }
+
+  // Rebuild the subtree from its keys and the new key with a refitted model. 
+  // Return how much depth_sum_ changed.
+  int64_t retrain(KVT kv, uint32_t depth, const HyperParameter& hyper_para) {
+    uint64_t depth_sum = depth_sum_;
+    std::vector<KVT> kvs;
+    collect(kvs);
+    kvs.insert(std::upper_bound(kvs.begin(), kvs.end(), kv, 
+                [](const KVT& a, const KVT& b) {
+                  return a.first < b.first;
+                }), kv);
+    destory_self();
+    build(kvs.data(), kvs.size(), depth, hyper_para);
+    return static_cast<int64_t>(depth_sum_) - depth_sum;
+  }
+
+public:
+  ForwardIterator<KT, VT> lower_bound(KT key) {
+    ForwardIterator<KT, VT> it;
+    it.cur_ = seek(key, it.path_);
+    return it;
+  }
+
+  ForwardIterator<KT, VT> begin() {
+    ForwardIterator<KT, VT> it;
+    it.cur_ = first(it.path_);
+    return it;
+  }
+
+  // Position the path at the first key that is not less than the given key
+  // and return it, or an end iterator if there is no such key in the subtree
+  ResultIterator<KT, VT> seek(KT key, std::vector<typename ForwardIterator<KT, VT>::Frame>& path) {
+    TNode<KT, VT>* node = this;
+    while (node->model_ != nullptr) {
+      uint32_t idx = std::min(std::max(node->model_->predict(key), 0L), 
+                              static_cast<int64_t>(node->capacity_ - 1));
+      uint8_t type = node->entry_type(idx);
+      if (type == kData) {
+        path.push_back({node, node->entries_[idx].kv_.first < key ? idx + 1 
+                                                                  : idx, 0});
+        return settle(path);
+      } else if (type == kBucket) {
+        path.push_back({node, idx, 
+                        node->entries_[idx].bucket_->lower_bound(key)});
+        return settle(path);
+      } else if (type == kNode) {
+        path.push_back({node, idx, 0});
+        node = node->entries_[idx].child_;
+      } else {
+        path.push_back({node, idx, 0});
+        return settle(path);
+      }
+    }
+    uint32_t idx = dense_lower_bound(node->entries_, node->bitmap0_, 
+                                    node->capacity_, key);
+    path.push_back({node, idx, 0});
+    return settle(path);
+  }
+
+  // Position the path at the smallest key in the subtree
+  ResultIterator<KT, VT> first(std::vector<typename ForwardIterator<KT, VT>::Frame>& path) {
+    path.push_back({this, 0, 0});
+    return settle(path);
+  }
+
+  // Move the path from its current key to the next one in key order
+  static ResultIterator<KT, VT> next(std::vector<typename ForwardIterator<KT, VT>::Frame>& path) {
+    auto& frame = path.back();
+    TNode<KT, VT>* node = frame.node_;
+    if (node->model_ != nullptr 
+        && node->entry_type(frame.pos_) == kBucket) {
+      frame.sub_pos_ ++;
+    } else {
+      frame.pos_ ++;
+    }
+    return settle(path);
+  }
+
+private:
+  // Walk forward from the position at the top of the path until it points 
+  // to a key. Exhausted nodes are popped and their parents skip over the 
+  // whole run of slots that share the child.
+  static ResultIterator<KT, VT> settle(std::vector<typename ForwardIterator<KT, VT>::Frame>& path) {
+    while (!path.empty()) {
+      auto& frame = path.back();
+      TNode<KT, VT>* node = frame.node_;
+      if (node->model_ == nullptr) {
+        frame.pos_ = dense_next(node->bitmap0_, node->capacity_, frame.pos_);
+        if (frame.pos_ < node->capacity_) {
+          return &node->entries_[frame.pos_].kv_;
+        }
+      } else {
+        bool descend = false;
+        for (; frame.pos_ < node->capacity_; ++ frame.pos_, 
+                                              frame.sub_pos_ = 0) {
+          uint8_t type = node->entry_type(frame.pos_);
+          if (type == kData) {
+            return &node->entries_[frame.pos_].kv_;
+          } else if (type == kBucket) {
+            Bucket<KT, VT>* bucket = node->entries_[frame.pos_].bucket_;
+            if (frame.sub_pos_ < bucket->size_) {
+              return bucket->at(frame.sub_pos_);
+            }
+          } else if (type == kNode) {
+            descend = true;
+            break;
+          }
+        }
+        if (descend) {
+          path.push_back({node->entries_[frame.pos_].child_, 0, 0});
+          continue;
+        }
+      }
+      path.pop_back();
+      if (!path.empty()) {
+        auto& parent = path.back();
+        TNode<KT, VT>* child = parent.node_->entries_[parent.pos_].child_;
+        while (parent.pos_ < parent.node_->capacity_ 
+              && parent.node_->entry_type(parent.pos_) == kNode 
+              && parent.node_->entries_[parent.pos_].child_ == child) {
+          parent.pos_ ++;
+        }
+        parent.sub_pos_ = 0;
+      }
+    }
+    return {};
+  }
+
+public:
   void destory_self() {    
     if (model_ != nullptr) {
-      delete model_;
+      SizeCounters::add(alloc_->counters_.num_models_, -1);
+      alloc_->deallocate(model_, sizeof(LinearModel<KT>));
       model_ = nullptr;
       for (uint32_t i = 0; i < capacity_; ++ i) {
         uint8_t type_i = entry_type(i);
         if (type_i == kBucket) {
-          delete entries_[i].bucket_;
+          Bucket<KT, VT>::destroy(alloc_, entries_[i].bucket_);
         } else if (type_i == kNode) {
           uint32_t j = i;
           for (; j < capacity_; ++ j) {
@@ -294,17 +741,19 @@ public:
               break;
             }
           }
-          delete entries_[i].child_;
+          TNode<KT, VT>::destroy(entries_[i].child_);
           i = j - 1;
         }
       }
-      delete[] bitmap0_;
+    }
+    if (bitmap0_ != nullptr) {
+      // Both bitmaps share one block
+      alloc_->deallocate(bitmap0_, sizeof(BIT_TYPE) * 2 * BIT_LEN(capacity_));
       bitmap0_ = nullptr;
-      delete[] bitmap1_;
       bitmap1_ = nullptr;
     }
     if (entries_ != nullptr) {
-      delete[] entries_;
+      alloc_->deallocate(entries_, sizeof(Entry<KT, VT>) * capacity_);
       entries_ = nullptr;
     }
     size_ = 0;
@@ -312,88 +761,280 @@ public:
     size_sub_tree_ = 0;
   }
 
+  // A dense node keeps its keys ordered in a gapped array. bitmap0_ marks 
+  // the occupied slots, and every gap holds a key between the keys of its 
+  // occupied neighbours, so the whole array stays sorted for binary search 
+  // and an insert only shifts the keys up to the nearest gap.
   void build_dense_node(const KVT* kvs, uint32_t size, uint32_t depth, 
-                        uint32_t capacity) {
+                        const HyperParameter& hyper_para) {
     model_ = nullptr;
     size_ = size;
-    capacity_ = capacity;
+    capacity_ = std::max(size + hyper_para.max_bucket_size_, 
+                static_cast<uint32_t>(size / hyper_para.kDenseInitDensity));
     size_sub_tree_ = size;
-    entries_ = new Entry<KT, VT>[capacity_];
-    for (uint32_t i = 0; i < size; ++ i) {
-      entries_[i].kv_ = kvs[i];
+    num_inserts_ = 0;
+    depth_sum_ = size;
+    build_cost_ = 1;
+    uint32_t bit_len = BIT_LEN(capacity_);
+    bitmap0_ = static_cast<BIT_TYPE*>(
+                alloc_->allocate(sizeof(BIT_TYPE) * 2 * bit_len));
+    bitmap1_ = bitmap0_ + bit_len;
+    memset(bitmap0_, 0, sizeof(BIT_TYPE) * 2 * bit_len);
+    entries_ = static_cast<Entry<KT, VT>*>(
+                alloc_->allocate(sizeof(Entry<KT, VT>) * capacity_));
+    // Spread the keys evenly and fill each gap with the next key
+    KVT fill = size > 0 ? kvs[size - 1] : KVT();
+    for (uint32_t i = capacity_, k = size; i > 0; -- i) {
+      if (k > 0 && (k - 1) * static_cast<uint64_t>(capacity_) / size 
+                    == i - 1) {
+        fill = kvs[-- k];
+        SET_BIT_ONE(bitmap0_[BIT_IDX(i - 1)], BIT_POS(i - 1));
+      }
+      entries_[i - 1].kv_ = fill;
+    }
+  }
+
+  static inline bool dense_occupied(const BIT_TYPE* bitmap, uint32_t pos) {
+    return GET_BIT(bitmap[BIT_IDX(pos)], BIT_POS(pos));
+  }
+
+  // Return the first occupied slot at or after pos, or capacity
+  static uint32_t dense_next(const BIT_TYPE* bitmap, uint32_t capacity, 
+                              uint32_t pos) {
+    while (pos < capacity && !dense_occupied(bitmap, pos)) {
+      if (BIT_POS(pos) == 0 && bitmap[BIT_IDX(pos)] == 0) {
+        pos += BIT_SIZE;
+      } else {
+        pos ++;
+      }
     }
+    return std::min(pos, capacity);
+  }
+
+  // Return the first occupied slot whose key is not less than the key, or 
+  // capacity. The arguments are passed explicitly so that optimistic readers 
+  // search one consistent snapshot of the node.
+  static uint32_t dense_lower_bound(const Entry<KT, VT>* entries, 
+                                    const BIT_TYPE* bitmap, uint32_t capacity, 
+                                    KT key) {
+    uint32_t pos = std::lower_bound(entries, entries + capacity, key, 
+                    [](const Entry<KT, VT>& kk, const KT k) {
+                      return kk.kv_.first < k;
+                    }) - entries;
+    return dense_next(bitmap, capacity, pos);
+  }
+
+  // The key comparisons of dense_lower_bound, i.e., the binary search steps 
+  // plus the check of the slot it returns
+  static inline uint32_t dense_comparisons(uint32_t capacity) {
+    return capacity == 0 ? 0 : 33 - __builtin_clz(capacity);
+  }
+
+  // Place the key into a dense node that has at least one gap. The key goes 
+  // into a gap next to its lower bound if there is one; otherwise the keys 
+  // between the lower bound and the nearest gap, searched with doubling 
+  // steps in both directions, move one slot towards it.
+  void dense_insert(KVT kv) {
+    uint32_t pos = std::lower_bound(entries_, entries_ + capacity_, kv.first, 
+                    [](const Entry<KT, VT>& kk, const KT k) {
+                      return kk.kv_.first < k;
+                    }) - entries_;
+    uint32_t slot;
+    if (pos < capacity_ && !dense_occupied(bitmap0_, pos)) {
+      slot = pos;
+    } else if (pos > 0 && !dense_occupied(bitmap0_, pos - 1)) {
+      slot = pos - 1;
+    } else {
+      // Scan windows of doubling size on both sides of the lower bound
+      int64_t p = pos;
+      int64_t left = -1;
+      int64_t right = capacity_;
+      for (int64_t lo = 0, hi = 1; left < 0 && right == capacity_ 
+            && (p + lo < capacity_ || p - 1 - lo >= 0); lo = hi, hi <<= 1) {
+        for (int64_t d = lo; d < hi && p + d < capacity_; ++ d) {
+          if (!dense_occupied(bitmap0_, p + d)) {
+            right = p + d;
+            break;
+          }
+        }
+        for (int64_t d = lo; d < hi && p - 1 - d >= 0; ++ d) {
+          if (!dense_occupied(bitmap0_, p - 1 - d)) {
+            left = p - 1 - d;
+            break;
+          }
+        }
+      }
+      if (right < capacity_ && (left < 0 || right - p <= p - 1 - left)) {
+        // Move the keys in [pos, right) one slot to the right
+        for (int64_t i = right; i > p; -- i) {
+          entries_[i].kv_ = entries_[i - 1].kv_;
+        }
+        slot = pos;
+        SET_BIT_ONE(bitmap0_[BIT_IDX(right)], BIT_POS(right));
+      } else {
+        // Move the keys in (left, pos) one slot to the left
+        for (int64_t i = left; i + 1 < p; ++ i) {
+          entries_[i].kv_ = entries_[i + 1].kv_;
+        }
+        slot = pos - 1;
+        SET_BIT_ONE(bitmap0_[BIT_IDX(left)], BIT_POS(left));
+      }
+    }
+    entries_[slot].kv_ = kv;
+    SET_BIT_ONE(bitmap0_[BIT_IDX(slot)], BIT_POS(slot));
   }
 
   void build(const KVT* kvs, uint32_t size, uint32_t depth, 
               const HyperParameter& hyper_para) {
+    model_ = new (alloc_->allocate(sizeof(LinearModel<KT>))) LinearModel<KT>();
+    SizeCounters::add(alloc_->counters_.num_models_, 1);
     ConflictsInfo* ci = build_linear_model(kvs, size, model_, 
                                           hyper_para.kSizeAmplification);
     if (ci == nullptr) {
-      build_dense_node(kvs, size, depth, size + hyper_para.max_bucket_size_);
+      SizeCounters::add(alloc_->counters_.num_models_, -1);
+      alloc_->deallocate(model_, sizeof(LinearModel<KT>));
+      build_dense_node(kvs, size, depth, hyper_para);
     } else {
       // Allocate memory for the node
       uint32_t bit_len = BIT_LEN(ci->max_size_);
       capacity_ = ci->max_size_;
       size_ = 0;
       size_sub_tree_ = size;
-      bitmap0_ = new BIT_TYPE[bit_len];
-      bitmap1_ = new BIT_TYPE[bit_len];
-      entries_ = new Entry<KT, VT>[ci->max_size_];
-      memset(bitmap0_, 0, sizeof(BIT_TYPE) * bit_len);
-      memset(bitmap1_, 0, sizeof(BIT_TYPE) * bit_len);
-      // Recursively build the node
-      for (uint32_t i = 0, j = 0; i < ci->num_conflicts_; ++ i) {
-        uint32_t p = ci->positions_[i];
-        uint32_t c = ci->conflicts_[i];
-        if (c == 0) {
-          continue;
-        } else if (c == 1) {
-          set_entry_type(p, kData);
-          entries_[p].kv_ = kvs[j];
-          size_ ++;
-          j = j + c;
-        } else if (c <= hyper_para.max_bucket_size_) {
-          set_entry_type(p, kBucket);
-          entries_[p].bucket_ = new Bucket<KT, VT>(kvs + j, c, 
-                                                  hyper_para.max_bucket_size_);
-          j = j + c;
-        } else {
-          uint32_t k = i + 1;
-          uint32_t seg_size = c;
-          uint32_t end = hyper_para.aggregate_size_ == 0 ? ci->num_conflicts_ 
-                          : std::min(k + hyper_para.aggregate_size_, 
-                                    ci->num_conflicts_);
-          while (k < end && ci->positions_[k] - ci->positions_[k - 1] == 1 
-                  && ci->conflicts_[k] > hyper_para.max_bucket_size_ + 1) {
-            seg_size += ci->conflicts_[k];
-            k ++;
-          }
-          if (seg_size == size) {
-            // All conflicted positions are aggregated in one child node 
-            // So we build a node for each conflicted position
-            for (uint32_t u = i; u < k; ++ u) {
-              uint32_t p_k = ci->positions_[u];
-              uint32_t c_k = ci->conflicts_[u];
-              set_entry_type(p_k, kNode);
-              entries_[p_k].child_ = new TNode<KT, VT>();
-              entries_[p_k].child_->build(kvs + j, c_k, depth + 1, hyper_para);
-              j = j + c_k;
-            }
-          } else {
-            set_entry_type(p, kNode);
-            entries_[p].child_ = new TNode<KT, VT>();
-            entries_[p].child_->build(kvs + j, seg_size, depth + 1, hyper_para);
-            for (uint32_t u = i; u < k; ++ u) {
-              uint32_t p_k = ci->positions_[u];
-              set_entry_type(p_k, kNode);
-              entries_[p_k].child_ = entries_[p].child_;
+      num_inserts_ = 0;
+      depth_sum_ = 0;
+      bitmap0_ = static_cast<BIT_TYPE*>(
+                  alloc_->allocate(sizeof(BIT_TYPE) * 2 * bit_len));
+      bitmap1_ = bitmap0_ + bit_len;
+      entries_ = static_cast<Entry<KT, VT>*>(
+                  alloc_->allocate(sizeof(Entry<KT, VT>) * capacity_));
+      memset(bitmap0_, 0, sizeof(BIT_TYPE) * 2 * bit_len);
+      uint32_t num_tasks = num_fit_tasks(size);
+      if (num_tasks == 1) {
+        size_ = build_entries(kvs, size, ci, 0, ci->num_conflicts_, 0, depth, 
+                              hyper_para);
+      } else {
+        // Split the positions into ranges that are filled by parallel tasks. 
+        // A range never starts inside an aggregated child or in the bitmap 
+        // byte where the previous range ends.
+        std::vector<uint32_t> begins(num_tasks + 1, ci->num_conflicts_);
+        std::vector<uint32_t> offsets(num_tasks + 1, size);
+        std::vector<uint32_t> sizes(num_tasks, 0);
+        begins[0] = offsets[0] = 0;
+        for (uint32_t t = 1, i = 0, j = 0; t < num_tasks; ++ t) {
+          uint32_t target = static_cast<uint64_t>(ci->num_conflicts_) * t 
+                            / num_tasks;
+          for (; i < ci->num_conflicts_; j += ci->conflicts_[i ++]) {
+            if (i >= std::max(target, 1u) 
+                && ci->conflicts_[i] <= hyper_para.max_bucket_size_ + 1
+                && BIT_IDX(ci->positions_[i]) 
+                    != BIT_IDX(ci->positions_[i - 1])) {
+              break;
             }
-            j = j + seg_size;
           }
-          i = k - 1;
+          begins[t] = i;
+          offsets[t] = j;
+        }
+        #pragma omp taskloop grainsize(1) shared(begins, offsets, sizes, hyper_para)
+        for (uint32_t t = 0; t < num_tasks; ++ t) {
+          sizes[t] = build_entries(kvs, size, ci, begins[t], begins[t + 1], 
+                                    offsets[t], depth, hyper_para);
+        }
+        for (uint32_t t = 0; t < num_tasks; ++ t) {
+          size_ += sizes[t];
         }
       }
       delete ci;
+      // The node is complete only when all its children are
+      #pragma omp taskwait
+      build_cost_ = depth_sum_ * 1. / size;
+    }
+  }
+
+private:
+  // Fill the entries of the conflicting positions [begin, end) whose keys 
+  // start at kvs[j], and return the number of data entries. The levels of 
+  // the keys are added to depth_sum_, atomically since the ranges and the 
+  // children may be built by parallel tasks.
+  uint32_t build_entries(const KVT* kvs, uint32_t size, const ConflictsInfo* ci, 
+                        uint32_t begin, uint32_t end, uint32_t j, 
+                        uint32_t depth, const HyperParameter& hyper_para) {
+    uint32_t num_data = 0;
+    uint64_t depth_sum = 0;
+    // Recursively build the node
+    for (uint32_t i = begin; i < end; ++ i) {
+      uint32_t p = ci->positions_[i];
+      uint32_t c = ci->conflicts_[i];
+      if (c == 0) {
+        continue;
+      } else if (c == 1) {
+        set_entry_type(p, kData);
+        entries_[p].kv_ = kvs[j];
+        num_data ++;
+        depth_sum ++;
+        j = j + c;
+      } else if (c <= hyper_para.max_bucket_size_) {
+        set_entry_type(p, kBucket);
+        entries_[p].bucket_ = Bucket<KT, VT>::create(alloc_, kvs + j, c, 
+                                                hyper_para.max_bucket_size_);
+        depth_sum += 2 * c;
+        j = j + c;
+      } else {
+        uint32_t k = i + 1;
+        uint32_t seg_size = c;
+        uint32_t seg_end = hyper_para.aggregate_size_ == 0 ? end 
+                          : std::min(k + hyper_para.aggregate_size_, end);
+        while (k < seg_end && ci->positions_[k] - ci->positions_[k - 1] == 1 
+                && ci->conflicts_[k] > hyper_para.max_bucket_size_ + 1) {
+          seg_size += ci->conflicts_[k];
+          k ++;
+        }
+        if (seg_size == size) {
+          // All conflicted positions are aggregated in one child node 
+          // So we build a node for each conflicted position
+          for (uint32_t u = i; u < k; ++ u) {
+            uint32_t p_k = ci->positions_[u];
+            uint32_t c_k = ci->conflicts_[u];
+            set_entry_type(p_k, kNode);
+            entries_[p_k].child_ = TNode<KT, VT>::create(alloc_);
+            build_child(entries_[p_k].child_, kvs + j, c_k, depth + 1, 
+                        hyper_para);
+            j = j + c_k;
+          }
+        } else {
+          set_entry_type(p, kNode);
+          entries_[p].child_ = TNode<KT, VT>::create(alloc_);
+          build_child(entries_[p].child_, kvs + j, seg_size, depth + 1, 
+                      hyper_para);
+          for (uint32_t u = i; u < k; ++ u) {
+            uint32_t p_k = ci->positions_[u];
+            set_entry_type(p_k, kNode);
+            entries_[p_k].child_ = entries_[p].child_;
+          }
+          j = j + seg_size;
+        }
+        i = k - 1;
+      }
+    }
+    #pragma omp atomic
+    depth_sum_ += depth_sum;
+    return num_data;
+  }
+
+  // Build a child as a deferred task if it is large. Outside a parallel 
+  // region the task runs immediately.
+  void build_child(TNode<KT, VT>* child, const KVT* kvs, uint32_t size, 
+                  uint32_t depth, const HyperParameter& hyper_para) {
+    if (size >= kParallelBuildSize) {
+      #pragma omp task shared(hyper_para)
+      {
+        child->build(kvs, size, depth, hyper_para);
+        #pragma omp atomic
+        depth_sum_ += child->depth_sum_ + size;
+      }
+    } else {
+      child->build(kvs, size, depth, hyper_para);
+      #pragma omp atomic
+      depth_sum_ += child->depth_sum_ + size;
     }
   }
 
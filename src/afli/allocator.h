@@ -0,0 +1,290 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include "util/common.h"
+
+namespace nfl {
+
+// The sizes of one index, kept up to date as its memory is allocated and 
+// freed, so that they are known without walking the tree. The counters are 
+// relaxed atomics since several threads may build or modify one index.
+struct SizeCounters {
+  std::atomic<int64_t> bytes_;        // The live bytes of the index.
+  std::atomic<int64_t> num_nodes_;    // Model and dense nodes.
+  std::atomic<int64_t> num_models_;
+  std::atomic<int64_t> num_buckets_;
+
+  SizeCounters() : bytes_(0), num_nodes_(0), num_models_(0), 
+                    num_buckets_(0) { }
+
+  static inline void add(std::atomic<int64_t>& counter, int64_t delta) {
+    counter.fetch_add(delta, std::memory_order_relaxed);
+  }
+};
+
+// The memory of the nodes, models, bitmaps, entry arrays and buckets of one 
+// index. The index picks the implementation as a policy and every TNode keeps 
+// a pointer to it, so the choice only costs a virtual call per allocation.
+class NodeAllocator {
+public:
+  SizeCounters counters_;
+
+  virtual ~NodeAllocator() { }
+
+  void* allocate(size_t size) {
+    SizeCounters::add(counters_.bytes_, size);
+    return allocate_block(size);
+  }
+
+  void deallocate(void* ptr, size_t size) {
+    SizeCounters::add(counters_.bytes_, -static_cast<int64_t>(size));
+    deallocate_block(ptr, size);
+  }
+
+  // Whether destroying the allocator releases all memory it handed out, so 
+  // that the index does not need to walk the tree to free it
+  virtual bool bulk_release() const = 0;
+
+  // Prepare for concurrent calls from the threads of an OpenMP team of the 
+  // given size. Must not run concurrently with other calls.
+  virtual void reserve_threads(uint32_t num_threads) { }
+
+  // Give memory that is no longer used back to the heap, e.g., after nodes 
+  // shrank. Must not run concurrently with other calls.
+  virtual void release_unused() { }
+
+protected:
+  virtual void* allocate_block(size_t size) = 0;
+
+  virtual void deallocate_block(void* ptr, size_t size) = 0;
+};
+
+// Plain heap allocation. Thread-safe.
+class HeapAllocator : public NodeAllocator {
+public:
+  bool bulk_release() const override { return false; }
+
+protected:
+  void* allocate_block(size_t size) override {
+    return ::operator new(size);
+  }
+
+  void deallocate_block(void* ptr, size_t size) override {
+    ::operator delete(ptr);
+  }
+};
+
+// Size-classed slabs carved from large per-index arenas. Freed blocks are 
+// kept in per-class free lists and reused by later rebuilds. Blocks larger 
+// than the largest slab come from the heap, go back to it when freed and are 
+// tracked for the bulk release. Once kReleaseStep more bytes than at the 
+// last release are allocated but not live, release_unused gives the arenas 
+// whose blocks are all free back to the heap. Every thread of an OpenMP team 
+// allocates from its own shard, so the threads of a parallel bulk load do 
+// not contend; other concurrent use is not thread-safe.
+class ArenaAllocator : public NodeAllocator {
+public:
+  static const size_t kArenaSize = 4 << 20;
+  static const size_t kMaxSlabSize = 64 << 10;
+  static const size_t kAlignment = 16;
+  static const size_t kReleaseStep = 4 * kArenaSize;
+  // 16-byte steps up to 1KB and powers of two up to kMaxSlabSize
+  static const uint32_t kNumClasses = 64 + 6;
+
+private:
+  struct Arena {
+    char* start_;
+    size_t carved_;     // The bytes handed out, set once the shard moves on.
+  };
+
+  struct alignas(64) Shard {
+    std::vector<Arena> arenas_;   // The last one is carved from cur_.
+    char* cur_ = nullptr;
+    size_t remain_ = 0;
+    void* free_lists_[kNumClasses] = { };
+  };
+
+  std::vector<Shard> shards_;
+  std::mutex large_mutex_;
+  std::unordered_set<void*> large_blocks_;
+  std::atomic<uint64_t> allocated_size_;
+  // The bytes allocated but not live after the last release_unused
+  int64_t unused_after_release_;
+
+public:
+  ArenaAllocator() : shards_(1), allocated_size_(0), unused_after_release_(0) { }
+
+  ~ArenaAllocator() {
+    for (Shard& shard : shards_) {
+      for (Arena& arena : shard.arenas_) {
+        ::operator delete(arena.start_);
+      }
+    }
+    for (void* block : large_blocks_) {
+      ::operator delete(block);
+    }
+  }
+
+  bool bulk_release() const override { return true; }
+
+  void reserve_threads(uint32_t num_threads) override {
+    if (shards_.size() < num_threads) {
+      shards_.resize(num_threads);
+    }
+  }
+
+  // The bytes requested from the heap, including free slab space
+  uint64_t allocated_size() const { return allocated_size_; }
+
+  // Count the free bytes of every arena from the free lists, and release 
+  // the arenas whose carved bytes are all free after unlinking their blocks
+  void release_unused() override {
+    int64_t unused = static_cast<int64_t>(allocated_size_) 
+                    - counters_.bytes_.load(std::memory_order_relaxed);
+    if (unused < unused_after_release_ + static_cast<int64_t>(kReleaseStep)) {
+      return;
+    }
+    // The arenas in address order, with the bytes of their free blocks
+    std::vector<Arena> arenas;
+    for (Shard& shard : shards_) {
+      if (!shard.arenas_.empty()) {
+        shard.arenas_.back().carved_ = kArenaSize - shard.remain_;
+      }
+      arenas.insert(arenas.end(), shard.arenas_.begin(), shard.arenas_.end());
+    }
+    std::sort(arenas.begin(), arenas.end(), [](const Arena& a, const Arena& b) {
+      return a.start_ < b.start_;
+    });
+    std::vector<size_t> free_bytes(arenas.size(), 0);
+    auto arena_of = [&](const void* block) {
+      return std::upper_bound(arenas.begin(), arenas.end(), block, 
+                              [](const void* b, const Arena& a) {
+                                return b < a.start_;
+                              }) - arenas.begin() - 1;
+    };
+    auto is_free = [&](const void* block) {
+      size_t a = arena_of(block);
+      return free_bytes[a] == arenas[a].carved_;
+    };
+    for (Shard& shard : shards_) {
+      for (uint32_t c = 0; c < kNumClasses; ++ c) {
+        for (void* block = shard.free_lists_[c]; block != nullptr; 
+              block = *static_cast<void**>(block)) {
+          free_bytes[arena_of(block)] += class_to_size(c);
+        }
+      }
+    }
+    // Unlink the blocks of the free arenas before releasing them, and relink 
+    // the rest in address order so that the low arenas fill up first and the 
+    // high ones can empty out for the next release
+    std::vector<void*> blocks;
+    for (Shard& shard : shards_) {
+      for (uint32_t c = 0; c < kNumClasses; ++ c) {
+        blocks.clear();
+        for (void* block = shard.free_lists_[c]; block != nullptr; 
+              block = *static_cast<void**>(block)) {
+          if (!is_free(block)) {
+            blocks.push_back(block);
+          }
+        }
+        std::sort(blocks.begin(), blocks.end());
+        void* head = nullptr;
+        for (auto it = blocks.rbegin(); it != blocks.rend(); ++ it) {
+          *static_cast<void**>(*it) = head;
+          head = *it;
+        }
+        shard.free_lists_[c] = head;
+      }
+    }
+    for (Shard& shard : shards_) {
+      if (!shard.arenas_.empty() && is_free(shard.arenas_.back().start_)) {
+        shard.cur_ = nullptr;
+        shard.remain_ = 0;
+      }
+      uint32_t j = 0;
+      for (uint32_t i = 0; i < shard.arenas_.size(); ++ i) {
+        if (is_free(shard.arenas_[i].start_)) {
+          ::operator delete(shard.arenas_[i].start_);
+          allocated_size_ -= kArenaSize;
+        } else {
+          shard.arenas_[j ++] = shard.arenas_[i];
+        }
+      }
+      shard.arenas_.resize(j);
+    }
+    unused_after_release_ = static_cast<int64_t>(allocated_size_) 
+                            - counters_.bytes_.load(std::memory_order_relaxed);
+  }
+
+protected:
+  void* allocate_block(size_t size) override {
+    if (size > kMaxSlabSize) {
+      void* block = ::operator new(size);
+      std::lock_guard<std::mutex> guard(large_mutex_);
+      large_blocks_.insert(block);
+      allocated_size_ += size;
+      return block;
+    }
+    Shard& shard = local_shard();
+    uint32_t c = size_class(size);
+    if (shard.free_lists_[c] != nullptr) {
+      void* block = shard.free_lists_[c];
+      shard.free_lists_[c] = *static_cast<void**>(block);
+      return block;
+    }
+    size_t class_size = class_to_size(c);
+    if (shard.remain_ < class_size) {
+      if (!shard.arenas_.empty()) {
+        shard.arenas_.back().carved_ = kArenaSize - shard.remain_;
+      }
+      shard.cur_ = static_cast<char*>(::operator new(kArenaSize));
+      shard.remain_ = kArenaSize;
+      shard.arenas_.push_back({shard.cur_, kArenaSize});
+      allocated_size_ += kArenaSize;
+    }
+    void* block = shard.cur_;
+    shard.cur_ += class_size;
+    shard.remain_ -= class_size;
+    return block;
+  }
+
+  void deallocate_block(void* ptr, size_t size) override {
+    if (size > kMaxSlabSize) {
+      std::lock_guard<std::mutex> guard(large_mutex_);
+      large_blocks_.erase(ptr);
+      allocated_size_ -= size;
+      ::operator delete(ptr);
+    } else {
+      // Any shard may reuse the block since release_unused walks the free 
+      // lists of all shards before an arena goes
+      Shard& shard = local_shard();
+      uint32_t c = size_class(size);
+      *static_cast<void**>(ptr) = shard.free_lists_[c];
+      shard.free_lists_[c] = ptr;
+    }
+  }
+
+private:
+  Shard& local_shard() {
+    uint32_t tid = omp_get_thread_num();
+    return shards_[tid < shards_.size() ? tid : 0];
+  }
+
+  static uint32_t size_class(size_t size) {
+    if (size <= 1024) {
+      return size <= kAlignment ? 0 : (size - 1) / kAlignment;
+    }
+    uint32_t c = 64;
+    for (size_t s = 2048; s < size; s <<= 1) {
+      c ++;
+    }
+    return c;
+  }
+
+  static size_t class_to_size(uint32_t c) {
+    return c < 64 ? (c + 1) * kAlignment : (size_t(2048) << (c - 64));
+  }
+};
+
+}
+#endif
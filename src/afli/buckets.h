@@ -1,68 +1,251 @@
 #ifndef BUCKET_H
 #define BUCKET_H
 
+#include "afli/allocator.h"
 #include "afli/iterator.h"
 #include "util/common.h"
 
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 namespace nfl {
 
+// The largest capacity a bucket probe handles in one SIMD pass
+const uint32_t kMaxProbeSize = 8;
+
+// Return the index of the key among the first size keys, or size if absent
+template<typename KT>
+inline uint32_t probe_keys(const KT* keys, uint32_t size, KT key) {
+  for (uint32_t i = 0; i < size; ++ i) {
+    if (compare(keys[i], key)) {
+      return i;
+    }
+  }
+  return size;
+}
+
+#if defined(__AVX512F__)
+template<>
+inline uint32_t probe_keys<double>(const double* keys, uint32_t size, 
+                                    double key) {
+  // Masked lanes are neither loaded nor compared, so the probe never reads 
+  // past the bucket
+  __mmask8 valid = static_cast<__mmask8>((1u << size) - 1);
+  __m512d k = _mm512_maskz_loadu_pd(valid, keys);
+  __m512d diff = _mm512_abs_pd(_mm512_sub_pd(k, _mm512_set1_pd(key)));
+  __mmask8 hit = _mm512_mask_cmp_pd_mask(valid, diff, 
+                  _mm512_set1_pd(std::numeric_limits<double>::epsilon()), 
+                  _CMP_LT_OQ);
+  return hit ? __builtin_ctz(hit) : size;
+}
+#elif defined(__AVX2__)
+template<>
+inline uint32_t probe_keys<double>(const double* keys, uint32_t size, 
+                                    double key) {
+  const __m256i lanes_lo = _mm256_setr_epi64x(0, 1, 2, 3);
+  const __m256i lanes_hi = _mm256_setr_epi64x(4, 5, 6, 7);
+  __m256i n = _mm256_set1_epi64x(size);
+  __m256d valid_lo = _mm256_castsi256_pd(_mm256_cmpgt_epi64(n, lanes_lo));
+  __m256d valid_hi = _mm256_castsi256_pd(_mm256_cmpgt_epi64(n, lanes_hi));
+  __m256d k = _mm256_set1_pd(key);
+  __m256d eps = _mm256_set1_pd(std::numeric_limits<double>::epsilon());
+  __m256d sign = _mm256_set1_pd(-0.);
+  __m256d diff_lo = _mm256_andnot_pd(sign, _mm256_sub_pd(
+                      _mm256_maskload_pd(keys, _mm256_castpd_si256(valid_lo)), 
+                      k));
+  __m256d diff_hi = _mm256_andnot_pd(sign, _mm256_sub_pd(
+                      _mm256_maskload_pd(keys + 4, 
+                                        _mm256_castpd_si256(valid_hi)), k));
+  uint32_t hit = _mm256_movemask_pd(_mm256_and_pd(valid_lo, 
+                    _mm256_cmp_pd(diff_lo, eps, _CMP_LT_OQ)))
+                | (_mm256_movemask_pd(_mm256_and_pd(valid_hi, 
+                    _mm256_cmp_pd(diff_hi, eps, _CMP_LT_OQ))) << 4);
+  return hit ? __builtin_ctz(hit) : size;
+}
+#endif
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+// 64-bit integer keys are equal iff their bits are, whatever their sign
+inline uint32_t probe_keys_epi64(const void* keys, uint32_t size, 
+                                  int64_t key) {
+#if defined(__AVX512F__)
+  __mmask8 valid = static_cast<__mmask8>((1u << size) - 1);
+  __m512i k = _mm512_maskz_loadu_epi64(valid, keys);
+  __mmask8 hit = _mm512_mask_cmpeq_epi64_mask(valid, k, 
+                                              _mm512_set1_epi64(key));
+#else
+  const __m256i lanes_lo = _mm256_setr_epi64x(0, 1, 2, 3);
+  const __m256i lanes_hi = _mm256_setr_epi64x(4, 5, 6, 7);
+  __m256i n = _mm256_set1_epi64x(size);
+  __m256i valid_lo = _mm256_cmpgt_epi64(n, lanes_lo);
+  __m256i valid_hi = _mm256_cmpgt_epi64(n, lanes_hi);
+  const long long* ks = static_cast<const long long*>(keys);
+  __m256i k = _mm256_set1_epi64x(key);
+  __m256i eq_lo = _mm256_and_si256(valid_lo, _mm256_cmpeq_epi64(
+                    _mm256_maskload_epi64(ks, valid_lo), k));
+  __m256i eq_hi = _mm256_and_si256(valid_hi, _mm256_cmpeq_epi64(
+                    _mm256_maskload_epi64(ks + 4, valid_hi), k));
+  uint32_t hit = _mm256_movemask_pd(_mm256_castsi256_pd(eq_lo)) 
+                | (_mm256_movemask_pd(_mm256_castsi256_pd(eq_hi)) << 4);
+#endif
+  return hit ? __builtin_ctz(hit) : size;
+}
+
+template<>
+inline uint32_t probe_keys<int64_t>(const int64_t* keys, uint32_t size, 
+                                    int64_t key) {
+  return probe_keys_epi64(keys, size, key);
+}
+
+template<>
+inline uint32_t probe_keys<uint64_t>(const uint64_t* keys, uint32_t size, 
+                                      uint64_t key) {
+  return probe_keys_epi64(keys, size, static_cast<int64_t>(key));
+}
+#endif
+
+// The key equality of an index, picked at compile time like the allocator 
+// and statistics policies. ApproxKeys is compare, which takes floating-point 
+// keys closer than epsilon as equal. ExactKeys takes keys as equal only if 
+// their bits are, for keys whose low bits carry a fingerprint, see 
+// nfl/key_storage.h.
+struct ApproxKeys {
+  template<typename T>
+  static inline bool equal(const T& a, const T& b) { return compare(a, b); }
+
+  template<typename T>
+  static inline uint32_t probe(const T* keys, uint32_t size, T key) {
+    return probe_keys<T>(keys, size, key);
+  }
+};
+
+struct ExactKeys {
+  template<typename T>
+  static inline bool equal(const T& a, const T& b) {
+    return std::memcmp(&a, &b, sizeof(T)) == 0;
+  }
+
+  template<typename T>
+  static inline uint32_t probe(const T* keys, uint32_t size, T key) {
+#if defined(__AVX512F__) || defined(__AVX2__)
+    if constexpr (sizeof(T) == sizeof(int64_t)) {
+      int64_t bits;
+      std::memcpy(&bits, &key, sizeof(T));
+      return probe_keys_epi64(keys, size, bits);
+    }
+#endif
+    for (uint32_t i = 0; i < size; ++ i) {
+      if (equal(keys[i], key)) {
+        return i;
+      }
+    }
+    return size;
+  }
+};
+
+// A bucket is one block: the header, the keys and then the values, so that 
+// a probe reads the contiguous keys with one SIMD compare. The keys are kept 
+// ordered.
 template<typename KT, typename VT>
 class Bucket {
 typedef std::pair<KT, VT> KVT;
 public:
-  KVT* data_;
   uint8_t size_;
+  uint8_t capacity_;
+
+private:
+  static size_t keys_offset() {
+    return (sizeof(Bucket<KT, VT>) + alignof(KT) - 1) / alignof(KT) 
+            * alignof(KT);
+  }
+
+  static size_t values_offset(uint32_t capacity) {
+    size_t end = keys_offset() + sizeof(KT) * capacity;
+    return (end + alignof(VT) - 1) / alignof(VT) * alignof(VT);
+  }
 
 public:
-  Bucket() : data_(nullptr), size_(0) { }
+  static size_t block_size(uint32_t capacity) {
+    return values_offset(capacity) + sizeof(VT) * capacity;
+  }
 
-  Bucket(const KVT* kvs, uint32_t size, const uint8_t capacity) 
-        : size_(size) {
-    data_ = new KVT[capacity];
+  static Bucket<KT, VT>* create(NodeAllocator* alloc, const KVT* kvs, 
+                                uint32_t size, const uint8_t capacity) {
+    assert_p(capacity <= kMaxProbeSize, "Bucket capacity is too large");
+    Bucket<KT, VT>* bucket = static_cast<Bucket<KT, VT>*>(
+                              alloc->allocate(block_size(capacity)));
+    SizeCounters::add(alloc->counters_.num_buckets_, 1);
+    bucket->size_ = size;
+    bucket->capacity_ = capacity;
+    KT* keys = bucket->keys();
+    VT* values = bucket->values();
     for (uint32_t i = 0; i < size; ++ i) {
-      data_[i] = kvs[i];
+      keys[i] = kvs[i].first;
+      values[i] = kvs[i].second;
     }
+    return bucket;
   }
 
-  ~Bucket() {
-    if (data_ != nullptr) {
-      delete[] data_;
-      data_ = nullptr;
-    }
+  static void destroy(NodeAllocator* alloc, Bucket<KT, VT>* bucket) {
+    SizeCounters::add(alloc->counters_.num_buckets_, -1);
+    alloc->deallocate(bucket, block_size(bucket->capacity_));
   }
 
   inline uint8_t size() const { return size_; }
 
+  inline KT* keys() {
+    return reinterpret_cast<KT*>(reinterpret_cast<char*>(this) 
+                                  + keys_offset());
+  }
+
+  inline VT* values() {
+    return reinterpret_cast<VT*>(reinterpret_cast<char*>(this) 
+                                  + values_offset(capacity_));
+  }
+
+  inline KVT kv(uint32_t i) { return {keys()[i], values()[i]}; }
+
+  inline ResultIterator<KT, VT> at(uint32_t i) {
+    return {keys() + i, values() + i};
+  }
+
+  // Return the index of the key, or size_ if the key is absent
+  template<typename Equal = ApproxKeys>
+  inline uint32_t probe(KT key) {
+    return Equal::probe(keys(), size_, key);
+  }
+
+  template<typename Equal = ApproxKeys>
   ResultIterator<KT, VT> find(KT key) {
-    for (uint32_t i = 0; i < size_; ++ i) {
-      if (compare(data_[i].first, key)) {
-        return {&data_[i]};
-      }
+    uint32_t i = probe<Equal>(key);
+    if (i < size_) {
+      return at(i);
     }
     return {};
   }
 
+  template<typename Equal = ApproxKeys>
   bool update(KVT kv) {
-    for (uint8_t i = 0; i < size_; ++ i) {
-      if (compare(data_[i].first, kv.first)) {
-        data_[i] = kv;
-        return true;
-      }
+    uint32_t i = probe<Equal>(kv.first);
+    if (i < size_) {
+      keys()[i] = kv.first;
+      values()[i] = kv.second;
+      return true;
     }
     return false;
   }
 
+  template<typename Equal = ApproxKeys>
   uint32_t remove(KT key) {
-    bool copy = false;
-    for (uint8_t i = 0; i < size_; ++ i) {
-      if (compare(data_[i].first, key)) {
-        copy = true;
+    uint32_t i = probe<Equal>(key);
+    if (i < size_) {
+      KT* keys = this->keys();
+      VT* values = this->values();
+      for (; i + 1 < size_; ++ i) {
+        keys[i] = keys[i + 1];
+        values[i] = values[i + 1];
       }
-      if (copy && i + 1 < size_) {
-        data_[i] = data_[i + 1];
-      }
-    }
-    if (copy) {
       size_ --;
       return 1;
     } else {
@@ -70,9 +253,28 @@ public:
     }
   }
 
+  // Returns the index of the first key not less than the given key
+  uint32_t lower_bound(KT key) {
+    KT* keys = this->keys();
+    uint32_t i = 0;
+    while (i < size_ && keys[i] < key) {
+      i ++;
+    }
+    return i;
+  }
+
   bool insert(KVT kv, const uint8_t capacity) {
     if (size_ < capacity) {
-      data_[size_] = kv;
+      // Keep the bucket ordered so that scans can read it sequentially
+      KT* keys = this->keys();
+      VT* values = this->values();
+      int32_t i = size_;
+      for (; i > 0 && kv.first < keys[i - 1]; -- i) {
+        keys[i] = keys[i - 1];
+        values[i] = values[i - 1];
+      }
+      keys[i] = kv.first;
+      values[i] = kv.second;
       size_ ++;
       return true;
     } else {
@@ -83,4 +285,4 @@ public:
 
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,510 @@
+#ifndef CONCURRENT_AFLI_H
+#define CONCURRENT_AFLI_H
+
+#include "afli/afli.h"
+#include "util/epoch.h"
+
+namespace nfl {
+
+// A thread-safe AFLI based on optimistic lock coupling. Readers never write
+// shared memory: they remember the version of each node on the path and
+// restart if it changed before they are done with the node. Writers lock only
+// the node they modify by making its version odd. Buckets and dense node
+// contents that are replaced are retired to an epoch manager and freed once
+// no reader can still see them.
+//
+// Model nodes never change their model, capacity, bitmaps or entry arrays
+// after being built. A dense node may be rebuilt in place into a model node,
+// and a subtree below the root is retrained like in AFLI once its counters,
+// which writers update atomically on every node of their path, call for it.
+// The retrain holds the lock of the parent, locks every node of the old
+// subtree for good and marks it obsolete, so that the readers and writers in
+// it restart and find the new subtree through the parent. Memory comes from
+// the thread-safe HeapAllocator.
+template <typename KT, typename VT>
+class ConcurrentAFLI {
+typedef std::pair<KT, VT> KVT;
+typedef TNode<KT, VT> Node;
+private:
+  AFLI<KT, VT, HeapAllocator> index_;
+  EpochManager epoch_;
+
+  const int32_t kRestart = -1;
+  const uint8_t kDense = 4;
+  // Set in the version of the nodes of a retrained subtree, which stay locked
+  static const uint64_t kObsolete = 1ULL << 63;
+
+  // A node on the path of a write and the slot of its model that the key 
+  // took, if any
+  struct Step {
+    Node* node_;
+    uint32_t idx_;
+  };
+public:
+  ConcurrentAFLI() { }
+
+  void bulk_load(const KVT* kvs, uint32_t size, int32_t bucket_size=-1,
+                uint32_t aggregate_size=0) {
+    index_.bulk_load(kvs, size, bucket_size, aggregate_size);
+  }
+
+  bool find(KT key, VT& value) {
+    EpochGuard guard(epoch_);
+    int32_t res = kRestart;
+    while (res == kRestart) {
+      res = try_find(key, value);
+    }
+    return res;
+  }
+
+  bool update(KVT kv) {
+    EpochGuard guard(epoch_);
+    int32_t res = kRestart;
+    while (res == kRestart) {
+      res = try_update(kv);
+    }
+    return res;
+  }
+
+  uint32_t remove(KT key) {
+    EpochGuard guard(epoch_);
+    thread_local std::vector<Step> path;
+    int32_t res = kRestart;
+    while (res == kRestart) {
+      res = try_remove(key, path);
+    }
+    return res;
+  }
+
+  void insert(KVT kv) {
+    EpochGuard guard(epoch_);
+    thread_local std::vector<Step> path;
+    int32_t res = kRestart;
+    while (res == kRestart) {
+      res = try_insert(kv, path);
+    }
+    maybe_retrain(path);
+  }
+
+  // The statistics walk the whole tree and must not run concurrently with
+  // writers. The sizes are read from counters and may be polled at any time;
+  // they include the memory that is retired but not yet freed.
+  void print_stats() { index_.print_stats(); }
+
+  uint64_t model_size() { return index_.model_size(); }
+
+  uint64_t index_size() { return index_.index_size(); }
+
+private:
+  static bool read_version(Node* node, uint64_t& version) {
+    version = node->version_.load(std::memory_order_acquire);
+    return (version & 1) == 0;
+  }
+
+  static bool validate(Node* node, uint64_t version) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return node->version_.load(std::memory_order_relaxed) == version;
+  }
+
+  static bool lock(Node* node, uint64_t version) {
+    return node->version_.compare_exchange_strong(version, version + 1,
+                                                  std::memory_order_acquire);
+  }
+
+  static void unlock(Node* node) {
+    node->version_.fetch_add(1, std::memory_order_release);
+  }
+
+  // Wait until the node is unlocked and lock it, unless it became obsolete
+  static bool lock_wait(Node* node) {
+    while (true) {
+      uint64_t version = node->version_.load(std::memory_order_acquire);
+      if (version & kObsolete) {
+        return false;
+      }
+      if ((version & 1) == 0 && lock(node, version)) {
+        return true;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  // The counters of retraining are shared by all writers below a node, so 
+  // they are updated atomically, also by the writer that holds its lock
+  static void add_counters(Node* node, int64_t size, uint32_t inserts, 
+                            int64_t depth_sum) {
+    __atomic_fetch_add(&node->size_sub_tree_, static_cast<uint32_t>(size), 
+                        __ATOMIC_RELAXED);
+    __atomic_fetch_add(&node->num_inserts_, inserts, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&node->depth_sum_, static_cast<uint64_t>(depth_sum), 
+                        __ATOMIC_RELAXED);
+  }
+
+  // Add a write into the last node of the path, which changed its depth_sum_ 
+  // by delta, to the counters of the nodes above it, whose keys sit one 
+  // level deeper per node
+  static void add_to_ancestors(const std::vector<Step>& path, int64_t size, 
+                                uint32_t inserts, int64_t delta) {
+    for (uint32_t i = path.size() - 1; i > 0; -- i) {
+      delta += size;
+      add_counters(path[i - 1].node_, size, inserts, delta);
+    }
+  }
+
+  static uint32_t predict_pos(const LinearModel<KT>* model, uint32_t capacity,
+                              KT key) {
+    return std::min(std::max(model->predict(key), 0L),
+                    static_cast<int64_t>(capacity - 1));
+  }
+
+  // Descend from the root to the node that holds the key. On success, node
+  // and version describe a validated snapshot of that node; for a model node
+  // idx and type describe the predicted slot, otherwise type is kDense.
+  // If path is given, it gets the nodes from the root to that node.
+  bool descend(KT key, Node*& node, uint64_t& version, uint32_t& idx,
+                uint8_t& type, uint32_t& depth, 
+                std::vector<Step>* path=nullptr) {
+    node = index_.root_;
+    depth = 1;
+    if (path != nullptr) {
+      path->clear();
+    }
+    if (!read_version(node, version)) {
+      return false;
+    }
+    while (true) {
+      LinearModel<KT>* model = node->model_;
+      uint32_t capacity = node->capacity_;
+      if (!validate(node, version)) {
+        return false;
+      }
+      if (model == nullptr) {
+        type = kDense;
+        if (path != nullptr) {
+          path->push_back({node, 0});
+        }
+        return true;
+      }
+      idx = predict_pos(model, capacity, key);
+      if (path != nullptr) {
+        path->push_back({node, idx});
+      }
+      type = node->entry_type(idx);
+      if (type != kNode) {
+        return validate(node, version);
+      }
+      // The child pointer is only safe to follow once the slot is validated.
+      // Children are never unlinked, so the parent needs no further checks.
+      Node* child = node->entries_[idx].child_;
+      if (!validate(node, version)) {
+        return false;
+      }
+      node = child;
+      if (!read_version(node, version)) {
+        return false;
+      }
+      depth ++;
+    }
+  }
+
+  int32_t try_find(KT key, VT& value) {
+    Node* node;
+    uint64_t version;
+    uint32_t idx, depth;
+    uint8_t type;
+    if (!descend(key, node, version, idx, type, depth)) {
+      return kRestart;
+    }
+    bool found = false;
+    if (type == kDense) {
+      Entry<KT, VT>* entries = node->entries_;
+      BIT_TYPE* bitmap = node->bitmap0_;
+      uint32_t capacity = node->capacity_;
+      if (!validate(node, version)) {
+        return kRestart;
+      }
+      uint32_t pos = Node::dense_lower_bound(entries, bitmap, capacity, key);
+      if (pos < capacity && compare(entries[pos].kv_.first, key)) {
+        value = entries[pos].kv_.second;
+        found = true;
+      }
+    } else if (type == kData) {
+      KVT kv = node->entries_[idx].kv_;
+      if (compare(kv.first, key)) {
+        value = kv.second;
+        found = true;
+      }
+    } else if (type == kBucket) {
+      Bucket<KT, VT>* bucket = node->entries_[idx].bucket_;
+      if (!validate(node, version)) {
+        return kRestart;
+      }
+      uint32_t size = bucket->size_;
+      uint32_t i = probe_keys<KT>(bucket->keys(), size, key);
+      if (i < size) {
+        value = bucket->values()[i];
+        found = true;
+      }
+    }
+    return validate(node, version) ? found : kRestart;
+  }
+
+  int32_t try_update(KVT kv) {
+    Node* node;
+    uint64_t version;
+    uint32_t idx, depth;
+    uint8_t type;
+    if (!descend(kv.first, node, version, idx, type, depth)
+        || !lock(node, version)) {
+      return kRestart;
+    }
+    bool res = false;
+    if (type == kDense) {
+      uint32_t pos = Node::dense_lower_bound(node->entries_, node->bitmap0_,
+                                              node->capacity_, kv.first);
+      if (pos < node->capacity_
+          && compare(node->entries_[pos].kv_.first, kv.first)) {
+        node->entries_[pos].kv_ = kv;
+        res = true;
+      }
+    } else if (type == kData) {
+      if (compare(node->entries_[idx].kv_.first, kv.first)) {
+        node->entries_[idx].kv_ = kv;
+        res = true;
+      }
+    } else if (type == kBucket) {
+      res = node->entries_[idx].bucket_->update(kv);
+    }
+    unlock(node);
+    return res;
+  }
+
+  int32_t try_remove(KT key, std::vector<Step>& path) {
+    Node* node;
+    uint64_t version;
+    uint32_t idx, depth;
+    uint8_t type;
+    if (!descend(key, node, version, idx, type, depth, &path)
+        || !lock(node, version)) {
+      return kRestart;
+    }
+    uint32_t res = 0;
+    int64_t delta = 0;
+    if (type == kDense) {
+      uint32_t pos = Node::dense_lower_bound(node->entries_, node->bitmap0_,
+                                              node->capacity_, key);
+      if (pos < node->capacity_
+          && compare(node->entries_[pos].kv_.first, key)) {
+        SET_BIT_ZERO(node->bitmap0_[BIT_IDX(pos)], BIT_POS(pos));
+        node->size_ --;
+        res = 1;
+        delta = -1;
+      }
+    } else if (type == kData) {
+      if (compare(node->entries_[idx].kv_.first, key)) {
+        node->set_entry_type(idx, kNone);
+        node->size_ --;
+        res = 1;
+        delta = -1;
+      }
+    } else if (type == kBucket) {
+      res = node->entries_[idx].bucket_->remove(key);
+      delta = -2 * static_cast<int64_t>(res);
+    }
+    if (res > 0) {
+      // The counters are updated before the unlock, so that a retrain of an 
+      // ancestor, which locks this node, sees them complete
+      add_counters(node, -1, 0, delta);
+      add_to_ancestors(path, -1, 0, delta);
+    }
+    unlock(node);
+    return res;
+  }
+
+  int32_t try_insert(KVT kv, std::vector<Step>& path) {
+    Node* node;
+    uint64_t version;
+    uint32_t idx, depth;
+    uint8_t type;
+    if (!descend(kv.first, node, version, idx, type, depth, &path)
+        || !lock(node, version)) {
+      return kRestart;
+    }
+    const HyperParameter& hyper_para = index_.hyper_para_;
+    // How much the insert changes depth_sum_ of the node
+    int64_t delta = 0;
+    if (type == kDense) {
+      if (node->size_ + 1 <= node->capacity_ * hyper_para.kDenseMaxDensity) {
+        // Shifts stay within the entries, so readers never leave the array
+        node->dense_insert(kv);
+        node->size_ ++;
+        delta = 1;
+        add_counters(node, 1, 1, delta);
+      } else {
+        // Build the new contents aside and swap them in, so that readers
+        // still holding the old entries see valid memory until they restart
+        std::vector<KVT> kvs;
+        node->collect(kvs);
+        kvs.insert(std::upper_bound(kvs.begin(), kvs.end(), kv,
+                    [](const KVT& a, const KVT& b) {
+                      return a.first < b.first;
+                    }), kv);
+        Node* fresh = Node::create(node->alloc_);
+        fresh->build(kvs.data(), kvs.size(), depth, hyper_para);
+        delta = static_cast<int64_t>(fresh->depth_sum_) - node->depth_sum_;
+        std::swap(node->model_, fresh->model_);
+        std::swap(node->size_, fresh->size_);
+        std::swap(node->capacity_, fresh->capacity_);
+        std::swap(node->size_sub_tree_, fresh->size_sub_tree_);
+        std::swap(node->num_inserts_, fresh->num_inserts_);
+        std::swap(node->depth_sum_, fresh->depth_sum_);
+        std::swap(node->build_cost_, fresh->build_cost_);
+        std::swap(node->bitmap0_, fresh->bitmap0_);
+        std::swap(node->bitmap1_, fresh->bitmap1_);
+        std::swap(node->entries_, fresh->entries_);
+        epoch_.retire(fresh, [](void* p, void* alloc) {
+          Node::destroy(static_cast<Node*>(p));
+        });
+      }
+    } else if (type == kNone) {
+      node->set_entry_type(idx, kData);
+      node->entries_[idx].kv_ = kv;
+      node->size_ ++;
+      delta = 1;
+      add_counters(node, 1, 1, delta);
+    } else {
+      if (type == kData) {
+        KVT stored_kv = node->entries_[idx].kv_;
+        node->entries_[idx].bucket_ = Bucket<KT, VT>::create(node->alloc_,
+                                        &stored_kv, 1,
+                                        hyper_para.max_bucket_size_);
+        node->set_entry_type(idx, kBucket);
+        node->size_ --;
+        // The stored key moves into the bucket
+        delta = 1;
+      }
+      Bucket<KT, VT>* bucket = node->entries_[idx].bucket_;
+      if (!bucket->insert(kv, hyper_para.max_bucket_size_)) {
+        uint32_t bucket_size = bucket->size_;
+        KVT* kvs = new KVT[bucket_size + 1];
+        for (uint32_t i = 0; i < bucket_size; ++ i) {
+          kvs[i] = bucket->kv(i);
+        }
+        kvs[bucket_size] = kv;
+        std::sort(kvs, kvs + bucket_size + 1,
+          [](auto const& a, auto const& b) {
+            return a.first < b.first;
+          });
+        Node* child = Node::create(node->alloc_);
+        child->build(kvs, bucket_size + 1, depth + 1, hyper_para);
+        delete[] kvs;
+        delta += static_cast<int64_t>(child->depth_sum_ + bucket_size + 1)
+                  - 2 * bucket_size;
+        node->entries_[idx].child_ = child;
+        node->set_entry_type(idx, kNode);
+        epoch_.retire(bucket, [](void* p, void* alloc) {
+          Bucket<KT, VT>::destroy(static_cast<NodeAllocator*>(alloc),
+                                  static_cast<Bucket<KT, VT>*>(p));
+        }, node->alloc_);
+      } else {
+        delta += 2;
+      }
+      add_counters(node, 1, 1, delta);
+    }
+    add_to_ancestors(path, 1, 1, delta);
+    unlock(node);
+    return 1;
+  }
+
+  // Retrain the highest model node below the root on the path of an insert 
+  // whose counters call for it, see TNode::need_retrain. The root has no 
+  // parent to lock and is never retrained, but the keys beyond its bounds 
+  // pile up in the subtrees of its first and last slots, which are.
+  void maybe_retrain(const std::vector<Step>& path) {
+    const HyperParameter& hyper_para = index_.hyper_para_;
+    for (uint32_t i = 1; i < path.size(); ++ i) {
+      Node* node = path[i].node_;
+      // Model nodes stay model nodes, so the last node of the path is the 
+      // only one that may be dense
+      if (i + 1 == path.size() 
+          && __atomic_load_n(&node->model_, __ATOMIC_ACQUIRE) == nullptr) {
+        return;
+      }
+      if (node->need_retrain(hyper_para)) {
+        retrain(path, i);
+        return;
+      }
+    }
+  }
+
+  // Rebuild the subtree of path[i] and link it into the slots of its parent
+  void retrain(const std::vector<Step>& path, uint32_t i) {
+    const HyperParameter& hyper_para = index_.hyper_para_;
+    Node* parent = path[i - 1].node_;
+    uint32_t idx = path[i - 1].idx_;
+    Node* child = path[i].node_;
+    if (!lock_wait(parent)) {
+      return;
+    }
+    // Another writer may have retrained it since
+    if (parent->entry_type(idx) != kNode || parent->entries_[idx].child_ != child
+        || !child->need_retrain(hyper_para)) {
+      unlock(parent);
+      return;
+    }
+    std::vector<Node*> nodes;
+    lock_subtree(child, nodes);
+    std::vector<KVT> kvs;
+    child->collect(kvs);
+    Node* fresh = Node::create(parent->alloc_);
+    fresh->build(kvs.data(), kvs.size(), i + 1, hyper_para);
+    uint32_t lo = idx;
+    uint32_t hi = idx + 1;
+    while (lo > 0 && parent->entry_type(lo - 1) == kNode
+          && parent->entries_[lo - 1].child_ == child) {
+      lo --;
+    }
+    while (hi < parent->capacity_ && parent->entry_type(hi) == kNode
+          && parent->entries_[hi].child_ == child) {
+      hi ++;
+    }
+    for (uint32_t j = lo; j < hi; ++ j) {
+      parent->entries_[j].child_ = fresh;
+    }
+    // The keys of the subtree are one level deeper in the parent
+    int64_t delta = static_cast<int64_t>(fresh->depth_sum_ + kvs.size())
+                    - static_cast<int64_t>(child->depth_sum_ 
+                                            + child->size_sub_tree_);
+    std::vector<Step> ancestors(path.begin(), path.begin() + i);
+    add_counters(parent, 0, 0, delta);
+    add_to_ancestors(ancestors, 0, 0, delta);
+    for (Node* node : nodes) {
+      node->version_.fetch_or(kObsolete, std::memory_order_release);
+    }
+    unlock(parent);
+    // The destructor frees the whole subtree
+    epoch_.retire(child, [](void* p, void* alloc) {
+      Node::destroy(static_cast<Node*>(p));
+    });
+  }
+
+  // Lock the nodes of the subtree top-down and append them to nodes. The 
+  // parent is locked, so none of them becomes obsolete meanwhile.
+  static void lock_subtree(Node* node, std::vector<Node*>& nodes) {
+    assert_p(lock_wait(node), "A node below a locked parent became obsolete");
+    nodes.push_back(node);
+    if (node->model_ == nullptr) {
+      return;
+    }
+    for (uint32_t j = 0; j < node->capacity_; ++ j) {
+      if (node->entry_type(j) == kNode
+          && (j == 0 || node->entry_type(j - 1) != kNode
+              || node->entries_[j - 1].child_ != node->entries_[j].child_)) {
+        lock_subtree(node->entries_[j].child_, nodes);
+      }
+    }
+  }
+};
+
+}
+#endif
@@ -32,86 +32,243 @@ struct ConflictsInfo {
   }
 };
 
+// Inputs with at least this many keys are fitted and scanned by parallel 
+// tasks when the caller runs inside an OpenMP parallel region
+const uint32_t kParallelFitSize = 1 << 16;
+
+// The number of tasks that share the work on size keys
+inline uint32_t num_fit_tasks(uint32_t size) {
+  return size < kParallelFitSize ? 1 : omp_get_num_threads();
+}
+
+// The range of keys [l, r) that the t-th of num_tasks tasks works on
+inline void fit_task_range(uint32_t size, uint32_t num_tasks, uint32_t t, 
+                            uint32_t& l, uint32_t& r) {
+  l = static_cast<uint64_t>(size) * t / num_tasks;
+  r = static_cast<uint64_t>(size) * (t + 1) / num_tasks;
+}
+
+// The number of lines that build_linear_model chooses from. All of them fit 
+// the ranks of the keys and differ in their slopes: the least squares line, 
+// the line through the first and last keys, and the lines through the keys 
+// at the inner quantiles in kFitQuantiles, which ignore the outliers at both 
+// ends that tilt the other lines.
+const uint32_t kNumFitters = 4;
+const double kFitQuantiles[kNumFitters - 2] = {0.01, 0.1};
+
+// Anchor the model with the given slope at the first key and return the 
+// number of positions it predicts into, which is at most max_size
+template<typename KT>
+uint32_t anchor_model(LinearModel<KT>* model, KT min_key, KT max_key, 
+                      uint32_t size, uint32_t max_size) {
+  model->base_ = min_key;
+  model->intercept_ = 0.5;
+  int64_t predicted_size = model->predict(max_key) + 1;
+  if (predicted_size > 1) {
+    max_size = std::min(predicted_size, static_cast<int64_t>(max_size));
+  }
+  uint32_t first_pos = std::min(std::max(model->predict(min_key), 0L), 
+                                static_cast<int64_t>(max_size - 1));
+  uint32_t last_pos = std::min(std::max(model->predict(max_key), 0L), 
+                                static_cast<int64_t>(max_size - 1));
+  if (last_pos == first_pos) {
+    // Model fails to predict since all predicted positions are rounded to the 
+    // same one
+    model->slope_ = size / key_offset(max_key, min_key);
+  }
+  return max_size;
+}
+
+// Add the sum of the squared conflict degrees of every model over the keys 
+// in [l, r) to costs. The sum is the number of keys times the conflict degree 
+// that an average key sees, so it grows quickly with the tail conflicts. All 
+// models are evaluated in one branch-free pass: the k-th key of a run adds 
+// 2k - 1, so a run of c keys adds c^2.
+template<typename KT, typename VT>
+void add_conflict_costs(const std::pair<KT, VT>* kvs, uint32_t l, uint32_t r, 
+                        const LinearModel<KT>* models, 
+                        const uint32_t* max_sizes, uint64_t* costs) {
+  int64_t p_last[kNumFitters];
+  uint64_t conflict[kNumFitters];
+  double max_pos[kNumFitters];
+  for (uint32_t m = 0; m < kNumFitters; ++ m) {
+    p_last[m] = -1;
+    conflict[m] = 0;
+    max_pos[m] = max_sizes[m] - 1;
+  }
+  for (uint32_t i = l; i < r; ++ i) {
+    KT key = kvs[i].first;
+    for (uint32_t m = 0; m < kNumFitters; ++ m) {
+      // Truncating the clamped prediction gives the same position as 
+      // flooring it first
+      int64_t p = static_cast<int64_t>(std::min(std::max(
+                    models[m].predict_double(key), 0.), max_pos[m]));
+      conflict[m] = (p == p_last[m]) ? conflict[m] + 1 : 1;
+      costs[m] += 2 * conflict[m] - 1;
+      p_last[m] = p;
+    }
+  }
+}
+
+// Fit the model owned by the caller. Return nullptr if no usable linear model
+// exists for the keys, e.g., all keys are the same. Every fitter proposes a 
+// line and the one with the least conflict cost is kept.
 template<typename KT, typename VT>
 ConflictsInfo* build_linear_model(const std::pair<KT, VT>* kvs, uint32_t size,
-                                  LinearModel<KT>*& model, 
+                                  LinearModel<KT>* model, 
                                   double size_amp) {
-  if (model != nullptr) {
-    model->slope_ = model->intercept_ = 0;
-  } else {
-    model = new LinearModel<KT>();
-  }
-  // OPT: Find a linear regression model that has the minimum conflict degree
-  // The heuristics below is a simple method that scales the positions
+  model->slope_ = model->intercept_ = 0;
   KT min_key = kvs[0].first;
   KT max_key = kvs[size - 1].first;
-  KT key_space = max_key - min_key;
+  double key_space = key_offset(max_key, min_key);
   if (compare(min_key, max_key)) {
-    delete model;
-    model = nullptr;
     return nullptr;
   }
   uint32_t max_size = static_cast<uint32_t>(size * size_amp);
-  LinearModelBuilder<KT> builder;
-  uint32_t j = 0;
-  for (uint32_t i = 0; i < size; ++ i) {
-    KT key = kvs[i].first;
-    // double y = max_size * (key - min_key) / key_space;
-    double y = i;
-    builder.add(key, y);
+  uint32_t num_tasks = num_fit_tasks(size);
+  // The keys are fitted relative to the first one, which keeps integer keys 
+  // exact and does not change the slope
+  LinearModelBuilder<double> builder;
+  if (num_tasks == 1) {
+    for (uint32_t i = 0; i < size; ++ i) {
+      double key = key_offset(kvs[i].first, min_key);
+      // double y = max_size * (key - min_key) / key_space;
+      double y = i;
+      builder.add(key, y);
+    }
+  } else {
+    // Reduce the partial sums of disjoint ranges in a fixed order
+    std::vector<LinearModelBuilder<double>> builders(num_tasks);
+    #pragma omp taskloop grainsize(1) shared(builders)
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      uint32_t l, r;
+      fit_task_range(size, num_tasks, t, l, r);
+      for (uint32_t i = l; i < r; ++ i) {
+        builders[t].add(key_offset(kvs[i].first, min_key), i);
+      }
+    }
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      builder.merge(builders[t]);
+    }
   }
-  builder.build(model);
-  if (compare(model->slope_, 0.)) {
+  LinearModel<double> least_squares;
+  builder.build(&least_squares);
+  if (compare(least_squares.slope_, 0.)) {
     // Fail to build a linear model
-    delete model;
-    model = nullptr;
     return nullptr;
+  }
+  // Collect the candidate lines, the least squares one first
+  LinearModel<KT> models[kNumFitters];
+  uint32_t max_sizes[kNumFitters];
+  uint32_t num_models = 0;
+  models[num_models ++].slope_ = least_squares.slope_;
+  models[num_models ++].slope_ = (size - 1) / key_space;
+  for (uint32_t q = 0; q < kNumFitters - 2; ++ q) {
+    uint32_t lo = static_cast<uint32_t>(size * kFitQuantiles[q]);
+    uint32_t hi = size - 1 - lo;
+    if (lo < hi && !compare(kvs[lo].first, kvs[hi].first)) {
+      models[num_models ++].slope_ = (hi - lo) / key_offset(kvs[hi].first, 
+                                                            kvs[lo].first);
+    }
+  }
+  for (uint32_t m = 0; m < num_models; ++ m) {
+    max_sizes[m] = anchor_model(&models[m], min_key, max_key, size, max_size);
+  }
+  // Repeat the least squares line in unused slots so that the cost pass 
+  // always evaluates kNumFitters lines
+  for (uint32_t m = num_models; m < kNumFitters; ++ m) {
+    models[m] = models[0];
+    max_sizes[m] = max_sizes[0];
+  }
+  uint64_t costs[kNumFitters] = { 0 };
+  if (num_tasks == 1) {
+    add_conflict_costs<KT, VT>(kvs, 0, size, models, max_sizes, costs);
   } else {
-    model->intercept_ = -model->slope_ * (min_key) + 0.5;
-    int64_t predicted_size = model->predict(max_key) + 1;
-    if (predicted_size > 1) {
-      max_size = std::min(predicted_size, static_cast<int64_t>(max_size));
+    // The runs cut at range boundaries are counted in parts, which hardly 
+    // matters for comparing the lines
+    std::vector<uint64_t> task_costs(num_tasks * kNumFitters, 0);
+    #pragma omp taskloop grainsize(1) shared(task_costs, models, max_sizes)
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      uint32_t l, r;
+      fit_task_range(size, num_tasks, t, l, r);
+      add_conflict_costs<KT, VT>(kvs, l, r, models, max_sizes, 
+                                  &task_costs[t * kNumFitters]);
     }
-    uint32_t first_pos = std::min(std::max(model->predict(min_key), 0L), 
-                                  static_cast<int64_t>(max_size - 1));
-    uint32_t last_pos = std::min(std::max(model->predict(max_key), 0L), 
-                                  static_cast<int64_t>(max_size - 1));
-    if (last_pos == first_pos) {
-      // Model fails to predict since all predicted positions are rounded to the 
-      // same one
-      model->slope_ = size / (max_key - min_key);
-      model->intercept_ = -model->slope_ * (min_key) + 0.5;
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      for (uint32_t m = 0; m < num_models; ++ m) {
+        costs[m] += task_costs[t * kNumFitters + m];
+      }
     }
-    ConflictsInfo* ci = new ConflictsInfo(size, max_size);
-    uint32_t p_last = first_pos;
-    uint32_t conflict = 1;
-    for (uint32_t i = 1; i < size; ++ i) {
-      uint32_t p = std::min(std::max(model->predict(kvs[i].first), 0L), 
-                                    static_cast<int64_t>(max_size - 1));
-      if (p == p_last) {
-        conflict ++;
-      } else {
-        ci->add_conflict(p_last, conflict);
-        p_last = p;
-        conflict = 1;
+  }
+  uint32_t best = 0;
+  for (uint32_t m = 1; m < num_models; ++ m) {
+    if (costs[m] < costs[best]) {
+      best = m;
+    }
+  }
+  *model = models[best];
+  max_size = max_sizes[best];
+  ConflictsInfo* ci = new ConflictsInfo(size, max_size);
+  if (num_tasks > 1) {
+    // Every task counts the runs of equal positions in its range, and the 
+    // runs that span two ranges are joined when they are concatenated
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> runs(num_tasks);
+    #pragma omp taskloop grainsize(1) shared(runs)
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      uint32_t l, r;
+      fit_task_range(size, num_tasks, t, l, r);
+      for (uint32_t i = l; i < r; ++ i) {
+        uint32_t p = std::min(std::max(model->predict(kvs[i].first), 0L), 
+                              static_cast<int64_t>(max_size - 1));
+        if (!runs[t].empty() && runs[t].back().first == p) {
+          runs[t].back().second ++;
+        } else {
+          runs[t].push_back({p, 1});
+        }
       }
     }
-    if (conflict > 0) {
-      ci->add_conflict(p_last, conflict);
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      for (auto& run : runs[t]) {
+        if (ci->num_conflicts_ > 0 
+            && ci->positions_[ci->num_conflicts_ - 1] == run.first) {
+          ci->conflicts_[ci->num_conflicts_ - 1] += run.second;
+        } else {
+          ci->add_conflict(run.first, run.second);
+        }
+      }
     }
     return ci;
   }
+  uint32_t p_last = std::min(std::max(model->predict(min_key), 0L), 
+                              static_cast<int64_t>(max_size - 1));
+  uint32_t conflict = 1;
+  for (uint32_t i = 1; i < size; ++ i) {
+    uint32_t p = std::min(std::max(model->predict(kvs[i].first), 0L), 
+                                  static_cast<int64_t>(max_size - 1));
+    if (p == p_last) {
+      conflict ++;
+    } else {
+      ci->add_conflict(p_last, conflict);
+      p_last = p;
+      conflict = 1;
+    }
+  }
+  if (conflict > 0) {
+    ci->add_conflict(p_last, conflict);
+  }
+  return ci;
 }
 
 template<typename KT, typename VT>
 uint32_t compute_tail_conflicts(const std::pair<KT, VT>* kvs, uint32_t size, 
                                 double size_amp, float kTailPercent=0.99) {
   // The input keys should be ordered
-  LinearModel<KT>* model = new LinearModel<KT>();
-  ConflictsInfo* ci = build_linear_model<KT, VT>(kvs, size, model, size_amp);
-  delete model;
+  LinearModel<KT> model;
+  ConflictsInfo* ci = build_linear_model<KT, VT>(kvs, size, &model, size_amp);
 
-  if (ci->num_conflicts_ == 0) {
+  if (ci == nullptr) {
+    return 0;
+  } else if (ci->num_conflicts_ == 0) {
     delete ci;
     return 0;
   } else {
@@ -122,5 +279,136 @@ uint32_t compute_tail_conflicts(const std::pair<KT, VT>* kvs, uint32_t size,
   }
 }
 
+// compute_tail_conflicts estimated from a sample, with the bounds of its 
+// confidence interval
+struct TailConflictsEstimate {
+  uint32_t estimate_;
+  uint32_t lower_;
+  uint32_t upper_;
+};
+
+// The conflicts at kTailPercent among the sampled runs of conflicts, each 
+// standing for weight runs of all keys, as compute_tail_conflicts returns 
+// them. The bounds are the conflicts at the ends of the binomial confidence 
+// interval of kTailPercent, z standard deviations wide for the effective 
+// number of sampled runs.
+inline TailConflictsEstimate tail_of_runs(
+    std::vector<std::pair<uint32_t, double>>& runs, float kTailPercent, 
+    double z) {
+  if (runs.empty()) {
+    return {0, 0, 0};
+  }
+  std::sort(runs.begin(), runs.end());
+  double weights = 0;
+  double squared_weights = 0;
+  for (auto& run : runs) {
+    weights += run.second;
+    squared_weights += run.second * run.second;
+  }
+  double num_effective = weights * weights / squared_weights;
+  double width = z * std::sqrt(kTailPercent * (1 - kTailPercent) 
+                                / num_effective);
+  auto conflicts_at = [&](double percent) {
+    double rank = std::min(std::max(percent, 0.), 1.) * weights;
+    double cum = 0;
+    for (auto& run : runs) {
+      cum += run.second;
+      if (cum >= rank) {
+        return run.first - 1;
+      }
+    }
+    return runs.back().first - 1;
+  };
+  return {conflicts_at(kTailPercent), conflicts_at(kTailPercent - width), 
+          conflicts_at(kTailPercent + width)};
+}
+
+// Estimate compute_tail_conflicts of the sorted keys from num_blocks blocks 
+// of block_size consecutive keys spread evenly over them. The model is that 
+// of every (size / num_samples)-th key scaled up to all keys. Every block 
+// counts the runs of equal positions that it meets, followed past its ends, 
+// and a run of c keys meets a block with probability about 
+// (c + block_size - 1) * num_blocks / size, by whose inverse it is weighted.
+template<typename KT, typename VT>
+TailConflictsEstimate estimate_tail_conflicts(const std::pair<KT, VT>* kvs, 
+                                              uint32_t size, 
+                                              uint32_t num_blocks, 
+                                              uint32_t block_size, 
+                                              double size_amp, 
+                                              float kTailPercent, double z) {
+  uint32_t num_samples = num_blocks * block_size;
+  if (size <= num_samples) {
+    uint32_t tail_conflicts = compute_tail_conflicts<KT, VT>(kvs, size, 
+                                size_amp, kTailPercent);
+    return {tail_conflicts, tail_conflicts, tail_conflicts};
+  }
+  // The first and the last keys are sampled, so that the scaled model is 
+  // anchored at the same keys as that of all keys
+  std::vector<std::pair<KT, VT>> samples(num_samples);
+  for (uint32_t i = 0; i < num_samples; ++ i) {
+    samples[i] = kvs[static_cast<uint64_t>(size - 1) * i / (num_samples - 1)];
+  }
+  LinearModel<KT> model;
+  ConflictsInfo* ci = build_linear_model<KT, VT>(samples.data(), num_samples, 
+                                                  &model, size_amp);
+  if (ci == nullptr) {
+    return {0, 0, 0};
+  }
+  delete ci;
+  model.slope_ *= static_cast<double>(size) / num_samples;
+  int64_t max_position = std::min(model.predict(kvs[size - 1].first), 
+                                  static_cast<int64_t>(size * size_amp) - 1);
+  auto position = [&](uint32_t i) {
+    return std::min(std::max(model.predict(kvs[i].first), 0L), max_position);
+  };
+  double stride = static_cast<double>(size) / num_blocks;
+  std::vector<std::pair<uint32_t, double>> runs;
+  uint32_t end = 0;
+  for (uint32_t b = 0; b < num_blocks; ++ b) {
+    uint32_t l = static_cast<uint64_t>(size) * b / num_blocks;
+    uint32_t r = std::min(l + block_size, size);
+    // A run that the last block followed into this one is counted once
+    for (uint32_t i = std::max(l, end); i < r; i = end) {
+      int64_t p = position(i);
+      uint32_t start = i;
+      while (start > 0 && position(start - 1) == p) {
+        start --;
+      }
+      end = i + 1;
+      while (end < size && position(end) == p) {
+        end ++;
+      }
+      uint32_t conflict = end - start;
+      runs.push_back({conflict, 
+                      stride / std::min(stride, conflict + block_size - 1.)});
+    }
+  }
+  return tail_of_runs(runs, kTailPercent, z);
+}
+
+// Estimate compute_tail_conflicts of all keys from a sorted sample of them 
+// drawn evenly over their ranks. The model of the sample has proportionally 
+// fewer slots, so its slots hold about as many sampled keys as the slots of 
+// the model of all keys hold keys. That holds where the keys spread smoothly 
+// at the scale of the slots of the sample, but unlike estimate_tail_conflicts 
+// it needs no other keys than the sampled ones.
+template<typename KT, typename VT>
+TailConflictsEstimate estimate_sample_tail_conflicts(
+    const std::pair<KT, VT>* samples, uint32_t num_samples, double size_amp, 
+    float kTailPercent, double z) {
+  LinearModel<KT> model;
+  ConflictsInfo* ci = build_linear_model<KT, VT>(samples, num_samples, &model, 
+                                                  size_amp);
+  if (ci == nullptr) {
+    return {0, 0, 0};
+  }
+  std::vector<std::pair<uint32_t, double>> runs(ci->num_conflicts_);
+  for (uint32_t i = 0; i < ci->num_conflicts_; ++ i) {
+    runs[i] = {ci->conflicts_[i], 1.};
+  }
+  delete ci;
+  return tail_of_runs(runs, kTailPercent, z);
+}
+
 }
 #endif
\ No newline at end of file
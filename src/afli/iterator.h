@@ -5,33 +5,84 @@
 
 namespace nfl {
 
+template<typename KT, typename VT>
+class TNode;
+
+// Points at a stored key and its value. Keys and values may live in separate
+// arrays, e.g., in buckets, and results of indexes that store no keys point 
+// at the value only.
 template<typename KT, typename VT>
 class ResultIterator {
 typedef std::pair<KT, VT> KVT;
 private:
-  KVT* kv_;
+  KT* key_;
+  VT* value_;
 
 public:
-  ResultIterator() : kv_(nullptr) { }
+  ResultIterator() : key_(nullptr), value_(nullptr) { }
+
+  ResultIterator(KT* key, VT* value) : key_(key), value_(value) { }
 
-  ResultIterator(KVT* kv) : kv_(kv) { }
+  ResultIterator(KVT* kv) : key_(&kv->first), value_(&kv->second) { }
 
-  bool is_end() { return kv_ == nullptr; }
+  bool is_end() { return value_ == nullptr; }
 
-  KT key() { return kv_->first; }
+  KT key() { return *key_; }
 
-  VT value() { return kv_->second; }
+  VT value() { return *value_; }
 
-  VT* value_addr() { return &kv_->second; }
+  VT* value_addr() { return value_; }
 
-  KVT* kv() { return kv_; }
+  KVT kv() { return {*key_, *value_}; }
 
   ResultIterator<KT, VT>& operator=(const ResultIterator<KT, VT>& other) {
     if (this != &other) {
-      kv_ = other.kv_;
+      key_ = other.key_;
+      value_ = other.value_;
+    }
+    return *this;
+  }
+};
+
+// Forward iterator over the key-ordered contents of a tree of TNodes.
+// The path keeps one frame per visited node, so advancing only touches the 
+// current leaf position and never descends from the root again.
+template<typename KT, typename VT>
+class ForwardIterator {
+typedef std::pair<KT, VT> KVT;
+public:
+  struct Frame {
+    TNode<KT, VT>*  node_;
+    uint32_t        pos_;       // The slot in a model node or the index in a 
+                                // dense node.
+    uint32_t        sub_pos_;   // The index inside the bucket at pos_.
+  };
+
+private:
+  std::vector<Frame> path_;
+  ResultIterator<KT, VT> cur_;
+
+public:
+  ForwardIterator() { }
+
+  bool is_end() { return cur_.is_end(); }
+
+  KT key() { return cur_.key(); }
+
+  VT value() { return cur_.value(); }
+
+  VT* value_addr() { return cur_.value_addr(); }
+
+  KVT kv() { return cur_.kv(); }
+
+  ForwardIterator<KT, VT>& operator++() {
+    if (!cur_.is_end()) {
+      cur_ = TNode<KT, VT>::next(path_);
     }
     return *this;
   }
+
+  friend class TNode<KT, VT>;
 };
 
 }
@@ -0,0 +1,138 @@
+#ifndef RUN_STATS_H
+#define RUN_STATS_H
+
+#include "util/common.h"
+
+namespace nfl {
+
+// Where an operation on an AFLI ended: at a data slot of a model node, in a
+// bucket or in a dense node. Lookups that miss end where the key would be.
+enum RunStatPlace : uint8_t {
+  kAtModel = 0,
+  kAtBucket = 1,
+  kAtDense = 2
+};
+
+// The running statistics policy of an AFLI, picked at compile time like the
+// NodeAllocator policy. The nodes call its hooks on every operation, so the
+// policy of production builds records nothing and its calls compile away.
+struct NoRunStat {
+  static constexpr bool kEnabled = false;
+
+  static inline void on_query(RunStatPlace place, uint32_t depth) { }
+  static inline void on_update(RunStatPlace place) { }
+  static inline void on_insert(RunStatPlace place) { }
+  static inline void on_remove(RunStatPlace place) { }
+  static inline void on_prediction() { }
+  static inline void on_comparisons(uint32_t n) { }
+  static inline void on_rebuild(uint32_t num_data) { }
+
+  static RunStat collect() { return RunStat(); }
+  static void reset() { }
+};
+
+// Records into a RunStat of the calling thread, so that the hooks are plain
+// increments on a line no other thread writes. collect sums the statistics
+// of all threads, including those that have exited; collect and reset must
+// not run while other threads operate on the index.
+class ThreadRunStat {
+private:
+  struct Registry {
+    std::mutex mutex_;
+    std::vector<RunStat*> live_;
+    RunStat retired_;             // The statistics of exited threads.
+  };
+
+  struct alignas(64) Local {
+    RunStat stat_;
+
+    Local() {
+      Registry& reg = registry();
+      std::lock_guard<std::mutex> guard(reg.mutex_);
+      reg.live_.push_back(&stat_);
+    }
+
+    ~Local() {
+      Registry& reg = registry();
+      std::lock_guard<std::mutex> guard(reg.mutex_);
+      reg.retired_.merge(stat_);
+      reg.live_.erase(std::find(reg.live_.begin(), reg.live_.end(), &stat_));
+    }
+  };
+
+  static Registry& registry() {
+    static Registry reg;
+    return reg;
+  }
+
+  static inline RunStat& local() {
+    thread_local Local l;
+    return l.stat_;
+  }
+
+public:
+  static constexpr bool kEnabled = true;
+
+  static inline void on_query(RunStatPlace place, uint32_t depth) {
+    RunStat& rs = local();
+    rs.num_queries_ ++;
+    rs.num_query_depth_ += depth;
+    (place == kAtModel ? rs.num_query_model_ : place == kAtBucket
+      ? rs.num_query_bucket_ : rs.num_query_dense_) ++;
+  }
+
+  static inline void on_update(RunStatPlace place) {
+    RunStat& rs = local();
+    rs.num_updates_ ++;
+    (place == kAtModel ? rs.num_update_model_ : place == kAtBucket
+      ? rs.num_update_bucket_ : rs.num_update_dense_) ++;
+  }
+
+  static inline void on_insert(RunStatPlace place) {
+    RunStat& rs = local();
+    rs.num_inserts_ ++;
+    (place == kAtModel ? rs.num_insert_model_ : place == kAtBucket
+      ? rs.num_insert_bucket_ : rs.num_insert_dense_) ++;
+  }
+
+  static inline void on_remove(RunStatPlace place) {
+    RunStat& rs = local();
+    rs.num_removes_ ++;
+    (place == kAtModel ? rs.num_remove_model_ : place == kAtBucket
+      ? rs.num_remove_bucket_ : rs.num_remove_dense_) ++;
+  }
+
+  static inline void on_prediction() { local().num_predictions_ ++; }
+
+  static inline void on_comparisons(uint32_t n) {
+    local().num_comparisons_ += n;
+  }
+
+  static inline void on_rebuild(uint32_t num_data) {
+    RunStat& rs = local();
+    rs.num_rebuilds_ ++;
+    rs.num_data_rebuild_ += num_data;
+  }
+
+  static RunStat collect() {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.mutex_);
+    RunStat rs = reg.retired_;
+    for (RunStat* stat : reg.live_) {
+      rs.merge(*stat);
+    }
+    return rs;
+  }
+
+  static void reset() {
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> guard(reg.mutex_);
+    reg.retired_ = RunStat();
+    for (RunStat* stat : reg.live_) {
+      *stat = RunStat();
+    }
+  }
+};
+
+}
+#endif
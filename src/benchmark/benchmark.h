@@ -5,6 +5,7 @@
 #include "util/common.h"
 
 #include "afli/afli.h"
+#include "afli/concurrent_afli.h"
 #include "ALEX/src/core/alex.h"
 #include "BTree/btree_map.h"
 #include "lipp/src/core/lipp.h"
@@ -13,6 +14,14 @@
 
 namespace nfl {
 
+// Build with NFL_RUN_STATS defined to record and print the running 
+// statistics of AFLI and NFL. They cost time on every request.
+#ifdef NFL_RUN_STATS
+typedef ThreadRunStat BenchRunStat;
+#else
+typedef NoRunStat BenchRunStat;
+#endif
+
 struct LIPPConfig {
   LIPPConfig(std::string path) { }
 };
@@ -62,10 +71,12 @@ struct BTreeConfig {
 struct AFLIConfig {
   int bucket_size;
   int aggregate_size;
+  int num_threads;
 
   AFLIConfig(std::string path) {
     bucket_size = -1;
     aggregate_size = 0;
+    num_threads = 1;
     if (path != "") {
       std::ifstream in(path, std::ios::in);
       if (in.is_open()) {
@@ -80,6 +91,8 @@ struct AFLIConfig {
               bucket_size = std::stoi(val);
             } else if (key == "aggregate_size") {
               aggregate_size = std::stoi(val);
+            } else if (key == "num_threads") {
+              num_threads = std::stoi(val);
             }
           }
         }
@@ -93,11 +106,39 @@ struct NFLConfig {
   int bucket_size;
   int aggregate_size;
   std::string weights_path;
+  // precision=float32 lets the flow run in float32, see NFL::check_float32
+  bool float32;
+  // pipeline=1 overlaps the flow and the index of consecutive batches, see 
+  // NFL::execute
+  bool pipeline;
+  // storage=compact stores no original keys in the index of transformed 
+  // keys, see CompactKeys
+  bool compact;
+  // transform_cache=n caches the transformed keys of n hot keys, see 
+  // TransformCache
+  uint64_t transform_cache;
+  // piecewise_error=e compiles the flow from the keys to bulk load into a 
+  // piecewise-linear approximation within e of the transformed keys, and 
+  // piecewise_path=p loads one that flow_convert compiled, see PiecewiseFlow
+  double piecewise_error;
+  std::string piecewise_path;
+  // rebuild=1 rebuilds the index in the background once inserts raised its 
+  // lookup cost enough, and rebuild_weights=a,b lets the rebuild try these 
+  // weights as well, see NFL::enable_rebuild
+  bool rebuild;
+  std::vector<std::string> rebuild_weights;
 
   NFLConfig(std::string path) {
     bucket_size = -1;
     aggregate_size = 0;
     weights_path = "";
+    float32 = false;
+    pipeline = false;
+    compact = false;
+    transform_cache = 0;
+    piecewise_error = 0;
+    piecewise_path = "";
+    rebuild = false;
     if (path != "") {
       std::ifstream in(path, std::ios::in);
       if (in.is_open()) {
@@ -114,6 +155,26 @@ struct NFLConfig {
               aggregate_size = std::stoi(val);
             } else if (key == "weights_path") {
               weights_path = val;
+            } else if (key == "precision") {
+              float32 = val == "float32";
+            } else if (key == "pipeline") {
+              pipeline = std::stoi(val) != 0;
+            } else if (key == "storage") {
+              compact = val == "compact";
+            } else if (key == "transform_cache") {
+              transform_cache = std::stoull(val);
+            } else if (key == "piecewise_error") {
+              piecewise_error = std::stod(val);
+            } else if (key == "piecewise_path") {
+              piecewise_path = val;
+            } else if (key == "rebuild") {
+              rebuild = std::stoi(val) != 0;
+            } else if (key == "rebuild_weights") {
+              std::stringstream paths(val);
+              std::string path;
+              while (std::getline(paths, path, ',')) {
+                rebuild_weights.push_back(path);
+              }
             }
           }
         }
@@ -187,6 +248,8 @@ public:
       run_pgm(batch_size, exp_res, config_path, show_stat);
     } else if (start_with(index_name, "btree")) {
       run_btree(batch_size, exp_res, config_path, show_stat);
+    } else if (start_with(index_name, "afli-olc")) {
+      run_concurrent_afli(batch_size, exp_res, config_path, show_stat);
     } else if (start_with(index_name, "afli")) {
       run_afli(batch_size, exp_res, config_path, show_stat);
     } else if (start_with(index_name, "nfl")) {
@@ -453,7 +516,7 @@ public:
     AFLIConfig config(config_path);
     // Start to bulk load
     auto bulk_load_start = std::chrono::high_resolution_clock::now();
-    AFLI<KT, VT> afli;
+    AFLI<KT, VT, ArenaAllocator, BenchRunStat> afli;
     afli.bulk_load(init_data.data(), init_data.size());
     auto bulk_load_end = std::chrono::high_resolution_clock::now();
     exp_res.bulk_load_index_time = 
@@ -465,6 +528,11 @@ public:
 
     std::vector<KVT> batch_data;
     batch_data.reserve(batch_size);
+    std::vector<KT> batch_keys;
+    batch_keys.reserve(batch_size);
+    std::vector<ResultIterator<KT, VT>> batch_results(batch_size);
+    // Count the requests only
+    BenchRunStat::reset();
     // Perform requests in batch
     int num_batches = std::ceil(requests.size() * 1. / batch_size);
     exp_res.latencies.reserve(num_batches * 3);
@@ -474,8 +542,10 @@ public:
       int l = batch_idx * batch_size;
       int r = std::min((batch_idx + 1) * batch_size, 
                         static_cast<int>(requests.size()));
+      batch_keys.clear();
       for (int i = l; i < r; ++ i) {
         batch_data.push_back(requests[i].kv);
+        batch_keys.push_back(requests[i].kv.first);
       }
 
       VT val_sum = 0;
@@ -484,10 +554,19 @@ public:
       for (int i = l; i < r; ++ i) {
         int data_idx = i - l;
         if (requests[i].op == kQuery) {
-          auto it = afli.find(batch_data[data_idx].first);
-          if (!it.is_end()) {
-            val_sum += it.value();
+          // Look up the run of consecutive queries together
+          int j = i + 1;
+          while (j < r && requests[j].op == kQuery) {
+            j ++;
+          }
+          afli.find_batch(batch_keys.data() + data_idx, j - i, 
+                          batch_results.data() + data_idx);
+          for (int k = data_idx; k < j - l; ++ k) {
+            if (!batch_results[k].is_end()) {
+              val_sum += batch_results[k].value();
+            }
           }
+          i = j - 1;
         } else if (requests[i].op == kUpdate) {
           bool res = afli.update(batch_data[data_idx]);
         } else if (requests[i].op == kInsert) {
@@ -508,14 +587,110 @@ public:
     if (show_stat) {
       afli.print_stats();
     }
+    if (BenchRunStat::kEnabled) {
+      afli.run_stats().show();
+    }
+  }
+
+  // Batches are dealt round-robin to the worker threads. The indexing time 
+  // is the wall-clock time of all workers, so the overall throughput counts 
+  // requests served in parallel.
+  void run_concurrent_afli(int batch_size, ExperimentalResults& exp_res, 
+                          std::string config_path, bool show_stat=false) {
+    AFLIConfig config(config_path);
+    // Start to bulk load
+    auto bulk_load_start = std::chrono::high_resolution_clock::now();
+    ConcurrentAFLI<KT, VT> afli;
+    afli.bulk_load(init_data.data(), init_data.size());
+    auto bulk_load_end = std::chrono::high_resolution_clock::now();
+    exp_res.bulk_load_index_time = 
+      std::chrono::duration_cast<std::chrono::nanoseconds>(bulk_load_end 
+                                                    - bulk_load_start).count();
+    if (show_stat) {
+      afli.print_stats();
+    }
+
+    int num_threads = std::max(config.num_threads, 1);
+    int num_batches = std::ceil(requests.size() * 1. / batch_size);
+    std::vector<std::vector<std::pair<double, double>>> latencies(num_threads);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < num_threads; ++ t) {
+      workers.emplace_back([&, t]() {
+        VT val_sum = 0;
+        for (int batch_idx = t; batch_idx < num_batches; 
+              batch_idx += num_threads) {
+          int l = batch_idx * batch_size;
+          int r = std::min((batch_idx + 1) * batch_size, 
+                            static_cast<int>(requests.size()));
+          auto batch_start = std::chrono::high_resolution_clock::now();
+          for (int i = l; i < r; ++ i) {
+            if (requests[i].op == kQuery) {
+              VT val;
+              if (afli.find(requests[i].kv.first, val)) {
+                val_sum += val;
+              }
+            } else if (requests[i].op == kUpdate) {
+              bool res = afli.update(requests[i].kv);
+            } else if (requests[i].op == kInsert) {
+              afli.insert(requests[i].kv);
+            } else if (requests[i].op == kDelete) {
+              int res = afli.remove(requests[i].kv.first);
+            }
+          }
+          auto batch_end = std::chrono::high_resolution_clock::now();
+          double time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          batch_end - batch_start).count();
+          latencies[t].push_back({0, time});
+        }
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    exp_res.sum_indexing_time = 
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    exp_res.latencies.reserve(num_batches);
+    exp_res.need_compute.reserve(num_batches);
+    for (int batch_idx = 0; batch_idx < num_batches; ++ batch_idx) {
+      int t = batch_idx % num_threads;
+      exp_res.latencies.push_back(latencies[t][batch_idx / num_threads]);
+      exp_res.num_requests += std::min((batch_idx + 1) * batch_size, 
+                                static_cast<int>(requests.size())) 
+                              - batch_idx * batch_size;
+      exp_res.step();
+    }
+    exp_res.model_size = afli.model_size();
+    exp_res.index_size = afli.index_size();
+    if (show_stat) {
+      afli.print_stats();
+    }
   }
 
   void run_nfl(int batch_size, ExperimentalResults& exp_res, 
                 std::string config_path, bool show_stat=false) {
     NFLConfig config(config_path);
+    if (config.compact) {
+      run_nfl<CompactKeys>(batch_size, exp_res, config, show_stat);
+    } else {
+      run_nfl<FullKeys>(batch_size, exp_res, config, show_stat);
+    }
+  }
+
+  template<template<typename, typename> class Storage>
+  void run_nfl(int batch_size, ExperimentalResults& exp_res, 
+                const NFLConfig& config, bool show_stat) {
     // Start to bulk load
     auto bulk_load_start = std::chrono::high_resolution_clock::now();
-    NFL<KT, VT> nfl(config.weights_path, batch_size);
+    NFL<KT, VT, BenchRunStat, Storage> nfl(config.weights_path, batch_size, 
+                                            config.float32);
+    if (config.piecewise_path != "") {
+      nfl.load_compiled_flow(config.piecewise_path);
+    } else if (config.piecewise_error > 0) {
+      nfl.compile_flow(init_data.data(), init_data.size(), 
+                        config.piecewise_error);
+    }
     uint32_t tail_conflicts = nfl.auto_switch(init_data.data(), 
                                               init_data.size());
     auto bulk_load_mid = std::chrono::high_resolution_clock::now();
@@ -528,60 +703,138 @@ public:
       std::chrono::duration_cast<std::chrono::nanoseconds>(bulk_load_end 
                                                       - bulk_load_mid).count();
     if (show_stat) {
+      if (config.float32) {
+        std::cout << "Flow precision\t" 
+                  << (nfl.float32() ? "float32" : "double") << std::endl;
+      }
+      if (nfl.compiled_flow_knots() > 0) {
+        std::cout << "Piecewise flow knots\t" << nfl.compiled_flow_knots() 
+                  << std::endl;
+      }
       nfl.print_stats();
     }
+    if (config.transform_cache > 0) {
+      nfl.enable_transform_cache(config.transform_cache);
+    }
+    if (config.rebuild) {
+      if constexpr (Storage<KT, VT>::kKeepsKeys) {
+        nfl.enable_rebuild(config.rebuild_weights);
+      } else {
+        assert_p(false, "rebuild needs the original keys, not storage=compact");
+      }
+    }
 
     std::vector<KVT> batch_data;
     batch_data.reserve(batch_size);
+    // Count the requests only
+    BenchRunStat::reset();
     // Perform requests in batch
     int num_batches = std::ceil(requests.size() * 1. / batch_size);
     exp_res.latencies.reserve(num_batches * 3);
     exp_res.need_compute.reserve(num_batches * 3);
-    for (int batch_idx = 0; batch_idx < num_batches; ++ batch_idx) {
-      batch_data.clear();
-      int l = batch_idx * batch_size;
-      int r = std::min((batch_idx + 1) * batch_size, 
-                        static_cast<int>(requests.size()));
-      for (int i = l; i < r; ++ i) {
-        batch_data.push_back(requests[i].kv);
+    if (config.pipeline && batch_size > 1) {
+      // The flow of a batch overlaps the index of the previous one, so the 
+      // time of a batch is counted as indexing time
+      std::vector<std::pair<bool, VT>> results(requests.size());
+      std::vector<double> batch_latencies(num_batches);
+      auto start = std::chrono::high_resolution_clock::now();
+      nfl.execute(requests.data(), requests.size(), results.data(), 
+                  batch_latencies.data());
+      auto end = std::chrono::high_resolution_clock::now();
+      exp_res.sum_indexing_time += 
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end 
+                                                        - start).count();
+      for (int batch_idx = 0; batch_idx < num_batches; ++ batch_idx) {
+        int l = batch_idx * batch_size;
+        int r = std::min((batch_idx + 1) * batch_size, 
+                          static_cast<int>(requests.size()));
+        exp_res.num_requests += r - l;
+        exp_res.latencies.push_back({0, batch_latencies[batch_idx]});
+        exp_res.step();
       }
+    } else {
+      for (int batch_idx = 0; batch_idx < num_batches; ++ batch_idx) {
+        batch_data.clear();
+        int l = batch_idx * batch_size;
+        int r = std::min((batch_idx + 1) * batch_size, 
+                          static_cast<int>(requests.size()));
+        for (int i = l; i < r; ++ i) {
+          batch_data.push_back(requests[i].kv);
+        }
 
-      VT val_sum = 0;
-      // Perform requests
-      auto start = std::chrono::high_resolution_clock::now();
-      nfl.transform(batch_data.data(), batch_data.size());
-      auto mid = std::chrono::high_resolution_clock::now();
-      for (int i = l; i < r; ++ i) {
-        int data_idx = i - l;
-        if (requests[i].op == kQuery) {
-          auto it = nfl.find(data_idx);
-          if (!it.is_end()) {
-              val_sum += it.value();
+        VT val_sum = 0;
+        // Perform requests. Unbatched requests transform their own keys, which 
+        // is counted as indexing time.
+        auto start = std::chrono::high_resolution_clock::now();
+        if (batch_size == 1) {
+          const KVT& kv = batch_data[0];
+          if (requests[l].op == kQuery) {
+            auto it = nfl.find(kv.first);
+            if (!it.is_end()) {
+                val_sum += it.value();
+            }
+          } else if (requests[l].op == kUpdate) {
+            bool res = nfl.update(kv);
+          } else if (requests[l].op == kInsert) {
+            nfl.insert(kv);
+          } else if (requests[l].op == kDelete) {
+            int res = nfl.remove(kv.first);
+          }
+          auto end = std::chrono::high_resolution_clock::now();
+          double time = std::chrono::duration_cast<std::chrono::nanoseconds>(end 
+                                                              - start).count();
+          exp_res.sum_indexing_time += time;
+          exp_res.num_requests += 1;
+          exp_res.latencies.push_back({0, time});
+          exp_res.step();
+          continue;
+        }
+        nfl.transform(batch_data.data(), batch_data.size());
+        auto mid = std::chrono::high_resolution_clock::now();
+        for (int i = l; i < r; ++ i) {
+          int data_idx = i - l;
+          if (requests[i].op == kQuery) {
+            auto it = nfl.find_at(data_idx);
+            if (!it.is_end()) {
+                val_sum += it.value();
+            }
+          } else if (requests[i].op == kUpdate) {
+            bool res = nfl.update_at(data_idx);
+          } else if (requests[i].op == kInsert) {
+            nfl.insert_at(data_idx);
+          } else if (requests[i].op == kDelete) {
+            int res = nfl.remove_at(data_idx);
           }
-        } else if (requests[i].op == kUpdate) {
-          bool res = nfl.update(data_idx);
-        } else if (requests[i].op == kInsert) {
-          nfl.insert(data_idx);
-        } else if (requests[i].op == kDelete) {
-          int res = nfl.remove(data_idx);
         }
+        auto end = std::chrono::high_resolution_clock::now();
+        double time1 = std::chrono::duration_cast<std::chrono::nanoseconds>(mid 
+                                                                - start).count();
+        double time2 = std::chrono::duration_cast<std::chrono::nanoseconds>(end 
+                                                                - mid).count();
+        exp_res.sum_transform_time += time1;
+        exp_res.sum_indexing_time += time2;
+        exp_res.num_requests += batch_data.size();
+        exp_res.latencies.push_back({time1, time2});
+        exp_res.step();
       }
-      auto end = std::chrono::high_resolution_clock::now();
-      double time1 = std::chrono::duration_cast<std::chrono::nanoseconds>(mid 
-                                                              - start).count();
-      double time2 = std::chrono::duration_cast<std::chrono::nanoseconds>(end 
-                                                              - mid).count();
-      exp_res.sum_transform_time += time1;
-      exp_res.sum_indexing_time += time2;
-      exp_res.num_requests += batch_data.size();
-      exp_res.latencies.push_back({time1, time2});
-      exp_res.step();
     }
+    // A rebuild still in flight replaces the index before it is measured
+    nfl.finish_rebuild();
     exp_res.model_size = nfl.model_size();
     exp_res.index_size = nfl.index_size();
     if (show_stat) {
       nfl.print_stats();
     }
+    if (config.transform_cache > 0) {
+      std::cout << "Transform cache hit rate\t" 
+                << nfl.transform_cache_hit_rate() << std::endl;
+    }
+    if (config.rebuild) {
+      std::cout << "Rebuilds\t" << nfl.num_rebuilds() << std::endl;
+    }
+    if (BenchRunStat::kEnabled) {
+      nfl.run_stats().show();
+    }
   }
 };
 
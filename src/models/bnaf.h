@@ -1,22 +1,68 @@
 #ifndef BNAF_H
 #define BNAF_H
 
+#include "models/flow_kernel.h"
 #include "util/common.h"
 
+#ifdef NFL_USE_MKL
 #include <mkl.h>
 #include <mkl_cblas.h>
+#endif
 
 namespace nfl {
 
+// 64-byte aligned, zeroed buffers of the flow
+inline double* flow_calloc(uint64_t n) {
+#ifdef NFL_USE_MKL
+  return static_cast<double*>(mkl_calloc(n, sizeof(double), 64));
+#else
+  uint64_t bytes = std::max((sizeof(double) * n + 63) / 64 * 64, 
+                            static_cast<uint64_t>(64));
+  void* ptr = std::aligned_alloc(64, bytes);
+  std::memset(ptr, 0, bytes);
+  return static_cast<double*>(ptr);
+#endif
+}
+
+inline void flow_free(double* ptr) {
+#ifdef NFL_USE_MKL
+  mkl_free(ptr);
+#else
+  std::free(ptr);
+#endif
+}
+
+// The buffers of the generic flow for a batch of keys. Threads that run a 
+// flow at once need one each.
+struct FlowBuffers {
+  double* inputs_;
+  double* outputs_[2];
+
+  FlowBuffers(uint32_t batch_size, int in_dim, int hidden_dim) {
+    inputs_ = flow_calloc(batch_size * in_dim);
+    outputs_[0] = flow_calloc(batch_size * hidden_dim);
+    outputs_[1] = flow_calloc(batch_size * hidden_dim);
+  }
+
+  FlowBuffers(const FlowBuffers&) = delete;
+  FlowBuffers& operator=(const FlowBuffers&) = delete;
+
+  ~FlowBuffers() {
+    flow_free(inputs_);
+    flow_free(outputs_[0]);
+    flow_free(outputs_[1]);
+  }
+};
+
 template<typename KT, typename VT>
 class BNAF_Infer {
 typedef std::pair<KT, VT> KVT;
-typedef std::pair<KT, KVT> KKVT;
+typedef std::pair<double, KVT> KKVT;
 public:
   int num_layers_;
-  MKL_INT batch_size_;
-  MKL_INT in_dim_;
-  MKL_INT hidden_dim_;
+  int batch_size_;
+  int in_dim_;
+  int hidden_dim_;
   double** weights_;
   // 1: in_dim_ * hidden_dim_
   // 2: hidden_dim_ * hidden_dim_
@@ -24,29 +70,84 @@ public:
   // n: hidden_dim_ * in_dim_
   double* inputs_;
   double* outputs_[2];
+  // Runs small flows without the buffers above, nullptr for larger ones
+  FusedFlowTransform<double, KKVT> fused_;
+  // The float32 mode runs the fused kernel on float copies of the weights
+  float** weights_f_;
+  FusedFlowTransform<float, KKVT> fused_f_;
+  bool float32_;
+  // The weights point into a mapped flow file, see flow_file.h
+  bool mapped_;
+  // The float copies were made by select_kernel rather than mapped
+  bool owns_weights_f_;
 public:
-  BNAF_Infer() : inputs_(nullptr), weights_(nullptr) {
+  BNAF_Infer() : inputs_(nullptr), weights_(nullptr), fused_(nullptr), 
+                  weights_f_(nullptr), fused_f_(nullptr), float32_(false), 
+                  mapped_(false), owns_weights_f_(false) {
     outputs_[0] = nullptr;
     outputs_[1] = nullptr;
   }
 
   ~BNAF_Infer() {
-    for (int i = 0; i < num_layers_; ++ i) {
+    for (int i = 0; i < num_layers_ && !mapped_; ++ i) {
       if (weights_[i] != nullptr) {
-        mkl_free(weights_[i]);
+        flow_free(weights_[i]);
       }
     }
+    delete[] weights_;
     if (inputs_ != nullptr) {
-      mkl_free(inputs_);
+      flow_free(inputs_);
     }
     if (outputs_[0] != nullptr) {
-      mkl_free(outputs_[0]);
+      flow_free(outputs_[0]);
     }
     if (outputs_[1] != nullptr) {
-      mkl_free(outputs_[1]);
+      flow_free(outputs_[1]);
+    }
+    if (weights_f_ != nullptr) {
+      for (int i = 0; i < num_layers_ && owns_weights_f_; ++ i) {
+        delete[] weights_f_[i];
+      }
+      delete[] weights_f_;
     }
   }
 
+  // Pick the kernels once the dimensions and weights are loaded. Without 
+  // fused, all layers run on the generic loops. The float copies of the 
+  // weights are made unless the loader provided them.
+  void select_kernel(bool fused=true) {
+    if (!fused) {
+      return;
+    }
+    fused_ = select_fused_flow_transform<double, KKVT>(in_dim_, hidden_dim_);
+    // float32 only pays off where a vector holds twice as many floats
+    if (FlowLanes<float>::kWidth > FlowLanes<double>::kWidth) {
+      fused_f_ = select_fused_flow_transform<float, KKVT>(in_dim_, hidden_dim_);
+    }
+    if (fused_f_ != nullptr && weights_f_ == nullptr) {
+      weights_f_ = new float*[num_layers_];
+      owns_weights_f_ = true;
+      for (int i = 0; i < num_layers_; ++ i) {
+        uint32_t n = num_weights(i);
+        weights_f_[i] = new float[n];
+        for (uint32_t j = 0; j < n; ++ j) {
+          weights_f_[i][j] = static_cast<float>(weights_[i][j]);
+        }
+      }
+    }
+  }
+
+  // Run the layers in float32 or double. Only the fused kernel has a float32 
+  // version, so return whether the requested precision is in use.
+  bool set_float32(bool float32) {
+    float32_ = float32 && fused_f_ != nullptr;
+    return float32_ == float32;
+  }
+
+  bool float32() const {
+    return float32_;
+  }
+
   uint64_t model_size() {
     return 0;
   }
@@ -54,30 +155,64 @@ public:
   uint64_t size() {
     return sizeof(BNAF_Infer<KT, VT>) + sizeof(double*) * num_layers_ 
           + sizeof(double) * (batch_size_ * in_dim_ + batch_size_ * hidden_dim_ * 2)
-          + sizeof(double) * (in_dim_ * hidden_dim_ * 2 + (num_layers_ - 2) * hidden_dim_ * hidden_dim_);
+          + sizeof(double) * (in_dim_ * hidden_dim_ * 2 + (num_layers_ - 2) * hidden_dim_ * hidden_dim_)
+          + (weights_f_ == nullptr ? 0 : sizeof(float*) * num_layers_ 
+            + sizeof(float) * (in_dim_ * hidden_dim_ * 2 + (num_layers_ - 2) * hidden_dim_ * hidden_dim_));
   }
 
   void set_batch_size(uint32_t batch_size) {
     batch_size_ = batch_size;
     if (inputs_ != nullptr) {
-      mkl_free(inputs_);
+      flow_free(inputs_);
     }
     if (outputs_[0] != nullptr) {
-      mkl_free(outputs_[0]);
+      flow_free(outputs_[0]);
     }
     if (outputs_[1] != nullptr) {
-      mkl_free(outputs_[1]);
+      flow_free(outputs_[1]);
     }
-    inputs_= (double*)mkl_calloc(batch_size_ * in_dim_, sizeof(double), 64);
-    outputs_[0] = (double*)mkl_calloc(batch_size_ * hidden_dim_, sizeof(double), 64);
-    outputs_[1] = (double*)mkl_calloc(batch_size_ * hidden_dim_, sizeof(double), 64);
+    inputs_= flow_calloc(batch_size_ * in_dim_);
+    outputs_[0] = flow_calloc(batch_size_ * hidden_dim_);
+    outputs_[1] = flow_calloc(batch_size_ * hidden_dim_);
   }
 
+  // Transform at most batch_size_ keys
   void transform(KKVT* tran_kvs, uint32_t size) {
-    prepare_inputs(tran_kvs, size);
-    forward();
-    prepare_outputs(tran_kvs, size);
+    transform(tran_kvs, size, inputs_, outputs_);
   }
+
+  // The same on buffers of the caller for at most batch_size_ keys
+  void transform(KKVT* tran_kvs, uint32_t size, FlowBuffers& buffers) const {
+    transform(tran_kvs, size, buffers.inputs_, buffers.outputs_);
+  }
+
+  // Transform one key on the stack, without the buffers of the batch, so that 
+  // concurrent callers do not need one each
+  void transform(KKVT& tran_kv) const {
+    if (float32_) {
+      fused_f_(weights_f_, num_layers_, &tran_kv, 1);
+      return;
+    }
+    if (fused_ != nullptr) {
+      fused_(weights_, num_layers_, &tran_kv, 1);
+      return;
+    }
+    std::vector<double> in(in_dim_);
+    std::vector<double> out[2] = {std::vector<double>(hidden_dim_), 
+                                  std::vector<double>(hidden_dim_)};
+    prepare_input(tran_kv.first, in.data());
+    matmul(in.data(), weights_[0], out[0].data(), 1, in_dim_, hidden_dim_);
+    tanh(out[0].data(), out[1].data(), hidden_dim_);
+    for (int i = 1; i < num_layers_ - 1; ++ i) {
+      matmul(out[1].data(), weights_[i], out[0].data(), 1, hidden_dim_, 
+            hidden_dim_);
+      tanh(out[0].data(), out[1].data(), hidden_dim_);
+    }
+    matmul(out[1].data(), weights_[num_layers_ - 1], in.data(), 1, 
+          hidden_dim_, in_dim_);
+    tran_kv.first = prepare_output(in.data());
+  }
+
   void print_parameters() {
     std::cout << "Layers\t" << num_layers_ << std::endl;
     std::cout << "Input Dim\t" << in_dim_ << std::endl;
@@ -88,88 +223,130 @@ public:
   }
 
 private:
-  void prepare_inputs(const KKVT* tran_kvs, uint32_t size) {
-    if (in_dim_ == 1) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        inputs_[i] = tran_kvs[i].first;
-      }
-    } else if (in_dim_ == 2) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        inputs_[2 * i] = tran_kvs[i].first;
-        inputs_[2 * i + 1] = tran_kvs[i].first - std::floor(inputs_[2 * i]);
-      }
-    } else if (in_dim_ == 4) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        inputs_[4 * i] = tran_kvs[i].first;
-        inputs_[4 * i + 1] = std::floor(inputs_[2 * i]);
-        double tmp = (tran_kvs[i].first - inputs_[4 * i + 1]) * 1000000;
-        inputs_[4 * i + 2] = std::floor(tmp);
-        inputs_[4 * i + 3] = tmp - inputs_[4 * i + 2];
-      }
-    } else {
-      std::cout << "Unsupported dimensions\t" << in_dim_ << std::endl;
-      exit(-1);
+  void transform(KKVT* tran_kvs, uint32_t size, double* inputs, 
+                  double* const* outputs) const {
+    if (float32_) {
+      fused_f_(weights_f_, num_layers_, tran_kvs, size);
+      return;
+    }
+    if (fused_ != nullptr) {
+      fused_(weights_, num_layers_, tran_kvs, size);
+      return;
+    }
+    prepare_inputs(tran_kvs, size, inputs);
+    forward(size, inputs, outputs);
+    prepare_outputs(tran_kvs, size, inputs);
+  }
+
+  // The number of weights of layer l
+  uint32_t num_weights(int l) const {
+    if (l == 0 || l == num_layers_ - 1) {
+      return in_dim_ * hidden_dim_;
     }
+    return hidden_dim_ * hidden_dim_;
   }
 
-  void prepare_outputs(KKVT* tran_kvs, uint32_t size) {
+  void prepare_inputs(const KKVT* tran_kvs, uint32_t size, 
+                      double* inputs) const {
+    for (uint32_t i = 0; i < size; ++ i) {
+      prepare_input(tran_kvs[i].first, inputs + i * in_dim_);
+    }
+  }
+
+  void prepare_outputs(KKVT* tran_kvs, uint32_t size, 
+                        const double* outputs) const {
+    for (uint32_t i = 0; i < size; ++ i) {
+      tran_kvs[i].first = prepare_output(outputs + i * in_dim_);
+    }
+  }
+
+  // The input features of a key
+  void prepare_input(double key, double* in) const {
     if (in_dim_ == 1) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        tran_kvs[i] = {inputs_[i], tran_kvs[i].second};
-      }
+      in[0] = key;
     } else if (in_dim_ == 2) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        tran_kvs[i] = {inputs_[i * 2] + inputs_[i * 2 + 1], tran_kvs[i].second};
-      }
+      in[0] = key;
+      in[1] = key - std::floor(in[0]);
     } else if (in_dim_ == 4) {
-      for (uint32_t i = 0; i < size; ++ i) {
-        tran_kvs[i] = {inputs_[i * 4] + inputs_[i * 4 + 1] + inputs_[i * 4 + 2] + inputs_[i * 4 + 3], tran_kvs[i].second};
-      }
+      in[0] = key;
+      in[1] = std::floor(in[0]);
+      double tmp = (key - in[1]) * 1000000;
+      in[2] = std::floor(tmp);
+      in[3] = tmp - in[2];
     } else {
       std::cout << "Unsupported dimensions\t" << in_dim_ << std::endl;
       exit(-1);
     }
   }
 
-  void forward() {
-    // print_outputs(-1, inputs_, batch_size_, in_dim_);
-    // Compute the formula: 
-    //            alpha * mat_a [m * k] * mat_b [k * n] + beta * mat_c [m * n]
-    // cblas_dgemm(layout, trans_a, trans_b, m, n, k, alpha, mat_a, lda, 
-    //              mat_b, ldb, beta, mat_c, ldc)
-    // IN [batch_size_ * in_dim] * W_0 [in_dim * hidden_dim] = 
-    // OUT [batch_size_ * hidden_dim]
-    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, 
-                batch_size_, hidden_dim_, in_dim_, 
-                1, inputs_, in_dim_, 
-                weights_[0], hidden_dim_, 
-                0, outputs_[0], hidden_dim_);
+  // The transformed key of the outputs of the last layer
+  double prepare_output(const double* out) const {
+    double key = out[0];
+    for (int i = 1; i < in_dim_; ++ i) {
+      key += out[i];
+    }
+    return key;
+  }
+
+  // Only the first num_rows rows of the buffers hold keys
+  void forward(int num_rows, double* inputs, double* const* outputs) const {
+    // print_outputs(-1, inputs, num_rows, in_dim_);
+    // IN [num_rows * in_dim] * W_0 [in_dim * hidden_dim] = 
+    // OUT [num_rows * hidden_dim]
+    matmul(inputs, weights_[0], outputs[0], num_rows, in_dim_, hidden_dim_);
     // print_weight_matrix(0);
-    // print_outputs(0, outputs_[0], batch_size_, hidden_dim_);
-    vdTanh(batch_size_ * hidden_dim_, outputs_[0], outputs_[1]);
-    // print_outputs(0, outputs_[1], batch_size_, hidden_dim_);
+    // print_outputs(0, outputs[0], num_rows, hidden_dim_);
+    tanh(outputs[0], outputs[1], num_rows * hidden_dim_);
+    // print_outputs(0, outputs[1], num_rows, hidden_dim_);
     for (int i = 1; i < num_layers_ - 1; ++ i) {
-      // IN [batch_size_ * hidden_dim] * W_i [hidden_dim * hidden_dim] = 
-      // OUT [batch_size_ * hidden_dim]
-      cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, 
-                  batch_size_, hidden_dim_, hidden_dim_, 
-                  1, outputs_[1], hidden_dim_, 
-                  weights_[i], hidden_dim_, 
-                  0, outputs_[0], hidden_dim_);
+      // IN [num_rows * hidden_dim] * W_i [hidden_dim * hidden_dim] = 
+      // OUT [num_rows * hidden_dim]
+      matmul(outputs[1], weights_[i], outputs[0], num_rows, hidden_dim_, 
+            hidden_dim_);
       // print_weight_matrix(i);
-      // print_outputs(i, outputs_[0], batch_size_, hidden_dim_);      
-      vdTanh(batch_size_ * hidden_dim_, outputs_[0], outputs_[1]);
-      // print_outputs(i, outputs_[1], batch_size_, hidden_dim_);      
-    }
-    // IN [batch_size_ * hidden_dim] * W_L [hidden_dim * in_dim] = 
-    // OUT [batch_size_ * in_dim]
-    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, 
-                batch_size_, in_dim_, hidden_dim_, 
-                1, outputs_[1], hidden_dim_, 
-                weights_[num_layers_ - 1], in_dim_, 
-                0, inputs_, in_dim_);
+      // print_outputs(i, outputs[0], num_rows, hidden_dim_);      
+      tanh(outputs[0], outputs[1], num_rows * hidden_dim_);
+      // print_outputs(i, outputs[1], num_rows, hidden_dim_);      
+    }
+    // IN [num_rows * hidden_dim] * W_L [hidden_dim * in_dim] = 
+    // OUT [num_rows * in_dim]
+    matmul(outputs[1], weights_[num_layers_ - 1], inputs, num_rows, 
+          hidden_dim_, in_dim_);
     // print_weight_matrix(num_layers_);
-    // print_outputs(num_layers_, inputs_, batch_size_, in_dim_);
+    // print_outputs(num_layers_, inputs, num_rows, in_dim_);
+  }
+
+  // OUT [m * n] = IN [m * k] * W [k * n]
+  static void matmul(const double* in, const double* w, double* out, 
+                      int m, int k, int n) {
+#ifdef NFL_USE_MKL
+    // Compute the formula: 
+    //            alpha * mat_a [m * k] * mat_b [k * n] + beta * mat_c [m * n]
+    // cblas_dgemm(layout, trans_a, trans_b, m, n, k, alpha, mat_a, lda, 
+    //              mat_b, ldb, beta, mat_c, ldc)
+    cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, m, n, k, 
+                1, in, k, w, n, 0, out, n);
+#else
+    for (int r = 0; r < m; ++ r) {
+      for (int j = 0; j < n; ++ j) {
+        double acc = 0;
+        for (int i = 0; i < k; ++ i) {
+          acc += in[r * k + i] * w[i * n + j];
+        }
+        out[r * n + j] = acc;
+      }
+    }
+#endif
+  }
+
+  static void tanh(const double* in, double* out, int n) {
+#ifdef NFL_USE_MKL
+    vdTanh(n, in, out);
+#else
+    for (int i = 0; i < n; ++ i) {
+      out[i] = std::tanh(in[i]);
+    }
+#endif
   }
 
   void print_weight_matrix(int l) {
@@ -0,0 +1,196 @@
+#ifndef FLOW_FILE_H
+#define FLOW_FILE_H
+
+#include "models/bnaf.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nfl {
+
+// The binary image of a flow, loaded in place of the text files of
+// flow_weights/. The header at offset 0 is followed by one record per layer
+// and by the weight matrices, each at a multiple of kFlowFileAlign bytes, so
+// that the matrices are used straight from a read-only mapping. The header
+// also carries the plan of the inference that the writer worked out, so that
+// loading neither parses nor converts anything.
+const char kFlowFileMagic[8] = {'N', 'F', 'L', 'F', 'L', 'O', 'W', '\0'};
+// Raised whenever the layout changes, files of other versions are refused
+const uint32_t kFlowFileVersion = 1;
+const uint64_t kFlowFileAlign = 64;
+
+// The flags of the plan
+enum FlowFilePlan : uint32_t {
+  kPlanFused = 1,               // The layers run on the fused kernel.
+  kPlanFloat32 = 2              // float copies follow the double weights.
+};
+
+struct FlowFileHeader {
+  char      magic_[8];
+  uint32_t  version_;
+  uint32_t  in_dim_;
+  uint32_t  hidden_dim_;
+  uint32_t  num_layers_;
+  uint32_t  plan_;
+  uint32_t  reserved_;
+  double    mean_;
+  double    var_;
+  uint64_t  layers_;            // The offset of the layer records.
+  uint64_t  file_size_;
+};
+
+struct FlowFileLayer {
+  uint32_t  rows_;
+  uint32_t  cols_;
+  uint64_t  weights_;           // The offset of the rows_ * cols_ doubles.
+  uint64_t  weights_f_;         // The offset of their float copies, or 0.
+};
+
+// Whether the file at path is a flow file rather than text weights
+inline bool is_flow_file(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(kFlowFileMagic)];
+  in.read(magic, sizeof(kFlowFileMagic));
+  return in.good()
+    && std::memcmp(magic, kFlowFileMagic, sizeof(kFlowFileMagic)) == 0;
+}
+
+template<typename KT, typename VT>
+class FlowFileWriter {
+typedef std::pair<KT, VT> KVT;
+typedef std::pair<double, KVT> KKVT;
+private:
+  std::ofstream out_;
+  uint64_t      offset_;
+
+public:
+  explicit FlowFileWriter(const std::string& path)
+    : out_(path, std::ios::binary | std::ios::trunc), offset_(0) {
+    assert_p(out_.is_open(), "Fail to open " + path);
+  }
+
+  // The plan runs the fused kernel wherever it covers the dimensions, and
+  // keeps float copies of the weights wherever its float32 version does,
+  // whether or not the writing machine would use them
+  void write(const BNAF_Infer<KT, VT>& model, double mean, double var) {
+    FlowFileHeader header;
+    std::memset(&header, 0, sizeof(FlowFileHeader));
+    append(&header, sizeof(FlowFileHeader));
+    std::memcpy(header.magic_, kFlowFileMagic, sizeof(kFlowFileMagic));
+    header.version_ = kFlowFileVersion;
+    header.in_dim_ = model.in_dim_;
+    header.hidden_dim_ = model.hidden_dim_;
+    header.num_layers_ = model.num_layers_;
+    header.mean_ = mean;
+    header.var_ = var;
+    if (select_fused_flow_transform<double, KKVT>(model.in_dim_,
+                                                  model.hidden_dim_) != nullptr) {
+      header.plan_ |= kPlanFused;
+    }
+    if (select_fused_flow_transform<float, KKVT>(model.in_dim_,
+                                                  model.hidden_dim_) != nullptr) {
+      header.plan_ |= kPlanFloat32;
+    }
+    std::vector<FlowFileLayer> layers(model.num_layers_);
+    for (int l = 0; l < model.num_layers_; ++ l) {
+      layers[l].rows_ = l == 0 ? model.in_dim_ : model.hidden_dim_;
+      layers[l].cols_ = l == model.num_layers_ - 1 ? model.in_dim_
+                                                    : model.hidden_dim_;
+      uint32_t n = layers[l].rows_ * layers[l].cols_;
+      layers[l].weights_ = append(model.weights_[l], sizeof(double) * n);
+      if (header.plan_ & kPlanFloat32) {
+        std::vector<float> weights_f(model.weights_[l], model.weights_[l] + n);
+        layers[l].weights_f_ = append(weights_f.data(), sizeof(float) * n);
+      }
+    }
+    header.layers_ = append(layers.data(),
+                            sizeof(FlowFileLayer) * model.num_layers_);
+    header.file_size_ = offset_;
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char*>(&header), sizeof(FlowFileHeader));
+    out_.flush();
+    assert_p(out_.good(), "Fail to write the flow file");
+  }
+
+private:
+  // Write the data at the next aligned offset and return that offset
+  uint64_t append(const void* data, uint64_t size) {
+    static const char zeros[kFlowFileAlign] = { 0 };
+    uint64_t padding = (kFlowFileAlign - offset_ % kFlowFileAlign)
+                        % kFlowFileAlign;
+    out_.write(zeros, padding);
+    offset_ += padding;
+    uint64_t start = offset_;
+    out_.write(static_cast<const char*>(data), size);
+    offset_ += size;
+    return start;
+  }
+};
+
+// A flow file mapped read-only. The weights point into the mapping, which
+// the pages of the file back, so they are never copied.
+class MappedFlowFile {
+private:
+  const char*             base_;
+  uint64_t                length_;
+  const FlowFileHeader*   header_;
+  const FlowFileLayer*    layers_;
+
+public:
+  MappedFlowFile() : base_(nullptr), length_(0), header_(nullptr),
+                      layers_(nullptr) { }
+
+  MappedFlowFile(const MappedFlowFile&) = delete;
+  MappedFlowFile& operator=(const MappedFlowFile&) = delete;
+
+  ~MappedFlowFile() {
+    if (base_ != nullptr) {
+      munmap(const_cast<char*>(base_), length_);
+    }
+  }
+
+  void open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    assert_p(fd >= 0, "Fail to open " + path);
+    struct stat st;
+    assert_p(fstat(fd, &st) == 0, "Fail to stat " + path);
+    length_ = st.st_size;
+    assert_p(length_ >= sizeof(FlowFileHeader), path + " is not a flow file");
+    void* addr = mmap(nullptr, length_, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file open
+    ::close(fd);
+    assert_p(addr != MAP_FAILED, "Fail to map " + path);
+    // Every transform reads all weights
+    madvise(addr, length_, MADV_WILLNEED);
+    base_ = static_cast<const char*>(addr);
+    header_ = reinterpret_cast<const FlowFileHeader*>(base_);
+    assert_p(std::memcmp(header_->magic_, kFlowFileMagic,
+                          sizeof(kFlowFileMagic)) == 0,
+              path + " is not a flow file");
+    assert_p(header_->version_ == kFlowFileVersion,
+              path + " has an unsupported flow file version");
+    assert_p(header_->file_size_ == length_, path + " is truncated");
+    layers_ = reinterpret_cast<const FlowFileLayer*>(base_ + header_->layers_);
+  }
+
+  const FlowFileHeader& header() const { return *header_; }
+
+  const FlowFileLayer& layer(int l) const { return layers_[l]; }
+
+  // The kernels take the weights as writable, but never write them
+  double* weights(int l) const {
+    return reinterpret_cast<double*>(const_cast<char*>(base_)
+                                      + layers_[l].weights_);
+  }
+
+  float* weights_f(int l) const {
+    return reinterpret_cast<float*>(const_cast<char*>(base_)
+                                    + layers_[l].weights_f_);
+  }
+};
+
+}
+
+#endif
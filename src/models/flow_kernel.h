@@ -0,0 +1,463 @@
+#ifndef FLOW_KERNEL_H
+#define FLOW_KERNEL_H
+
+#include "util/common.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace nfl {
+
+// The vector operations of the fused flow kernel on T, which runs one key 
+// per lane on the widest vectors that the target supports.
+template<typename T>
+struct FlowLanes;
+
+// One key of T, which is also the lanes of scalar targets
+template<typename T>
+struct ScalarLanes {
+  typedef T V;
+  static const uint32_t kWidth = 1;
+
+  static inline V set1(T a) { return a; }
+  static inline V load(const T* p) { return *p; }
+  static inline V gather(const T* p, int64_t stride) { return *p; }
+  static inline void store(T* p, V a) { *p = a; }
+  static inline V add(V a, V b) { return a + b; }
+  static inline V sub(V a, V b) { return a - b; }
+  static inline V mul(V a, V b) { return a * b; }
+  static inline V div(V a, V b) { return a / b; }
+  static inline V fmadd(V a, V b, V c) { return a * b + c; }
+  static inline V min(V a, V b) { return std::min(a, b); }
+  static inline V abs(V a) { return std::fabs(a); }
+  static inline V floor(V a) { return std::floor(a); }
+  static inline V copysign(V a, V b) { return std::copysign(a, b); }
+  static inline V select_lt(V a, V b, V c, V d) { return a < b ? c : d; }
+
+  static inline V pow2(V n) {
+    return std::ldexp(static_cast<T>(1), static_cast<int>(n));
+  }
+
+  static inline V narrow(const double* p) { return static_cast<T>(*p); }
+};
+
+#if defined(__AVX512F__)
+template<>
+struct FlowLanes<double> {
+  typedef __m512d V;
+  static const uint32_t kWidth = 8;
+
+  static inline V set1(double a) { return _mm512_set1_pd(a); }
+  static inline V load(const double* p) { return _mm512_load_pd(p); }
+
+  // Lane i loads p[i * stride]
+  static inline V gather(const double* p, int64_t stride) {
+    return _mm512_i64gather_pd(_mm512_setr_epi64(0, stride, 2 * stride, 
+                                3 * stride, 4 * stride, 5 * stride, 
+                                6 * stride, 7 * stride), p, 8);
+  }
+
+  static inline void store(double* p, V a) { _mm512_store_pd(p, a); }
+  static inline V add(V a, V b) { return _mm512_add_pd(a, b); }
+  static inline V sub(V a, V b) { return _mm512_sub_pd(a, b); }
+  static inline V mul(V a, V b) { return _mm512_mul_pd(a, b); }
+  static inline V div(V a, V b) { return _mm512_div_pd(a, b); }
+  static inline V fmadd(V a, V b, V c) { return _mm512_fmadd_pd(a, b, c); }
+  static inline V min(V a, V b) { return _mm512_min_pd(a, b); }
+  static inline V abs(V a) { return _mm512_abs_pd(a); }
+
+  static inline V floor(V a) {
+    return _mm512_roundscale_pd(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  }
+
+  // The non-negative a with the sign of b
+  static inline V copysign(V a, V b) {
+    return _mm512_castsi512_pd(_mm512_or_si512(_mm512_castpd_si512(a), 
+            _mm512_and_si512(_mm512_castpd_si512(b), 
+                              _mm512_castpd_si512(_mm512_set1_pd(-0.)))));
+  }
+
+  // a < b ? c : d
+  static inline V select_lt(V a, V b, V c, V d) {
+    return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(a, b, _CMP_LT_OQ), d, c);
+  }
+
+  // 2^n for an integral n in the range of normal numbers
+  static inline V pow2(V n) {
+    __m512i e = _mm512_cvtepi32_epi64(_mm512_cvtpd_epi32(n));
+    return _mm512_castsi512_pd(_mm512_slli_epi64(
+            _mm512_add_epi64(e, _mm512_set1_epi64(1023)), 52));
+  }
+};
+
+template<>
+struct FlowLanes<float> {
+  typedef __m512 V;
+  static const uint32_t kWidth = 16;
+
+  static inline V set1(float a) { return _mm512_set1_ps(a); }
+  static inline V load(const float* p) { return _mm512_load_ps(p); }
+
+  // Round kWidth doubles to float
+  static inline V narrow(const double* p) {
+    __m256 lo = _mm512_cvtpd_ps(_mm512_load_pd(p));
+    __m256 hi = _mm512_cvtpd_ps(_mm512_load_pd(p + 8));
+    return _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castpd256_pd512(
+            _mm256_castps_pd(lo)), _mm256_castps_pd(hi), 1));
+  }
+  static inline void store(float* p, V a) { _mm512_store_ps(p, a); }
+  static inline V add(V a, V b) { return _mm512_add_ps(a, b); }
+  static inline V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+  static inline V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+  static inline V div(V a, V b) { return _mm512_div_ps(a, b); }
+  static inline V fmadd(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+  static inline V min(V a, V b) { return _mm512_min_ps(a, b); }
+  static inline V abs(V a) { return _mm512_abs_ps(a); }
+
+  static inline V floor(V a) {
+    return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  }
+
+  // The non-negative a with the sign of b
+  static inline V copysign(V a, V b) {
+    return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(a), 
+            _mm512_and_si512(_mm512_castps_si512(b), 
+                              _mm512_castps_si512(_mm512_set1_ps(-0.f)))));
+  }
+
+  // a < b ? c : d
+  static inline V select_lt(V a, V b, V c, V d) {
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), d, c);
+  }
+
+  // 2^n for an integral n in the range of normal numbers
+  static inline V pow2(V n) {
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(
+            _mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23));
+  }
+};
+#elif defined(__AVX2__)
+template<>
+struct FlowLanes<double> {
+  typedef __m256d V;
+  static const uint32_t kWidth = 4;
+
+  static inline V set1(double a) { return _mm256_set1_pd(a); }
+  static inline V load(const double* p) { return _mm256_load_pd(p); }
+
+  // Lane i loads p[i * stride]
+  static inline V gather(const double* p, int64_t stride) {
+    return _mm256_i64gather_pd(p, _mm256_setr_epi64x(0, stride, 2 * stride, 
+                                                      3 * stride), 8);
+  }
+
+  static inline void store(double* p, V a) { _mm256_store_pd(p, a); }
+  static inline V add(V a, V b) { return _mm256_add_pd(a, b); }
+  static inline V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+  static inline V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+  static inline V div(V a, V b) { return _mm256_div_pd(a, b); }
+  static inline V min(V a, V b) { return _mm256_min_pd(a, b); }
+  static inline V floor(V a) { return _mm256_floor_pd(a); }
+
+  static inline V fmadd(V a, V b, V c) {
+#if defined(__FMA__)
+    return _mm256_fmadd_pd(a, b, c);
+#else
+    return _mm256_add_pd(_mm256_mul_pd(a, b), c);
+#endif
+  }
+
+  static inline V abs(V a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.), a); }
+
+  // The non-negative a with the sign of b
+  static inline V copysign(V a, V b) {
+    return _mm256_or_pd(a, _mm256_and_pd(b, _mm256_set1_pd(-0.)));
+  }
+
+  // a < b ? c : d
+  static inline V select_lt(V a, V b, V c, V d) {
+    return _mm256_blendv_pd(d, c, _mm256_cmp_pd(a, b, _CMP_LT_OQ));
+  }
+
+  // 2^n for an integral n in the range of normal numbers
+  static inline V pow2(V n) {
+    __m256i e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(n));
+    return _mm256_castsi256_pd(_mm256_slli_epi64(
+            _mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52));
+  }
+};
+
+template<>
+struct FlowLanes<float> {
+  typedef __m256 V;
+  static const uint32_t kWidth = 8;
+
+  static inline V set1(float a) { return _mm256_set1_ps(a); }
+  static inline V load(const float* p) { return _mm256_load_ps(p); }
+
+  // Round kWidth doubles to float
+  static inline V narrow(const double* p) {
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(
+            _mm256_cvtpd_ps(_mm256_load_pd(p))), 
+            _mm256_cvtpd_ps(_mm256_load_pd(p + 4)), 1);
+  }
+  static inline void store(float* p, V a) { _mm256_store_ps(p, a); }
+  static inline V add(V a, V b) { return _mm256_add_ps(a, b); }
+  static inline V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static inline V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static inline V div(V a, V b) { return _mm256_div_ps(a, b); }
+  static inline V min(V a, V b) { return _mm256_min_ps(a, b); }
+  static inline V floor(V a) { return _mm256_floor_ps(a); }
+
+  static inline V fmadd(V a, V b, V c) {
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+  }
+
+  static inline V abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+
+  // The non-negative a with the sign of b
+  static inline V copysign(V a, V b) {
+    return _mm256_or_ps(a, _mm256_and_ps(b, _mm256_set1_ps(-0.f)));
+  }
+
+  // a < b ? c : d
+  static inline V select_lt(V a, V b, V c, V d) {
+    return _mm256_blendv_ps(d, c, _mm256_cmp_ps(a, b, _CMP_LT_OQ));
+  }
+
+  // 2^n for an integral n in the range of normal numbers
+  static inline V pow2(V n) {
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(
+            _mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23));
+  }
+};
+#else
+template<typename T>
+struct FlowLanes : ScalarLanes<T> { };
+#endif
+
+// tanh with the rational approximation of Cephes for |x| < 0.625 and 
+// (e - 1) / (e + 1) for e = exp(2|x|) otherwise, within a few ulp. The 
+// exponential is the Pade approximation of Cephes, p(r) / q(r) * 2^n. Both 
+// branches are computed for all lanes and only their blend is divided, so a 
+// vector of keys costs a single division.
+#if defined(__AVX512F__) || defined(__AVX2__)
+inline FlowLanes<double>::V flow_tanh(FlowLanes<double>::V x) {
+  typedef FlowLanes<double> L;
+  L::V ax = L::abs(x);
+  // |x| < 0.625: x + x^3 * P(x^2) / Q(x^2)
+  L::V z = L::mul(x, x);
+  L::V p = L::fmadd(L::fmadd(L::set1(-9.64399179425052238628E-1), z, 
+                    L::set1(-9.92877231001918586564E1)), 
+                    z, L::set1(-1.61468768441708447952E3));
+  L::V q = L::fmadd(L::fmadd(L::add(z, L::set1(1.12811678491632931402E2)), 
+                    z, L::set1(2.23548839060100448583E3)), 
+                    z, L::set1(4.84406305325125486048E3));
+  L::V small_num = L::fmadd(L::mul(x, z), p, L::mul(x, q));
+  // exp(y) for y = 2|x|, which saturates tanh long before it overflows
+  L::V y = L::min(L::add(ax, ax), L::set1(64.));
+  L::V n = L::floor(L::fmadd(y, L::set1(1.4426950408889634073599), 
+                            L::set1(0.5)));
+  L::V r = L::sub(L::sub(y, L::mul(n, L::set1(6.93145751953125E-1))), 
+                  L::mul(n, L::set1(1.42860682030941723212E-6)));
+  L::V rr = L::mul(r, r);
+  L::V px = L::mul(r, L::fmadd(L::fmadd(L::set1(1.26177193074810590878E-4), 
+                    rr, L::set1(3.02994407707441961300E-2)), 
+                    rr, L::set1(9.99999999999999999910E-1)));
+  L::V qx = L::fmadd(L::fmadd(L::fmadd(L::set1(3.00198505138664455042E-6), 
+              rr, L::set1(2.52448340349684104192E-3)), 
+              rr, L::set1(2.27265548208155028766E-1)), 
+              rr, L::set1(2.00000000000000000009E0));
+  // exp(y) = e_num / e_den
+  L::V e_num = L::mul(L::add(qx, px), L::pow2(n));
+  L::V e_den = L::sub(qx, px);
+  L::V large_num = L::copysign(L::sub(e_num, e_den), x);
+  L::V large_den = L::add(e_num, e_den);
+  L::V is_small = L::set1(0.625);
+  return L::div(L::select_lt(ax, is_small, small_num, large_num), 
+                L::select_lt(ax, is_small, q, large_den));
+}
+
+// The float version of the above with the approximations of Cephes for 
+// float, where the polynomial of |x| < 0.625 needs no division
+inline FlowLanes<float>::V flow_tanh(FlowLanes<float>::V x) {
+  typedef FlowLanes<float> L;
+  L::V ax = L::abs(x);
+  L::V z = L::mul(x, x);
+  L::V p = L::fmadd(L::fmadd(L::fmadd(L::fmadd(L::set1(-5.70498872745E-3f), 
+            z, L::set1(2.06390887954E-2f)), z, L::set1(-5.37397155531E-2f)), 
+            z, L::set1(1.33314422036E-1f)), z, L::set1(-3.33332819422E-1f));
+  L::V small = L::fmadd(L::mul(p, z), x, x);
+  // exp(y) for y = 2|x|, which saturates tanh long before it overflows
+  L::V y = L::min(L::add(ax, ax), L::set1(40.f));
+  L::V n = L::floor(L::fmadd(y, L::set1(1.44269504088896341f), 
+                            L::set1(0.5f)));
+  L::V r = L::fmadd(n, L::set1(2.12194440E-4f), 
+                    L::sub(y, L::mul(n, L::set1(0.693359375f))));
+  L::V e = L::fmadd(L::set1(1.9875691500E-4f), r, L::set1(1.3981999507E-3f));
+  e = L::fmadd(e, r, L::set1(8.3334519073E-3f));
+  e = L::fmadd(e, r, L::set1(4.1665795894E-2f));
+  e = L::fmadd(e, r, L::set1(1.6666665459E-1f));
+  e = L::fmadd(e, r, L::set1(5.0000001201E-1f));
+  e = L::add(L::fmadd(L::mul(e, r), r, r), L::set1(1.f));
+  e = L::mul(e, L::pow2(n));
+  L::V one = L::set1(1.f);
+  L::V is_small = L::set1(0.625f);
+  return L::div(L::select_lt(ax, is_small, small, 
+                              L::copysign(L::sub(e, one), x)), 
+                L::select_lt(ax, is_small, one, L::add(e, one)));
+}
+#else
+// A scalar lane does better to branch
+template<typename T>
+inline T flow_tanh(T x) {
+  return std::tanh(x);
+}
+#endif
+
+// out[j] = sum_i in[i] * w[i * kOut + j], i.e., one row of IN * W per lane
+template<typename T, int kIn, int kOut>
+inline void flow_layer(const T* w, const typename FlowLanes<T>::V* in, 
+                        typename FlowLanes<T>::V* out) {
+  typedef FlowLanes<T> L;
+  for (int j = 0; j < kOut; ++ j) {
+    typename L::V acc = L::mul(in[0], L::set1(w[j]));
+    for (int i = 1; i < kIn; ++ i) {
+      acc = L::fmadd(in[i], L::set1(w[i * kOut + j]), acc);
+    }
+    out[j] = acc;
+  }
+}
+
+// The features of BNAF_Infer::prepare_inputs
+template<typename L, int kInDim>
+inline void flow_features(typename L::V x, typename L::V* in) {
+  if constexpr (kInDim == 1) {
+    in[0] = x;
+  } else if constexpr (kInDim == 2) {
+    in[0] = x;
+    in[1] = L::sub(x, L::floor(x));
+  } else {
+    static_assert(kInDim == 4, "Unsupported dimensions");
+    in[0] = x;
+    in[1] = L::floor(x);
+    typename L::V tmp = L::mul(L::sub(x, in[1]), L::set1(1000000));
+    in[2] = L::floor(tmp);
+    in[3] = L::sub(tmp, in[2]);
+  }
+}
+
+// The whole BNAF_Infer::transform for compile-time dimensions: the input 
+// features, all layers with their tanh, and the sum of the outputs are 
+// computed in registers for kWidth keys at a time. The last group is padded 
+// with its last key, so that every key runs the same arithmetic.
+//
+// With T = float the layers run on twice as many lanes with float weights. 
+// The features are still computed in double, since the fractional parts of 
+// the keys would not survive rounding the keys to float.
+template<typename T, typename KKVT, int kInDim, int kHiddenDim>
+void fused_flow_transform(T* const* weights, int num_layers, 
+                          KKVT* tran_kvs, uint32_t size) {
+  typedef FlowLanes<T> L;
+  static_assert(sizeof(KKVT) % sizeof(double) == 0, 
+                "The transformed keys must be gathered in whole doubles");
+  alignas(64) T buf[L::kWidth];
+  for (uint32_t l = 0; l < size; l += L::kWidth) {
+    uint32_t n = std::min(size - l, L::kWidth);
+    typename L::V in[kInDim];
+    if constexpr (std::is_same<T, double>::value) {
+      typename L::V x;
+      if (n == L::kWidth) {
+        x = L::gather(&tran_kvs[l].first, sizeof(KKVT) / sizeof(double));
+      } else {
+        for (uint32_t i = 0; i < L::kWidth; ++ i) {
+          buf[i] = tran_kvs[l + std::min(i, n - 1)].first;
+        }
+        x = L::load(buf);
+      }
+      flow_features<L, kInDim>(x, in);
+    } else {
+      // The features of kWidth keys in double lanes, then rounded to float
+      typedef FlowLanes<double> D;
+      alignas(64) double features[kInDim][L::kWidth];
+      for (uint32_t h = 0; h < L::kWidth; h += D::kWidth) {
+        typename D::V x;
+        if (h + D::kWidth <= n) {
+          x = D::gather(&tran_kvs[l + h].first, sizeof(KKVT) / sizeof(double));
+        } else {
+          alignas(64) double keys[D::kWidth];
+          for (uint32_t i = 0; i < D::kWidth; ++ i) {
+            keys[i] = tran_kvs[l + std::min(h + i, n - 1)].first;
+          }
+          x = D::load(keys);
+        }
+        typename D::V f[kInDim];
+        flow_features<D, kInDim>(x, f);
+        for (int d = 0; d < kInDim; ++ d) {
+          D::store(features[d] + h, f[d]);
+        }
+      }
+      for (int d = 0; d < kInDim; ++ d) {
+        in[d] = L::narrow(features[d]);
+      }
+    }
+    typename L::V h[kHiddenDim];
+    typename L::V g[kHiddenDim];
+    flow_layer<T, kInDim, kHiddenDim>(weights[0], in, g);
+    for (int j = 0; j < kHiddenDim; ++ j) {
+      h[j] = flow_tanh(g[j]);
+    }
+    for (int w = 1; w < num_layers - 1; ++ w) {
+      flow_layer<T, kHiddenDim, kHiddenDim>(weights[w], h, g);
+      for (int j = 0; j < kHiddenDim; ++ j) {
+        h[j] = flow_tanh(g[j]);
+      }
+    }
+    flow_layer<T, kHiddenDim, kInDim>(weights[num_layers - 1], h, in);
+    // The output of BNAF_Infer::prepare_outputs
+    typename L::V out = in[0];
+    for (int i = 1; i < kInDim; ++ i) {
+      out = L::add(out, in[i]);
+    }
+    L::store(buf, out);
+    for (uint32_t i = 0; i < n; ++ i) {
+      tran_kvs[l + i].first = buf[i];
+    }
+  }
+}
+
+template<typename T, typename KKVT>
+using FusedFlowTransform = void (*)(T* const*, int, KKVT*, uint32_t);
+
+template<typename T, typename KKVT, int kInDim>
+FusedFlowTransform<T, KKVT> select_fused_flow_transform(int hidden_dim) {
+  switch (hidden_dim) {
+    case 1: return fused_flow_transform<T, KKVT, kInDim, 1>;
+    case 2: return fused_flow_transform<T, KKVT, kInDim, 2>;
+    case 4: return fused_flow_transform<T, KKVT, kInDim, 4>;
+    case 8: return fused_flow_transform<T, KKVT, kInDim, 8>;
+    default: return nullptr;
+  }
+}
+
+// Return the fused kernel for the dimensions of a flow, or nullptr if they 
+// are too large for keeping a key in registers
+template<typename T, typename KKVT>
+FusedFlowTransform<T, KKVT> select_fused_flow_transform(int in_dim, 
+                                                        int hidden_dim) {
+  switch (in_dim) {
+    case 1: return select_fused_flow_transform<T, KKVT, 1>(hidden_dim);
+    case 2: return select_fused_flow_transform<T, KKVT, 2>(hidden_dim);
+    case 4: return select_fused_flow_transform<T, KKVT, 4>(hidden_dim);
+    default: return nullptr;
+  }
+}
+
+}
+
+#endif
@@ -5,20 +5,35 @@
 
 namespace nfl {
 
+// Return key - base as a double. Integer keys are subtracted exactly, so that 
+// 64-bit keys keep their precision in the product with a slope.
+template<class KT>
+inline double key_offset(KT key, KT base) {
+  if constexpr (std::numeric_limits<KT>::is_integer) {
+    typedef typename std::make_unsigned<KT>::type UKT;
+    return key < base 
+          ? -static_cast<double>(static_cast<UKT>(base) - static_cast<UKT>(key))
+          : static_cast<double>(static_cast<UKT>(key) - static_cast<UKT>(base));
+  } else {
+    return key - base;
+  }
+}
+
 template<class KT>
 class LinearModel {
  public:
   double slope_;
   double intercept_;
+  KT base_;         // The key that the intercept is relative to.
 
-  LinearModel() : slope_(0), intercept_(0) { }
+  LinearModel() : slope_(0), intercept_(0), base_(0) { }
 
   inline int64_t predict(KT key) const {
-    return static_cast<int64_t>(std::floor(slope_ * key + intercept_));
+    return static_cast<int64_t>(std::floor(predict_double(key)));
   }
 
   inline double predict_double(KT key) const {
-    return slope_ * static_cast<double>(key) + intercept_;
+    return slope_ * key_offset(key, base_) + intercept_;
   }
 };
 
@@ -53,6 +68,20 @@ class LinearModelBuilder {
     y_max_ = std::max(y, y_max_);
   }
 
+  // Combine the sums of another builder, e.g., one that saw a disjoint part 
+  // of the keys in parallel
+  inline void merge(const LinearModelBuilder<KT>& other) {
+    count_ += other.count_;
+    x_sum_ += other.x_sum_;
+    y_sum_ += other.y_sum_;
+    xx_sum_ += other.xx_sum_;
+    xy_sum_ += other.xy_sum_;
+    x_min_ = std::min(other.x_min_, x_min_);
+    x_max_ = std::max(other.x_max_, x_max_);
+    y_min_ = std::min(other.y_min_, y_min_);
+    y_max_ = std::max(other.y_max_, y_max_);
+  }
+
   // TODO: the calculated slope or intercept is too small or too large, the 
   // precision is lost.
   void build(LinearModel<KT> *lrm) {
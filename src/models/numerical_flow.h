@@ -2,6 +2,9 @@
 #define NUMERICAL_FLOW_H
 
 #include "models/bnaf.h"
+#include "models/flow_file.h"
+#include "models/piecewise_flow.h"
+#include "models/transform_cache.h"
 #include "util/common.h"
 
 namespace nfl {
@@ -9,30 +12,154 @@ namespace nfl {
 template<typename KT, typename VT>
 class NumericalFlow {
 typedef std::pair<KT, VT> KVT;
-typedef std::pair<KT, KVT> KKVT;
+typedef std::pair<double, KVT> KKVT;
 public:
   double mean_;
   double var_;
-  MKL_INT batch_size_;
+  uint32_t batch_size_;
+  // Holds the weights of model_ if they were loaded from a flow file
+  MappedFlowFile file_;
   BNAF_Infer<KT, VT> model_;
+  // Serves the batches of transform from hot keys if enabled, see 
+  // enable_cache
+  TransformCache<KT>* cache_;
+  // The keys of a batch that miss cache_ and their positions in the batch
+  std::vector<KKVT> misses_;
+  std::vector<uint32_t> miss_positions_;
+  // Stands in for model_ on the keys it covers if compiled, see compile
+  PiecewiseFlow* piecewise_;
 
 public:
+  // weight_path is either a text file of flow_weights/ or a flow file, see 
+  // flow_file.h
   explicit NumericalFlow(std::string weight_path, uint32_t batch_size) 
-    : batch_size_(batch_size) {
-    load(weight_path);
+    : batch_size_(batch_size), cache_(nullptr), piecewise_(nullptr) {
+    if (is_flow_file(weight_path)) {
+      load_flow_file(weight_path);
+    } else {
+      load(weight_path);
+    }
     model_.set_batch_size(batch_size);
   }
 
+  ~NumericalFlow() {
+    if (cache_ != nullptr) {
+      delete cache_;
+    }
+    if (piecewise_ != nullptr) {
+      delete piecewise_;
+    }
+  }
+
   uint64_t size() {
-    return sizeof(NumericalFlow<KT, VT>) - sizeof(BNAF_Infer<KT, VT>) + model_.size();
+    return sizeof(NumericalFlow<KT, VT>) - sizeof(BNAF_Infer<KT, VT>) + model_.size()
+          + (cache_ == nullptr ? 0 : cache_->size() 
+            + (sizeof(KKVT) + sizeof(uint32_t)) * misses_.size())
+          + (piecewise_ == nullptr ? 0 : piecewise_->size());
+  }
+
+  // Replace model_ by a piecewise-linear approximation within max_error of 
+  // the transformed keys of the sorted kvs, see PiecewiseFlow. It is 
+  // compiled from model_ in double, and the keys outside its ranges keep 
+  // running model_ in double.
+  void compile(const KVT* kvs, uint32_t size, double max_error) {
+    assert_p(size > 0, "No keys to compile the flow from");
+    if (piecewise_ != nullptr) {
+      delete piecewise_;
+      piecewise_ = nullptr;
+    }
+    model_.set_float32(false);
+    PiecewiseFlow* piecewise = new PiecewiseFlow(max_error);
+    FlowBuffers buffers = new_buffers();
+    std::vector<KKVT> tran_kvs(batch_size_);
+    // The distinct keys of the current partition
+    std::vector<double> xs;
+    std::vector<double> ys;
+    int64_t p = partition(kvs[0].first);
+    for (uint32_t l = 0; l < size; l += batch_size_) {
+      uint32_t r = std::min(l + batch_size_, size);
+      transform(kvs + l, r - l, tran_kvs.data(), buffers);
+      for (uint32_t i = l; i < r; ++ i) {
+        if (i > 0 && kvs[i].first == kvs[i - 1].first) {
+          continue;
+        }
+        int64_t q = partition(kvs[i].first);
+        if (q != p) {
+          piecewise->add_range(xs.data(), ys.data(), xs.size());
+          xs.clear();
+          ys.clear();
+          p = q;
+        }
+        double y = tran_kvs[i - l].first;
+        // Keys that the flow rounds to one transformed key are set apart, so 
+        // that the segments strictly increase
+        if (!ys.empty() && !(y > ys.back())) {
+          y = std::nextafter(ys.back(), std::numeric_limits<double>::infinity());
+        }
+        xs.push_back((kvs[i].first - mean_) / var_);
+        ys.push_back(y);
+      }
+    }
+    piecewise->add_range(xs.data(), ys.data(), xs.size());
+    piecewise->finish();
+    piecewise_ = piecewise;
+  }
+
+  // Load the piecewise-linear approximation that save_piecewise wrote
+  void load_piecewise(const std::string& path) {
+    if (piecewise_ != nullptr) {
+      delete piecewise_;
+    }
+    model_.set_float32(false);
+    piecewise_ = new PiecewiseFlow();
+    piecewise_->load(path, mean_, var_);
+  }
+
+  void save_piecewise(const std::string& path) const {
+    assert_p(piecewise_ != nullptr, "The flow is not compiled");
+    piecewise_->save(path, mean_, var_);
+  }
+
+  const PiecewiseFlow* piecewise() const {
+    return piecewise_;
+  }
+
+  // Cache the transformed keys of at least capacity raw keys for the batches 
+  // of transform. The other transforms are used by several threads at once 
+  // and do not touch the cache. A probe costs about as much as the fused 
+  // kernel transforms a key of a 2D2H2L flow, so the cache only pays for 
+  // deeper or wider flows.
+  void enable_cache(uint64_t capacity) {
+    if (cache_ != nullptr) {
+      delete cache_;
+    }
+    cache_ = new TransformCache<KT>(capacity);
+    misses_.resize(batch_size_);
+    miss_positions_.resize(batch_size_);
+  }
+
+  const TransformCache<KT>* cache() const {
+    return cache_;
   }
 
   void set_batch_size(uint32_t batch_size) {
     batch_size_ = batch_size;
     model_.set_batch_size(batch_size_);
+    if (cache_ != nullptr) {
+      misses_.resize(batch_size_);
+      miss_positions_.resize(batch_size_);
+    }
   }
 
   void transform(const KVT* kvs, uint32_t size, KKVT* tran_kvs) {
+    if (piecewise_ != nullptr) {
+      transform_piecewise(kvs, size, tran_kvs);
+      return;
+    }
+    if (cache_ != nullptr) {
+      transform_cached(kvs, size, tran_kvs);
+      return;
+    }
     for (uint32_t i = 0; i < size; ++ i) {
       tran_kvs[i] = {(kvs[i].first - mean_) / var_, kvs[i]};
     }
@@ -44,13 +171,167 @@ public:
     }
   }
 
-  KKVT transform(const KVT kv) {
+  // The same on buffers of the caller from new_buffers, so that threads can 
+  // transform disjoint ranges of keys at once
+  void transform(const KVT* kvs, uint32_t size, KKVT* tran_kvs, 
+                  FlowBuffers& buffers) const {
+    if (piecewise_ != nullptr) {
+      transform_piecewise(kvs, size, tran_kvs);
+      return;
+    }
+    for (uint32_t l = 0; l < size; l += batch_size_) {
+      uint32_t r = std::min(l + batch_size_, size);
+      for (uint32_t i = l; i < r; ++ i) {
+        tran_kvs[i] = {(kvs[i].first - mean_) / var_, kvs[i]};
+      }
+      model_.transform(tran_kvs + l, r - l, buffers);
+    }
+  }
+
+  FlowBuffers new_buffers() const {
+    return FlowBuffers(batch_size_, model_.in_dim_, model_.hidden_dim_);
+  }
+
+  // See BNAF_Infer::set_float32. The cached keys of the other precision 
+  // would not match the index, so they are dropped. A compiled flow has no 
+  // float32 version.
+  bool set_float32(bool float32) {
+    if (piecewise_ != nullptr) {
+      return !float32;
+    }
+    if (cache_ != nullptr && float32 != model_.float32()) {
+      cache_->clear();
+    }
+    return model_.set_float32(float32);
+  }
+
+  bool float32() const {
+    return model_.float32();
+  }
+
+  // Thread-safe, and as cheap as the fused kernel for one key
+  KKVT transform(const KVT kv) const {
     KKVT t_kv = {(kv.first - mean_) / var_, kv};
-    model_.transform(&t_kv, 1);
+    if (piecewise_ != nullptr && piecewise_->transform(t_kv.first, t_kv.first)) {
+      return t_kv;
+    }
+    model_.transform(t_kv);
     return t_kv;
   }
 
+  // The flow is monotonic inside each partition of the normalized key space, 
+  // but the fractional inputs built by BNAF_Infer::prepare_inputs restart at 
+  // every partition boundary. Return the partition id of a key.
+  int64_t partition(KT key) const {
+    double x = (key - mean_) / var_;
+    if (model_.in_dim_ == 1) {
+      return 0;
+    } else if (model_.in_dim_ == 2) {
+      return static_cast<int64_t>(std::floor(x));
+    } else {
+      return static_cast<int64_t>(std::floor(x * 1000000));
+    }
+  }
+
+  // Return the smallest key that is greater than the given key and lies in 
+  // the next partition, or the largest value of KT if there is none.
+  KT partition_end(KT key) const {
+    if (model_.in_dim_ == 1) {
+      return std::numeric_limits<KT>::max();
+    }
+    int64_t p = partition(key);
+    double width = model_.in_dim_ == 2 ? 1 : 1e-6;
+    double bound = mean_ + (p + 1) * width * var_;
+    if (bound >= static_cast<double>(std::numeric_limits<KT>::max())) {
+      return std::numeric_limits<KT>::max();
+    }
+    // Start from the estimated boundary, or from the key if rounding puts the 
+    // boundary below it
+    KT end = bound > static_cast<double>(key) ? static_cast<KT>(bound) : key;
+    while (end > key && partition(end) > p) {
+      end = next_toward(end, key);
+    }
+    while (end <= key || partition(end) == p) {
+      if (end == std::numeric_limits<KT>::max()) {
+        return end;
+      }
+      end = next_toward(end, std::numeric_limits<KT>::max());
+    }
+    return end;
+  }
+
+  // Write the flow as a flow file, which later runs load without parsing 
+  void save(const std::string& path) const {
+    FlowFileWriter<KT, VT>(path).write(model_, mean_, var_);
+  }
+
 private:
+  // The keys outside the ranges of piecewise_ run model_ one by one
+  void transform_piecewise(const KVT* kvs, uint32_t size, 
+                            KKVT* tran_kvs) const {
+    for (uint32_t i = 0; i < size; ++ i) {
+      tran_kvs[i] = {(kvs[i].first - mean_) / var_, kvs[i]};
+      if (!piecewise_->transform(tran_kvs[i].first, tran_kvs[i].first)) {
+        model_.transform(tran_kvs[i]);
+      }
+    }
+  }
+
+  // Take the keys that hit cache_ from it and run the flow only on the 
+  // misses, gathered into full batches
+  void transform_cached(const KVT* kvs, uint32_t size, KKVT* tran_kvs) {
+    for (uint32_t i = 0; i < size; ++ i) {
+      cache_->prefetch(kvs[i].first);
+    }
+    uint32_t num_misses = 0;
+    for (uint32_t i = 0; i < size; ++ i) {
+      double tran_key;
+      if (cache_->find(kvs[i].first, tran_key)) {
+        tran_kvs[i] = {tran_key, kvs[i]};
+        continue;
+      }
+      misses_[num_misses] = {(kvs[i].first - mean_) / var_, kvs[i]};
+      miss_positions_[num_misses ++] = i;
+      if (num_misses == batch_size_) {
+        transform_misses(num_misses, tran_kvs);
+        num_misses = 0;
+      }
+    }
+    if (num_misses > 0) {
+      transform_misses(num_misses, tran_kvs);
+    }
+  }
+
+  void transform_misses(uint32_t num_misses, KKVT* tran_kvs) {
+    model_.transform(misses_.data(), num_misses);
+    for (uint32_t j = 0; j < num_misses; ++ j) {
+      tran_kvs[miss_positions_[j]] = misses_[j];
+      cache_->admit(misses_[j].second.first, misses_[j].first);
+    }
+  }
+
+  void load_flow_file(const std::string& path) {
+    file_.open(path);
+    const FlowFileHeader& header = file_.header();
+    model_.in_dim_ = header.in_dim_;
+    model_.hidden_dim_ = header.hidden_dim_;
+    model_.num_layers_ = header.num_layers_;
+    mean_ = header.mean_;
+    var_ = header.var_;
+    model_.mapped_ = true;
+    model_.weights_ = new double*[model_.num_layers_];
+    for (int w = 0; w < model_.num_layers_; ++ w) {
+      model_.weights_[w] = file_.weights(w);
+    }
+    if (header.plan_ & kPlanFloat32) {
+      model_.weights_f_ = new float*[model_.num_layers_];
+      for (int w = 0; w < model_.num_layers_; ++ w) {
+        model_.weights_f_[w] = file_.weights_f(w);
+      }
+    }
+    model_.select_kernel(header.plan_ & kPlanFused);
+  }
+
   void load(std::string path) {
     std::fstream in(path, std::ios::in);
     if (!in.is_open()) {
@@ -63,7 +344,7 @@ private:
     for (uint32_t w = 0; w < model_.num_layers_; ++ w) {
       uint32_t n, m;
       in >> n >> m;
-      model_.weights_[w] = (double*)mkl_calloc(n * m, sizeof(double), 64);
+      model_.weights_[w] = flow_calloc(n * m);
       for (uint32_t i = 0; i < n; ++ i) {
         for (uint32_t j = 0; j < m; ++ j) {
           in >> model_.weights_[w][i * m + j];
@@ -71,6 +352,7 @@ private:
       }
     }
     in.close();
+    model_.select_kernel();
   }
 
 };
@@ -0,0 +1,232 @@
+#ifndef PIECEWISE_FLOW_H
+#define PIECEWISE_FLOW_H
+
+#include "util/common.h"
+
+namespace nfl {
+
+// A piecewise-linear stand-in for the flow on normalized keys, compiled from
+// the exact transformed keys of a set of keys. The flow is monotonic only
+// inside a partition, so every partition is compiled on its own range, from
+// its smallest to its largest key, and a segment joins two knots of the same
+// range. The knots are keys of the set with their exact transformed keys, so
+// the approximation meets the flow at both ends of every range. A key outside
+// the ranges is left to the flow, and stays in order with the keys inside.
+// A transform finds its segment by a radix table over the knots and a binary
+// search in its slot, and then takes one FMA.
+const char kPiecewiseFlowMagic[8] = {'N', 'F', 'L', 'P', 'W', 'L', 'F', '\0'};
+// Raised whenever the layout changes, files of other versions are refused
+const uint32_t kPiecewiseFlowVersion = 1;
+
+struct PiecewiseFlowHeader {
+  char      magic_[8];
+  uint32_t  version_;
+  uint32_t  num_knots_;
+  uint32_t  num_slots_;
+  uint32_t  reserved_;
+  double    mean_;              // The normalization of the flow it was
+  double    var_;               // compiled from.
+  double    max_error_;
+};
+
+class PiecewiseFlow {
+private:
+  static const uint32_t kMaxSearchSteps = 2;
+  static const uint32_t kMaxSlotsPerKnot = 16;
+
+  // The knots in increasing order of their normalized keys. slopes_[k] leads
+  // to knot k + 1, and is NaN for the last knot of a range.
+  std::vector<double>   xs_;
+  std::vector<double>   ys_;
+  std::vector<double>   slopes_;
+  // table_[b]: the first knot in slot b or above, with num_slots_ slots of
+  // equal width from the first knot to the last one
+  std::vector<uint32_t> table_;
+  uint32_t              num_slots_;
+  double                scale_;
+  // The halvings that narrow the knots of any slot to one
+  uint32_t              search_steps_;
+  double                max_error_;
+
+public:
+  explicit PiecewiseFlow(double max_error=0)
+    : num_slots_(0), scale_(0), search_steps_(0), 
+      max_error_(max_error) { }
+
+  // Append the range of one partition, above all ranges so far, from its
+  // increasing normalized keys xs and their strictly increasing transformed
+  // keys ys. The knots are picked greedily: a segment grows to the farthest
+  // key whose chord keeps all keys it passes within max_error_ of their ys.
+  void add_range(const double* xs, const double* ys, uint32_t n) {
+    append_knot(xs[0], ys[0]);
+    uint32_t i = 0;
+    while (i + 1 < n) {
+      // The slopes from knot i that keep the keys passed so far in bounds
+      double lo = -std::numeric_limits<double>::infinity();
+      double hi = std::numeric_limits<double>::infinity();
+      uint32_t end = i + 1;
+      for (uint32_t j = i + 1; j < n; ++ j) {
+        double dx = xs[j] - xs[i];
+        double slope = (ys[j] - ys[i]) / dx;
+        if (slope < lo || slope > hi) {
+          break;
+        }
+        end = j;
+        lo = std::max(lo, (ys[j] - max_error_ - ys[i]) / dx);
+        hi = std::min(hi, (ys[j] + max_error_ - ys[i]) / dx);
+      }
+      slopes_.back() = (ys[end] - ys[i]) / (xs[end] - xs[i]);
+      append_knot(xs[end], ys[end]);
+      i = end;
+    }
+  }
+
+  // Build the radix table once all ranges are added. The slots start as 
+  // many as the knots and double, up to kMaxSlotsPerKnot per knot, while the 
+  // densest slot takes more than kMaxSearchSteps halvings.
+  void finish() {
+    uint32_t n = xs_.size();
+    num_slots_ = 1;
+    while (num_slots_ < n) {
+      num_slots_ <<= 1;
+    }
+    double width = xs_.back() - xs_.front();
+    while (true) {
+      scale_ = width > 0 ? num_slots_ / width : 0;
+      build_table();
+      if (search_steps_ <= kMaxSearchSteps 
+          || num_slots_ >= static_cast<uint64_t>(n) * kMaxSlotsPerKnot) {
+        break;
+      }
+      num_slots_ <<= 1;
+    }
+  }
+
+  // The transformed key of the normalized key x, or false if x is outside
+  // the ranges and needs the flow
+  inline bool transform(double x, double& y) const {
+    if (!(x >= xs_.front() && x <= xs_.back())) {
+      return false;
+    }
+    uint32_t b = slot(x);
+    // The knots of the slots below b are below x and those above it are above
+    // x, so the segment of x starts in [table_[b] - 1, table_[b + 1]). Knot 0
+    // is in slot 0, so the first of them is never above x. The search halves
+    // the range without branches for the same number of steps in every slot, 
+    // since a range of one knot stays put, so that nothing is mispredicted.
+    uint32_t first = std::max(table_[b], 1u) - 1;
+    const double* base = xs_.data() + first;
+    uint32_t n = table_[b + 1] - first;
+    for (uint32_t s = 0; s < search_steps_; ++ s) {
+      uint32_t half = n / 2;
+      base = base[half] <= x ? base + half : base;
+      n -= half;
+    }
+    uint32_t k = base - xs_.data();
+    double slope = slopes_[k];
+    if (std::isnan(slope)) {
+      return false;
+    }
+    y = std::fma(slope, x - xs_[k], ys_[k]);
+    return true;
+  }
+
+  uint32_t num_knots() const {
+    return xs_.size();
+  }
+
+  double max_error() const {
+    return max_error_;
+  }
+
+  uint64_t size() const {
+    return sizeof(PiecewiseFlow) + sizeof(double) * 3 * xs_.size()
+          + sizeof(uint32_t) * table_.size();
+  }
+
+  // mean and var of the flow are stored, so that load refuses the
+  // approximation of another flow
+  void save(const std::string& path, double mean, double var) const {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    assert_p(out.is_open(), "Fail to open " + path);
+    PiecewiseFlowHeader header;
+    std::memset(&header, 0, sizeof(PiecewiseFlowHeader));
+    std::memcpy(header.magic_, kPiecewiseFlowMagic, sizeof(kPiecewiseFlowMagic));
+    header.version_ = kPiecewiseFlowVersion;
+    header.num_knots_ = xs_.size();
+    header.num_slots_ = num_slots_;
+    header.mean_ = mean;
+    header.var_ = var;
+    header.max_error_ = max_error_;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(PiecewiseFlowHeader));
+    out.write(reinterpret_cast<const char*>(xs_.data()),
+              sizeof(double) * xs_.size());
+    out.write(reinterpret_cast<const char*>(ys_.data()),
+              sizeof(double) * ys_.size());
+    out.write(reinterpret_cast<const char*>(slopes_.data()),
+              sizeof(double) * slopes_.size());
+    out.flush();
+    assert_p(out.good(), "Fail to write the piecewise flow");
+  }
+
+  void load(const std::string& path, double mean, double var) {
+    std::ifstream in(path, std::ios::binary);
+    assert_p(in.is_open(), "Fail to open " + path);
+    PiecewiseFlowHeader header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(PiecewiseFlowHeader));
+    assert_p(in.good() && std::memcmp(header.magic_, kPiecewiseFlowMagic,
+                                      sizeof(kPiecewiseFlowMagic)) == 0,
+              path + " is not a piecewise flow");
+    assert_p(header.version_ == kPiecewiseFlowVersion,
+              path + " has an unsupported piecewise flow version");
+    assert_p(header.mean_ == mean && header.var_ == var,
+              path + " was compiled from another flow");
+    assert_p(header.num_knots_ > 0, path + " has no knots");
+    max_error_ = header.max_error_;
+    xs_.resize(header.num_knots_);
+    ys_.resize(header.num_knots_);
+    slopes_.resize(header.num_knots_);
+    in.read(reinterpret_cast<char*>(xs_.data()), sizeof(double) * xs_.size());
+    in.read(reinterpret_cast<char*>(ys_.data()), sizeof(double) * ys_.size());
+    in.read(reinterpret_cast<char*>(slopes_.data()),
+            sizeof(double) * slopes_.size());
+    assert_p(in.good(), path + " is truncated");
+    finish();
+    assert_p(num_slots_ == header.num_slots_, path + " is corrupted");
+  }
+
+private:
+  void append_knot(double x, double y) {
+    xs_.push_back(x);
+    ys_.push_back(y);
+    slopes_.push_back(std::numeric_limits<double>::quiet_NaN());
+  }
+
+  // The rounding of the product is monotonic, so the slots of the knots and
+  // of the keys agree on their order
+  inline uint32_t slot(double x) const {
+    uint64_t b = static_cast<uint64_t>((x - xs_.front()) * scale_);
+    return std::min(b, static_cast<uint64_t>(num_slots_ - 1));
+  }
+
+  void build_table() {
+    table_.assign(num_slots_ + 1, xs_.size());
+    for (uint32_t k = xs_.size(); k > 0; -- k) {
+      table_[slot(xs_[k - 1])] = k - 1;
+    }
+    for (uint32_t b = num_slots_; b > 0; -- b) {
+      table_[b - 1] = std::min(table_[b - 1], table_[b]);
+    }
+    search_steps_ = 0;
+    for (uint32_t b = 0; b < num_slots_; ++ b) {
+      uint32_t n = table_[b + 1] - (std::max(table_[b], 1u) - 1);
+      while ((1u << search_steps_) < n) {
+        search_steps_ ++;
+      }
+    }
+  }
+};
+
+}
+
+#endif
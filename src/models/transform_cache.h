@@ -0,0 +1,127 @@
+#ifndef TRANSFORM_CACHE_H
+#define TRANSFORM_CACHE_H
+
+#include "util/common.h"
+
+namespace nfl {
+
+// A fixed-size cache from raw keys to their transformed keys, so that the
+// hot keys of skewed requests skip the flow. A key lives only in the bucket
+// its hash picks, and every bucket is one cache line that holds kWays keys,
+// their transformed keys and the CLOCK state of its ways. A hit marks its way
+// as referenced, and a miss is admitted into the first way from the hand of
+// the bucket that is free or unreferenced, clearing the marks it passes, so
+// that keys hit again since the hand last passed them stay. Not thread-safe.
+template<typename KT>
+class TransformCache {
+public:
+  static const uint32_t kWays = (64 - 8) / (sizeof(KT) + sizeof(double));
+
+private:
+  struct alignas(64) Bucket {
+    KT        keys_[kWays];
+    double    tran_keys_[kWays];
+    uint8_t   valid_;           // Bit w is set if way w holds a key.
+    uint8_t   referenced_;      // Bit w is set if way w was hit since the
+    uint8_t   hand_;            // hand last passed it.
+  };
+
+  Bucket*   buckets_;
+  uint64_t  num_buckets_;
+  uint64_t  num_lookups_;
+  uint64_t  num_hits_;
+
+public:
+  // Room for at least capacity keys, in a power of two of buckets
+  explicit TransformCache(uint64_t capacity)
+    : num_lookups_(0), num_hits_(0) {
+    num_buckets_ = 1;
+    while (num_buckets_ * kWays < capacity) {
+      num_buckets_ <<= 1;
+    }
+    buckets_ = new Bucket[num_buckets_];
+    clear();
+  }
+
+  TransformCache(const TransformCache&) = delete;
+  TransformCache& operator=(const TransformCache&) = delete;
+
+  ~TransformCache() {
+    delete[] buckets_;
+  }
+
+  // Batches prefetch the buckets of all their keys before the first find, 
+  // so that the misses of the cache lines overlap
+  inline void prefetch(KT key) const {
+    __builtin_prefetch(&buckets_[hash_key(key) & (num_buckets_ - 1)]);
+  }
+
+  inline bool find(KT key, double& tran_key) {
+    Bucket& bucket = buckets_[hash_key(key) & (num_buckets_ - 1)];
+    num_lookups_ ++;
+    uint32_t match = matches(bucket, key);
+    if (match == 0) {
+      return false;
+    }
+    uint32_t w = __builtin_ctz(match);
+    bucket.referenced_ |= 1 << w;
+    tran_key = bucket.tran_keys_[w];
+    num_hits_ ++;
+    return true;
+  }
+
+  inline void admit(KT key, double tran_key) {
+    Bucket& bucket = buckets_[hash_key(key) & (num_buckets_ - 1)];
+    // Repeated misses of a key in one batch admit it once
+    if (matches(bucket, key) != 0) {
+      return;
+    }
+    uint32_t w = bucket.hand_;
+    while (((bucket.valid_ & bucket.referenced_) >> w) & 1) {
+      bucket.referenced_ &= ~(1 << w);
+      w = w + 1 == kWays ? 0 : w + 1;
+    }
+    bucket.keys_[w] = key;
+    bucket.tran_keys_[w] = tran_key;
+    bucket.valid_ |= 1 << w;
+    bucket.referenced_ &= ~(1 << w);
+    bucket.hand_ = w + 1 == kWays ? 0 : w + 1;
+  }
+
+  // Drop all keys, e.g., once the flow computes them differently
+  void clear() {
+    std::memset(static_cast<void*>(buckets_), 0, sizeof(Bucket) * num_buckets_);
+  }
+
+  double hit_rate() const {
+    return num_lookups_ == 0 ? 0 : num_hits_ * 1. / num_lookups_;
+  }
+
+  void reset_hit_rate() {
+    num_lookups_ = 0;
+    num_hits_ = 0;
+  }
+
+  uint64_t capacity() const {
+    return num_buckets_ * kWays;
+  }
+
+  uint64_t size() const {
+    return sizeof(TransformCache<KT>) + sizeof(Bucket) * num_buckets_;
+  }
+
+private:
+  // The ways of the bucket that hold the key, compared without branches 
+  // since the matching way is random
+  static inline uint32_t matches(const Bucket& bucket, KT key) {
+    uint32_t match = 0;
+    for (uint32_t w = 0; w < kWays; ++ w) {
+      match |= static_cast<uint32_t>(bucket.keys_[w] == key) << w;
+    }
+    return match & bucket.valid_;
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef KEY_STORAGE_H
+#define KEY_STORAGE_H
+
+#include "afli/buckets.h"
+#include "afli/iterator.h"
+#include "util/common.h"
+
+namespace nfl {
+
+// The layout of the index of transformed keys of NFL, picked at compile time
+// like the running statistics policy. A transformed request is searched by
+// key() and stored as entry(), and value() and result() read a stored value.
+// Equal is the key equality of the index, see afli/buckets.h.
+
+// Stores the original key and value behind every transformed key. scan needs
+// the original keys, both to drop the keys of other partitions and to return
+// them.
+template<typename KT, typename VT>
+struct FullKeys {
+  typedef std::pair<KT, VT> KVT;
+  typedef std::pair<double, KVT> KKVT;
+  typedef KVT Value;
+  typedef ApproxKeys Equal;
+  static constexpr bool kKeepsKeys = true;
+
+  static inline double key(const KKVT& tran_kv) { return tran_kv.first; }
+
+  static inline const KKVT& entry(const KKVT& tran_kv) { return tran_kv; }
+
+  static inline VT value(const Value& v) { return v.second; }
+
+  static inline ResultIterator<KT, VT> result(Value* v) { return {v}; }
+};
+
+// Stores only the value behind every transformed key, so that a slot takes
+// as many bytes as in an AFLI of the original keys. The original key is told
+// apart by a fingerprint in the low kFingerprintBits bits of the mantissa of
+// the transformed key, which are below the precision that orders the keys
+// and are zero anyway in float32. The index compares the keys bit for bit,
+// since compare takes keys closer than epsilon as equal and so would ignore
+// the fingerprints of all keys below 2^-kFingerprintBits in magnitude. A
+// lookup of an absent key thus only matches a stored key if their
+// transformed keys agree in all other bits and their fingerprints collide,
+// at odds of 2^-kFingerprintBits. Results carry no key and scan is not
+// supported.
+template<typename KT, typename VT>
+struct CompactKeys {
+  typedef std::pair<KT, VT> KVT;
+  typedef std::pair<double, KVT> KKVT;
+  typedef VT Value;
+  typedef ExactKeys Equal;
+  static constexpr bool kKeepsKeys = false;
+  static const uint32_t kFingerprintBits = 16;
+
+  static inline double key(const KKVT& tran_kv) {
+    const uint64_t mask = (1ULL << kFingerprintBits) - 1;
+    uint64_t bits;
+    std::memcpy(&bits, &tran_kv.first, sizeof(double));
+    bits = (bits & ~mask) | (hash_key(tran_kv.second.first) & mask);
+    double key;
+    std::memcpy(&key, &bits, sizeof(double));
+    return key;
+  }
+
+  static inline std::pair<double, VT> entry(const KKVT& tran_kv) {
+    return {key(tran_kv), tran_kv.second.second};
+  }
+
+  static inline VT value(const Value& v) { return v; }
+
+  static inline ResultIterator<KT, VT> result(Value* v) { return {nullptr, v}; }
+};
+
+}
+
+#endif
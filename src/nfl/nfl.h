@@ -5,30 +5,90 @@
 #include "afli/iterator.h"
 #include "benchmark/workload.h"
 #include "models/numerical_flow.h"
+#include "nfl/key_storage.h"
 #include "util/common.h"
+#include "util/parallel_sort.h"
 
 namespace nfl {
 
-template<typename KT, typename VT>
+// Stats is the running statistics policy of both AFLIs, see run_stats.h, and 
+// Storage the layout of the index of transformed keys, see key_storage.h
+template<typename KT, typename VT, typename Stats = NoRunStat, 
+          template<typename, typename> class Storage = FullKeys>
 class NFL {
 typedef std::pair<KT, VT> KVT;
-typedef std::pair<KT, KVT> KKVT;
+typedef std::pair<double, KVT> KKVT;
+typedef Storage<KT, VT> TS;
+typedef std::pair<double, typename TS::Value> TKVT;
 private:
-  AFLI<KT, VT>* index_;
+  AFLI<KT, VT, ArenaAllocator, Stats>* index_;
   uint32_t batch_size_;
   KVT* batch_kvs_;
 
   bool enable_flow_;
   NumericalFlow<KT, VT>* flow_;
-  AFLI<KT, KVT>* tran_index_;
+  // Indexes the transformed keys
+  AFLI<double, typename TS::Value, ArenaAllocator, Stats, 
+        typename TS::Equal>* tran_index_;
   KKVT* tran_kvs_;
+  // Whether the flow runs in float32, see check_float32
+  bool float32_;
+  std::string weights_path_;
+  // The float32 that the constructor asked for, which rebuilds ask for again
+  bool float32_requested_;
+  uint32_t aggregate_size_;
+
+  // Online detection of distribution shifts and background rebuilds, see 
+  // enable_rebuild
+  struct Rebuild;
+  bool rebuild_enabled_;
+  std::vector<std::string> rebuild_weights_;
+  double build_cost_;           // The lookup cost of the index after its 
+  uint32_t build_size_;         // build, and its number of keys.
+  uint32_t num_inserts_;        // The inserts since the build.
+  uint32_t num_rebuilds_;
+  Rebuild* rebuild_;            // The rebuild in flight, or nullptr.
+
+  // The smallest and the largest original keys stored in each partition of 
+  // the flow that holds keys, so that scan skips the empty partitions and 
+  // stops at the last key of a partition. It is built by the first scan and 
+  // kept by the inserts from then on. Removes leave it alone, so a partition 
+  // emptied by them still costs scan one descent.
+  std::map<int64_t, std::pair<KT, KT>> partition_bounds_;
+  bool partitions_built_;
 
   const float kConflictsDecay = 0.1;
   const uint32_t kMaxBatchSize = 4196;
   const float kSizeAmplification = 1.5;
   const float kTailPercent = 0.99;
+  const uint32_t kFloat32CheckBlocks = 64;
+  const uint32_t kFloat32CheckBlockSize = 1024;
+  const float kFloat32ConflictsSlack = 0.1;
+  const double kMaxUnsortedRatio = 0.6;
+  // auto_switch samples inputs of at least kSwitchMinSize keys, see 
+  // estimate_switch
+  const uint32_t kSwitchMinSize = 1 << 21;
+  const uint32_t kSwitchSampleBlocks = 256;
+  const uint32_t kSwitchBlockSize = 256;
+  const uint32_t kSwitchSampleSize = 1 << 18;
+  const double kSwitchConfidenceZ = 2.58;
+  // A rebuild starts once the inserts since the last build reach 
+  // kShiftMinInsertRatio of its keys and raised the lookup cost of the index 
+  // by kShiftCostRatio, checked every kShiftCheckInterval inserts. Both are 
+  // below the thresholds at which the root of an AFLI retrains on the 
+  // calling thread, so that the rebuild usually comes first.
+  const double kShiftMinInsertRatio = 0.1;
+  const double kShiftCostRatio = 1.25;
+  const uint32_t kShiftCheckInterval = 1024;
 public:
-  explicit NFL(std::string weights_path, uint32_t batch_size) : batch_size_(batch_size) { 
+  // With float32, auto_switch runs the flow in float32 if that keeps the 
+  // order of the keys and about the tail conflicts of double, and in double 
+  // otherwise
+  explicit NFL(std::string weights_path, uint32_t batch_size, bool float32=false) 
+    : batch_size_(batch_size), float32_(float32), weights_path_(weights_path), 
+      float32_requested_(float32), aggregate_size_(0), rebuild_enabled_(false), 
+      build_cost_(0), build_size_(0), num_inserts_(0), num_rebuilds_(0), 
+      rebuild_(nullptr), partitions_built_(false) { 
     enable_flow_ = true;
     flow_ = new NumericalFlow<KT, VT>(weights_path, batch_size);
     index_ = nullptr;
@@ -38,6 +98,11 @@ public:
   }
 
   ~NFL() {
+    if (rebuild_ != nullptr) {
+      rebuild_->thread_.join();
+      delete rebuild_->nfl_;
+      delete rebuild_;
+    }
     if (index_ != nullptr) {
       delete index_;
     }
@@ -68,43 +133,73 @@ public:
     batch_size_ = batch_size;
   }
 
+  // Decide from samples whether the flow lowers the tail conflicts of kvs 
+  // enough, and compute the tail conflicts of the chosen keys only. Only if 
+  // the samples leave it open are both computed on all keys.
   uint32_t auto_switch(const KVT* kvs, uint32_t size, uint32_t aggregate_size=0) {
-    tran_kvs_ = new KKVT[size];
-    uint32_t origin_tail_conflicts = compute_tail_conflicts<KT, VT>(kvs, size, kSizeAmplification, kTailPercent);
     flow_->set_batch_size(kMaxBatchSize);
-    flow_->transform(kvs, size, tran_kvs_);
-    std::sort(tran_kvs_, tran_kvs_ + size, [](const KKVT& a, const KKVT& b) {
-      return a.first < b.first;
-    });
-    uint32_t tran_tail_conflicts = compute_tail_conflicts<KT, KVT>(tran_kvs_, size, kSizeAmplification, kTailPercent);
-    if (origin_tail_conflicts <= tran_tail_conflicts
-      || origin_tail_conflicts - tran_tail_conflicts 
-        < static_cast<uint32_t>(origin_tail_conflicts * kConflictsDecay)) {
-      enable_flow_ = false;
+    uint32_t tail_conflicts;
+    // One thread drives and the team runs the tasks that transform, sort and 
+    // fit large inputs, as in AFLI::bulk_load
+    uint32_t num_threads = size < kParallelFitSize ? 1 : omp_get_max_threads();
+    #pragma omp parallel num_threads(num_threads)
+    #pragma omp single
+    {
+      SwitchDecision decision = estimate_switch(kvs, size);
+      if (decision == kKeepKeys) {
+        enable_flow_ = false;
+        tail_conflicts = compute_tail_conflicts<KT, VT>(kvs, size, 
+                          kSizeAmplification, kTailPercent);
+      } else {
+        uint32_t tran_tail_conflicts = transform_sorted(kvs, size);
+        if (decision == kUseFlow) {
+          enable_flow_ = true;
+          tail_conflicts = tran_tail_conflicts;
+        } else {
+          uint32_t origin_tail_conflicts = compute_tail_conflicts<KT, VT>(kvs, 
+                                            size, kSizeAmplification, 
+                                            kTailPercent);
+          enable_flow_ = flow_wins(origin_tail_conflicts, tran_tail_conflicts);
+          tail_conflicts = enable_flow_ ? tran_tail_conflicts 
+                                        : origin_tail_conflicts;
+        }
+      }
+    }
+    if (!enable_flow_ && tran_kvs_ != nullptr) {
       delete[] tran_kvs_;
       tran_kvs_ = nullptr;
-      return origin_tail_conflicts;
-    } else {
-      enable_flow_ = true;
-      return tran_tail_conflicts;
     }
+    return tail_conflicts;
   }
 
   void bulk_load(const KVT* kvs, uint32_t size, uint32_t tail_conflicts, uint32_t aggregate_size=0) {
     if (enable_flow_) {
-      tran_index_ = new AFLI<KT, KVT>();
-      tran_index_->bulk_load(tran_kvs_, size, tail_conflicts, aggregate_size);
+      tran_index_ = new AFLI<double, typename TS::Value, ArenaAllocator, 
+                              Stats, typename TS::Equal>();
+      if constexpr (std::is_same<TKVT, KKVT>::value) {
+        tran_index_->bulk_load(tran_kvs_, size, tail_conflicts, aggregate_size);
+      } else {
+        TKVT* entries = stored_entries(size);
+        tran_index_->bulk_load(entries, size, tail_conflicts, aggregate_size);
+        delete[] entries;
+      }
       flow_->set_batch_size(batch_size_);
       delete tran_kvs_;
       tran_kvs_ = new KKVT[batch_size_];
     } else {
-      index_ = new AFLI<KT, VT>();
+      index_ = new AFLI<KT, VT, ArenaAllocator, Stats>();
       index_->bulk_load(kvs, size, tail_conflicts, aggregate_size);
       batch_kvs_ = new KVT[batch_size_];      
     }
+    aggregate_size_ = aggregate_size;
+    reset_build_cost();
+    reset_partitions();
   }
 
+  // A rebuild that is done replaces the index here, before the batch is 
+  // transformed, so that the batch and its *_at calls see one index
   void transform(const KVT* kvs, uint32_t size) {
+    poll_rebuild();
     if (enable_flow_) {
       flow_->transform(kvs, size, tran_kvs_);
     } else {
@@ -112,11 +207,13 @@ public:
     }
   }
 
-  ResultIterator<KT, VT> find(uint32_t idx_in_batch) {
+  // The requests on the keys of the last transformed batch, addressed by 
+  // their positions in the batch
+  ResultIterator<KT, VT> find_at(uint32_t idx_in_batch) {
     if (enable_flow_) {
-      auto it = tran_index_->find(tran_kvs_[idx_in_batch].first);
+      auto it = tran_index_->find(TS::key(tran_kvs_[idx_in_batch]));
       if (!it.is_end()) {
-        return {it.value_addr()};
+        return TS::result(it.value_addr());
       } else {
         return {};
       }
@@ -125,44 +222,261 @@ public:
     }
   }
 
-  bool update(uint32_t idx_in_batch) {
+  bool update_at(uint32_t idx_in_batch) {
+    log_write(kUpdate, batch_kv(idx_in_batch));
     if (enable_flow_) {
-      return tran_index_->update(tran_kvs_[idx_in_batch]);
+      return tran_index_->update(TS::entry(tran_kvs_[idx_in_batch]));
     } else {
       return index_->update(batch_kvs_[idx_in_batch]);
     }
   }
 
-  uint32_t remove(uint32_t idx_in_batch) {
+  uint32_t remove_at(uint32_t idx_in_batch) {
+    log_write(kDelete, batch_kv(idx_in_batch));
     if (enable_flow_) {
-      return tran_index_->remove(tran_kvs_[idx_in_batch].first);
+      return tran_index_->remove(TS::key(tran_kvs_[idx_in_batch]));
     } else {
       return index_->remove(batch_kvs_[idx_in_batch].first);
     }
   }
 
-  void insert(uint32_t idx_in_batch) {
+  void insert_at(uint32_t idx_in_batch) {
     if (enable_flow_) {
-      tran_index_->insert(tran_kvs_[idx_in_batch]);
+      tran_index_->insert(TS::entry(tran_kvs_[idx_in_batch]));
     } else {
       index_->insert(batch_kvs_[idx_in_batch]);
     }
+    after_insert(batch_kv(idx_in_batch));
   }
 
-  uint64_t model_size() {
+  // The requests on single keys. The key is transformed in registers and 
+  // no batch buffer is touched, so unbatched requests only pay for the flow 
+  // of their own key.
+  ResultIterator<KT, VT> find(KT key) {
+    poll_rebuild();
     if (enable_flow_) {
-      return tran_index_->model_size() + flow_->size();
+      auto it = tran_index_->find(TS::key(flow_->transform(KVT(key, VT()))));
+      if (!it.is_end()) {
+        return TS::result(it.value_addr());
+      } else {
+        return {};
+      }
+    } else {
+      return index_->find(key);
+    }
+  }
+
+  bool update(KVT kv) {
+    poll_rebuild();
+    log_write(kUpdate, kv);
+    if (enable_flow_) {
+      return tran_index_->update(TS::entry(flow_->transform(kv)));
     } else {
-      return index_->model_size();
+      return index_->update(kv);
     }
   }
 
-  uint64_t index_size() {
+  uint32_t remove(KT key) {
+    poll_rebuild();
+    log_write(kDelete, KVT(key, VT()));
     if (enable_flow_) {
-      return tran_index_->index_size() + flow_->size() 
-            + sizeof(NFL<KT, VT>) + sizeof(KKVT) * batch_size_;
+      return tran_index_->remove(TS::key(flow_->transform(KVT(key, VT()))));
     } else {
-      return index_->index_size() + sizeof(NFL<KT, VT>) + sizeof(KVT) * batch_size_;
+      return index_->remove(key);
+    }
+  }
+
+  void insert(KVT kv) {
+    poll_rebuild();
+    if (enable_flow_) {
+      tran_index_->insert(TS::entry(flow_->transform(kv)));
+    } else {
+      index_->insert(kv);
+    }
+    after_insert(kv);
+  }
+
+  // Apply the requests in batches of batch_size_, with the flow of batch 
+  // i + 1 running on a helper thread into the other half of a double buffer 
+  // while batch i is applied to the index, so that a batch costs about the 
+  // larger of its transform and its index time instead of their sum. The 
+  // flow does not depend on the index, so the requests take effect in order 
+  // as with transform and the *_at calls. results[i] gets the outcome of 
+  // reqs[i]: whether it found, updated or removed its key, with the value 
+  // found by queries, and true for inserts. If batch_latencies is given, it 
+  // gets the time from the start of applying each batch to its end, waiting 
+  // for its transform included. A rebuild that is done replaces the index 
+  // between two batches, and the rest of the requests run on the new one.
+  void execute(const Request<KT, VT>* reqs, uint32_t size, 
+                std::pair<bool, VT>* results, double* batch_latencies=nullptr) {
+    poll_rebuild();
+    uint32_t num_batches = (size + batch_size_ - 1) / batch_size_;
+    // The batches applied before a rebuild was done
+    uint32_t num_done = num_batches;
+    if (!enable_flow_) {
+      for (uint32_t b = 0; b < num_batches; ++ b) {
+        auto start = std::chrono::high_resolution_clock::now();
+        uint32_t l = b * batch_size_;
+        uint32_t r = std::min(l + batch_size_, size);
+        for (uint32_t i = l; i < r; ++ i) {
+          results[i] = apply(reqs[i].op, reqs[i].kv);
+          after_apply(reqs[i]);
+        }
+        if (batch_latencies != nullptr) {
+          batch_latencies[b] = std::chrono::duration_cast<
+            std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() 
+                                      - start).count();
+        }
+        if (rebuild_done()) {
+          num_done = b + 1;
+          break;
+        }
+      }
+      execute_rest(reqs, size, results, batch_latencies, num_done);
+      return;
+    }
+    std::vector<KKVT> back(batch_size_);
+    KKVT* buffers[2] = {tran_kvs_, back.data()};
+    std::vector<KVT> kvs(batch_size_);
+    auto transform_batch = [&](uint32_t b) {
+      uint32_t l = b * batch_size_;
+      uint32_t r = std::min(l + batch_size_, size);
+      for (uint32_t i = l; i < r; ++ i) {
+        kvs[i - l] = reqs[i].kv;
+      }
+      flow_->transform(kvs.data(), r - l, buffers[b % 2]);
+    };
+    // Without a second hardware thread nothing overlaps, and handing over 
+    // batches only adds context switches
+    bool pipelined = std::thread::hardware_concurrency() > 1;
+    // The number of batches transformed and applied so far. The helper may 
+    // run one batch ahead, since the batch before it holds the other buffer.
+    std::atomic<uint32_t> num_transformed(0);
+    std::atomic<uint32_t> num_applied(0);
+    // Set once a rebuild is done, so that the helper stops transforming with 
+    // the old flow
+    std::atomic<bool> stop(false);
+    std::thread helper;
+    if (pipelined) {
+      helper = std::thread([&]() {
+        for (uint32_t b = 0; b < num_batches; ++ b) {
+          while (b > num_applied.load(std::memory_order_acquire) + 1) {
+            if (stop.load(std::memory_order_acquire)) {
+              return;
+            }
+            std::this_thread::yield();
+          }
+          if (stop.load(std::memory_order_acquire)) {
+            return;
+          }
+          transform_batch(b);
+          num_transformed.store(b + 1, std::memory_order_release);
+        }
+      });
+    }
+    for (uint32_t b = 0; b < num_batches; ++ b) {
+      auto start = std::chrono::high_resolution_clock::now();
+      if (pipelined) {
+        while (num_transformed.load(std::memory_order_acquire) <= b) {
+          std::this_thread::yield();
+        }
+      } else {
+        transform_batch(b);
+      }
+      uint32_t l = b * batch_size_;
+      uint32_t r = std::min(l + batch_size_, size);
+      const KKVT* tran_kvs = buffers[b % 2];
+      for (uint32_t i = l; i < r; ++ i) {
+        results[i] = apply(reqs[i].op, tran_kvs[i - l]);
+        after_apply(reqs[i]);
+      }
+      num_applied.store(b + 1, std::memory_order_release);
+      if (batch_latencies != nullptr) {
+        batch_latencies[b] = std::chrono::duration_cast<
+          std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() 
+                                    - start).count();
+      }
+      if (rebuild_done()) {
+        num_done = b + 1;
+        stop.store(true, std::memory_order_release);
+        break;
+      }
+    }
+    if (pipelined) {
+      helper.join();
+    }
+    execute_rest(reqs, size, results, batch_latencies, num_done);
+  }
+
+  // Append all key-value pairs whose original keys are in [lo, hi) to out.
+  // The flow is monotonic inside each partition of the key space, so each 
+  // partition that overlaps the range and holds keys costs one descent in 
+  // the transformed index followed by a sequential scan. The range starts at 
+  // the smallest key of its first such partition and ends with the last one, 
+  // so the time does not grow with the width of the range. The partitions 
+  // share the transformed key space, so their sequential scans may pass the 
+  // keys of others. Once they passed as many keys as the index holds, the 
+  // keys in the range are collected from one pass over the index instead.
+  uint32_t scan(KT lo, KT hi, std::vector<KVT>& out) {
+    static_assert(TS::kKeepsKeys, "scan needs the original keys in the index");
+    poll_rebuild();
+    if (enable_flow_) {
+      if (!partitions_built_) {
+        build_partitions();
+      }
+      size_t first = out.size();
+      uint64_t budget = tran_index_->size();
+      uint64_t num_passed = 0;
+      uint32_t cnt = 0;
+      for (auto p = partition_bounds_.lower_bound(flow_->partition(lo)); 
+            p != partition_bounds_.end(); ++ p) {
+        KT l = std::max(lo, p->second.first);
+        if (!(l < hi)) {
+          break;
+        }
+        KT r = std::min(flow_->partition_end(l), hi);
+        // The largest key of the partition that is less than r and not above 
+        // its largest stored key
+        KT last = std::min(next_toward(r, l), p->second.second);
+        if (last < l) {
+          continue;
+        }
+        double tran_lo = flow_->transform(KVT(l, VT())).first;
+        double tran_last = flow_->transform(KVT(last, VT())).first;
+        for (auto it = tran_index_->lower_bound(tran_lo); 
+              !it.is_end() && !(tran_last < it.key()); ++ it) {
+          KVT kv = it.value();
+          if (!(kv.first < l) && kv.first < r) {
+            out.push_back(kv);
+            cnt ++;
+          }
+          if (++ num_passed > budget) {
+            out.resize(first);
+            return scan_all(lo, hi, out);
+          }
+        }
+      }
+      return cnt;
+    } else {
+      return index_->scan(lo, hi, out);
+    }
+  }
+
+  // See AFLI::model_size for the deep mode
+  uint64_t model_size(bool deep=false) {
+    if (enable_flow_) {
+      return tran_index_->model_size(deep) + flow_->size();
+    } else {
+      return index_->model_size(deep);
+    }
+  }
+
+  uint64_t index_size(bool deep=false) {
+    if (enable_flow_) {
+      return tran_index_->index_size(deep) + flow_->size() 
+            + sizeof(NFL<KT, VT, Stats, Storage>) + sizeof(KKVT) * batch_size_;
+    } else {
+      return index_->index_size(deep) + sizeof(NFL<KT, VT, Stats, Storage>) + sizeof(KVT) * batch_size_;
     }
   }
 
@@ -173,6 +487,521 @@ public:
       index_->print_stats();
     }
   }
+
+  RunStat run_stats() {
+    if (enable_flow_) {
+      return tran_index_->run_stats();
+    } else {
+      return index_->run_stats();
+    }
+  }
+
+  bool float32() const {
+    return enable_flow_ && float32_;
+  }
+
+  // Run the flow as a piecewise-linear approximation within max_error of the 
+  // transformed keys of the sorted kvs, see NumericalFlow::compile. Call it 
+  // before auto_switch, usually on the keys to bulk load.
+  void compile_flow(const KVT* kvs, uint32_t size, double max_error) {
+    flow_->compile(kvs, size, max_error);
+  }
+
+  // The same from an approximation that NumericalFlow::save_piecewise wrote
+  void load_compiled_flow(const std::string& path) {
+    flow_->load_piecewise(path);
+  }
+
+  // The number of knots of the approximation, 0 if the flow is not compiled
+  uint32_t compiled_flow_knots() const {
+    return flow_->piecewise() == nullptr ? 0 : flow_->piecewise()->num_knots();
+  }
+
+  // Serve the hot keys of batches from a cache of at least capacity 
+  // transformed keys, see TransformCache. Unbatched requests transform their 
+  // keys without it.
+  void enable_transform_cache(uint64_t capacity) {
+    flow_->enable_cache(capacity);
+  }
+
+  // The share of the keys of batches that the cache served, 0 without one
+  double transform_cache_hit_rate() const {
+    return flow_->cache() == nullptr ? 0 : flow_->cache()->hit_rate();
+  }
+
+  // Watch the lookup cost of the index, which the conflicts of inserts, e.g., 
+  // of keys out of the bounds of the bulk load, raise. Once it grew enough, 
+  // see kShiftCostRatio, the index is rebuilt in the background: the keys 
+  // are copied on the calling thread, and a thread runs auto_switch on them 
+  // for the current weights and each of weights_paths and bulk loads the 
+  // ones with the lowest tail conflicts, with or without the flow. The writes 
+  // in the meantime are logged, replayed on the new index and then the new 
+  // index replaces the old one between two requests. A compiled flow is 
+  // compiled again and a transform cache enabled again on the new keys.
+  void enable_rebuild(const std::vector<std::string>& weights_paths = {}) {
+    static_assert(TS::kKeepsKeys, "rebuilds need the original keys in the index");
+    rebuild_enabled_ = true;
+    rebuild_weights_ = weights_paths;
+  }
+
+  // Replace the index by the rebuilt one if the rebuild is done, which the 
+  // requests do before they transform a key. Return whether it did.
+  bool poll_rebuild() {
+    if (rebuild_done()) {
+      finish_rebuild();
+      return true;
+    }
+    return false;
+  }
+
+  // Wait for the rebuild in flight, if any, and replace the index by it
+  void finish_rebuild() {
+    if (rebuild_ == nullptr) {
+      return;
+    }
+    rebuild_->thread_.join();
+    NFL<KT, VT, Stats, Storage>* fresh = rebuild_->nfl_;
+    for (const Request<KT, VT>& req : rebuild_->log_) {
+      if (req.op == kInsert) {
+        fresh->insert(req.kv);
+      } else if (req.op == kUpdate) {
+        fresh->update(req.kv);
+      } else if (req.op == kDelete) {
+        fresh->remove(req.kv.first);
+      }
+    }
+    fresh->set_batch_size(batch_size_);
+    std::swap(index_, fresh->index_);
+    std::swap(batch_kvs_, fresh->batch_kvs_);
+    std::swap(enable_flow_, fresh->enable_flow_);
+    std::swap(flow_, fresh->flow_);
+    std::swap(tran_index_, fresh->tran_index_);
+    std::swap(tran_kvs_, fresh->tran_kvs_);
+    std::swap(float32_, fresh->float32_);
+    weights_path_ = rebuild_->weights_path_;
+    // fresh holds and frees the old index
+    delete fresh;
+    delete rebuild_;
+    rebuild_ = nullptr;
+    num_rebuilds_ ++;
+    reset_build_cost();
+    reset_partitions();
+  }
+
+  uint32_t num_rebuilds() const {
+    return num_rebuilds_;
+  }
+
+  // The weights of the flow, which a rebuild may have changed
+  const std::string& weights_path() const {
+    return weights_path_;
+  }
+
+private:
+  // A rebuild in flight. Its thread only touches the members above nfl_.
+  struct Rebuild {
+    std::vector<KVT> kvs_;                  // The copied keys.
+    std::vector<std::string> weights_paths_;
+    uint32_t batch_size_;
+    bool float32_;
+    uint32_t aggregate_size_;
+    double piecewise_error_;                // 0 if the flow is not compiled.
+    uint64_t cache_capacity_;               // 0 without a transform cache.
+    std::string weights_path_;              // The weights it picked.
+    NFL<KT, VT, Stats, Storage>* nfl_;      // The new index once done_.
+    std::atomic<bool> done_;
+    std::thread thread_;
+    std::vector<Request<KT, VT>> log_;      // The writes since the copy.
+
+    Rebuild() : nfl_(nullptr), done_(false) { }
+  };
+
+  bool rebuild_done() const {
+    return rebuild_ != nullptr && rebuild_->done_.load(std::memory_order_acquire);
+  }
+
+  // The lookup cost after a build, which later costs are compared to
+  void reset_build_cost() {
+    if (enable_flow_) {
+      build_cost_ = tran_index_->lookup_cost();
+      build_size_ = tran_index_->size();
+    } else {
+      build_cost_ = index_->lookup_cost();
+      build_size_ = index_->size();
+    }
+    num_inserts_ = 0;
+  }
+
+  // The original key of the last transformed batch at idx_in_batch
+  KVT batch_kv(uint32_t idx_in_batch) const {
+    return enable_flow_ ? tran_kvs_[idx_in_batch].second 
+                        : batch_kvs_[idx_in_batch];
+  }
+
+  // Log a write for the rebuild in flight, if any
+  inline void log_write(OperationType op, const KVT& kv) {
+    if (rebuild_ != nullptr) {
+      rebuild_->log_.push_back({op, kv});
+    }
+  }
+
+  // Log an insert that took effect, or start a rebuild if the inserts since 
+  // the last build raised the lookup cost enough
+  inline void after_insert(const KVT& kv) {
+    if (partitions_built_) {
+      add_partition_key(kv.first);
+    }
+    if (rebuild_ != nullptr) {
+      rebuild_->log_.push_back({kInsert, kv});
+      return;
+    }
+    if constexpr (TS::kKeepsKeys) {
+      if (rebuild_enabled_ && (++ num_inserts_) % kShiftCheckInterval == 0 
+          && num_inserts_ >= build_size_ * kShiftMinInsertRatio 
+          && lookup_cost() > build_cost_ * kShiftCostRatio) {
+        start_rebuild();
+      }
+    }
+  }
+
+  inline void after_apply(const Request<KT, VT>& req) {
+    if (req.op == kInsert) {
+      after_insert(req.kv);
+    } else if (req.op == kUpdate || req.op == kDelete) {
+      log_write(req.op, req.kv);
+    }
+  }
+
+  // scan in one pass over the transformed index, with the keys sorted after
+  uint32_t scan_all(KT lo, KT hi, std::vector<KVT>& out) {
+    size_t first = out.size();
+    for (auto it = tran_index_->begin(); !it.is_end(); ++ it) {
+      KVT kv = it.value();
+      if (!(kv.first < lo) && kv.first < hi) {
+        out.push_back(kv);
+      }
+    }
+    std::sort(out.begin() + first, out.end(), [](const KVT& a, const KVT& b) {
+      return a.first < b.first;
+    });
+    return out.size() - first;
+  }
+
+  void add_partition_key(KT key) {
+    auto p = partition_bounds_.emplace(flow_->partition(key), 
+                                        std::make_pair(key, key));
+    if (!p.second) {
+      p.first->second.first = std::min(p.first->second.first, key);
+      p.first->second.second = std::max(p.first->second.second, key);
+    }
+  }
+
+  // Walk the transformed index once for the partitions that hold keys
+  void build_partitions() {
+    for (auto it = tran_index_->begin(); !it.is_end(); ++ it) {
+      add_partition_key(it.value().first);
+    }
+    partitions_built_ = true;
+  }
+
+  void reset_partitions() {
+    partition_bounds_.clear();
+    partitions_built_ = false;
+  }
+
+  double lookup_cost() const {
+    return enable_flow_ ? tran_index_->lookup_cost() : index_->lookup_cost();
+  }
+
+  // Copy the keys of the index and start the rebuild thread on them
+  void start_rebuild() {
+    rebuild_ = new Rebuild();
+    std::vector<KVT>& kvs = rebuild_->kvs_;
+    if (enable_flow_) {
+      kvs.reserve(tran_index_->size());
+      for (auto it = tran_index_->begin(); !it.is_end(); ++ it) {
+        kvs.push_back(it.value());
+      }
+    } else {
+      kvs.reserve(index_->size());
+      for (auto it = index_->begin(); !it.is_end(); ++ it) {
+        kvs.push_back(it.kv());
+      }
+    }
+    rebuild_->weights_paths_.push_back(weights_path_);
+    for (const std::string& path : rebuild_weights_) {
+      if (path != weights_path_) {
+        rebuild_->weights_paths_.push_back(path);
+      }
+    }
+    rebuild_->batch_size_ = batch_size_;
+    rebuild_->float32_ = float32_requested_;
+    rebuild_->aggregate_size_ = aggregate_size_;
+    rebuild_->piecewise_error_ = flow_->piecewise() == nullptr ? 0 
+                                  : flow_->piecewise()->max_error();
+    rebuild_->cache_capacity_ = flow_->cache() == nullptr ? 0 
+                                : flow_->cache()->capacity();
+    rebuild_->thread_ = std::thread(rebuild_index, rebuild_);
+  }
+
+  // The body of the rebuild thread. The keys of the flow index come in the 
+  // order of their transformed keys and are sorted here.
+  static void rebuild_index(Rebuild* rebuild) {
+    std::vector<KVT>& kvs = rebuild->kvs_;
+    std::sort(kvs.begin(), kvs.end(), [](const KVT& a, const KVT& b) {
+      return a.first < b.first;
+    });
+    NFL<KT, VT, Stats, Storage>* best = nullptr;
+    uint32_t best_tail_conflicts = 0;
+    for (const std::string& path : rebuild->weights_paths_) {
+      NFL<KT, VT, Stats, Storage>* nfl = new NFL<KT, VT, Stats, Storage>(
+                                          path, rebuild->batch_size_, 
+                                          rebuild->float32_);
+      if (rebuild->piecewise_error_ > 0) {
+        nfl->compile_flow(kvs.data(), kvs.size(), rebuild->piecewise_error_);
+      }
+      uint32_t tail_conflicts = nfl->auto_switch(kvs.data(), kvs.size(), 
+                                                  rebuild->aggregate_size_);
+      if (best == nullptr || tail_conflicts < best_tail_conflicts) {
+        delete best;
+        best = nfl;
+        best_tail_conflicts = tail_conflicts;
+        rebuild->weights_path_ = path;
+      } else {
+        delete nfl;
+      }
+    }
+    best->bulk_load(kvs.data(), kvs.size(), best_tail_conflicts, 
+                    rebuild->aggregate_size_);
+    if (rebuild->cache_capacity_ > 0) {
+      best->enable_transform_cache(rebuild->cache_capacity_);
+    }
+    std::vector<KVT>().swap(kvs);
+    rebuild->nfl_ = best;
+    rebuild->done_.store(true, std::memory_order_release);
+  }
+
+  // Run the requests from batch num_done on, after the rebuild that stopped 
+  // execute there replaced the index
+  void execute_rest(const Request<KT, VT>* reqs, uint32_t size, 
+                    std::pair<bool, VT>* results, double* batch_latencies, 
+                    uint32_t num_done) {
+    uint32_t l = num_done * batch_size_;
+    if (l >= size) {
+      return;
+    }
+    execute(reqs + l, size - l, results + l, 
+            batch_latencies == nullptr ? nullptr : batch_latencies + num_done);
+  }
+
+  enum SwitchDecision {
+    kKeepKeys = 0,
+    kUseFlow = 1,
+    kUndecided = 2
+  };
+
+  // Whether the tail conflicts of the transformed keys are low enough to 
+  // index them rather than the original keys
+  bool flow_wins(uint32_t origin_tail_conflicts, uint32_t tran_tail_conflicts) {
+    return origin_tail_conflicts > tran_tail_conflicts 
+      && origin_tail_conflicts - tran_tail_conflicts 
+        >= static_cast<uint32_t>(origin_tail_conflicts * kConflictsDecay);
+  }
+
+  // Decide auto_switch on samples of kvs, unless their confidence intervals 
+  // of the tail conflicts allow both outcomes. The original keys are sampled 
+  // in blocks of consecutive keys. The transformed keys of a block spread 
+  // among those of other partitions, so they are sampled one key per stratum 
+  // of ranks and transformed alone.
+  SwitchDecision estimate_switch(const KVT* kvs, uint32_t size) {
+    if (size < kSwitchMinSize) {
+      return kUndecided;
+    }
+    TailConflictsEstimate origin = estimate_tail_conflicts<KT, VT>(kvs, size, 
+                                    kSwitchSampleBlocks, kSwitchBlockSize, 
+                                    kSizeAmplification, kTailPercent, 
+                                    kSwitchConfidenceZ);
+    std::vector<KVT> samples(kSwitchSampleSize);
+    std::mt19937_64 gen(0);
+    for (uint32_t t = 0; t < kSwitchSampleSize; ++ t) {
+      uint32_t l = static_cast<uint64_t>(size) * t / kSwitchSampleSize;
+      uint32_t r = static_cast<uint64_t>(size) * (t + 1) / kSwitchSampleSize;
+      samples[t] = kvs[l + gen() % (r - l)];
+    }
+    std::vector<KKVT> tran_samples(kSwitchSampleSize);
+    flow_->transform(samples.data(), kSwitchSampleSize, tran_samples.data());
+    std::sort(tran_samples.begin(), tran_samples.end(), 
+              [](const KKVT& a, const KKVT& b) { return a.first < b.first; });
+    TailConflictsEstimate tran = estimate_sample_tail_conflicts<double, KVT>(
+                                  tran_samples.data(), kSwitchSampleSize, 
+                                  kSizeAmplification, kTailPercent, 
+                                  kSwitchConfidenceZ);
+    if (!flow_wins(origin.upper_, tran.lower_)) {
+      return kKeepKeys;
+    } else if (flow_wins(origin.lower_, tran.upper_)) {
+      return kUseFlow;
+    }
+    return kUndecided;
+  }
+
+  // Transform all kvs into the sorted tran_kvs_ and return their tail 
+  // conflicts. float32 is kept only if it keeps the keys apart.
+  uint32_t transform_sorted(const KVT* kvs, uint32_t size) {
+    tran_kvs_ = new KKVT[size];
+    if (float32_) {
+      float32_ = check_float32(kvs, size);
+    }
+    transform_all(kvs, size);
+    if (float32_ && !keeps_order(kvs, tran_kvs_, size)) {
+      float32_ = false;
+      flow_->set_float32(false);
+      transform_all(kvs, size);
+    }
+    sort_transformed(size);
+    if (float32_ && !distinct(tran_kvs_, size)) {
+      float32_ = false;
+      flow_->set_float32(false);
+      transform_all(kvs, size);
+      sort_transformed(size);
+    }
+    return compute_tail_conflicts<double, KVT>(tran_kvs_, size, 
+                                                kSizeAmplification, kTailPercent);
+  }
+
+  // Transform kvs into tran_kvs_ by tasks on disjoint ranges of keys, each 
+  // with its own buffers of the flow
+  void transform_all(const KVT* kvs, uint32_t size) {
+    uint32_t num_tasks = num_fit_tasks(size);
+    #pragma omp taskloop grainsize(1)
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      uint32_t l, r;
+      fit_task_range(size, num_tasks, t, l, r);
+      FlowBuffers buffers = flow_->new_buffers();
+      flow_->transform(kvs + l, r - l, tran_kvs_ + l, buffers);
+    }
+  }
+
+  // Sort the transformed keys of the sorted keys. The flow is monotonic 
+  // inside each partition, so only the keys that a partition maps below the 
+  // keys before it are out of order.
+  void sort_transformed(uint32_t size) {
+    sort_nearly_sorted_by_first(tran_kvs_, size, kMaxUnsortedRatio, 
+                                num_fit_tasks(size));
+  }
+
+  // The entries of the Storage layout for the sorted tran_kvs_. Fingerprints 
+  // only reorder keys whose transformed keys agree in all other bits, which 
+  // are next to each other, so a pass of insertion restores the order.
+  TKVT* stored_entries(uint32_t size) {
+    TKVT* entries = new TKVT[size];
+    for (uint32_t i = 0; i < size; ++ i) {
+      entries[i] = TS::entry(tran_kvs_[i]);
+      for (uint32_t j = i; j > 0 && entries[j].first < entries[j - 1].first; 
+            -- j) {
+        std::swap(entries[j], entries[j - 1]);
+      }
+    }
+    return entries;
+  }
+
+  // One request of execute on the transformed index
+  std::pair<bool, VT> apply(OperationType op, const KKVT& tran_kv) {
+    if (op == kQuery) {
+      auto it = tran_index_->find(TS::key(tran_kv));
+      if (!it.is_end()) {
+        return {true, TS::value(it.value())};
+      }
+    } else if (op == kUpdate) {
+      return {tran_index_->update(TS::entry(tran_kv)), VT()};
+    } else if (op == kInsert) {
+      tran_index_->insert(TS::entry(tran_kv));
+      return {true, VT()};
+    } else if (op == kDelete) {
+      return {tran_index_->remove(TS::key(tran_kv)) > 0, VT()};
+    }
+    return {false, VT()};
+  }
+
+  // One request of execute on the index of the original keys
+  std::pair<bool, VT> apply(OperationType op, const KVT& kv) {
+    if (op == kQuery) {
+      auto it = index_->find(kv.first);
+      if (!it.is_end()) {
+        return {true, it.value()};
+      }
+    } else if (op == kUpdate) {
+      return {index_->update(kv), VT()};
+    } else if (op == kInsert) {
+      index_->insert(kv);
+      return {true, VT()};
+    } else if (op == kDelete) {
+      return {index_->remove(kv.first) > 0, VT()};
+    }
+    return {false, VT()};
+  }
+
+  // float32 doubles the keys per vector of the flow but keeps only about 7 
+  // digits of the transformed keys. On blocks of consecutive keys sampled 
+  // over kvs, accept it only if it raises the tail conflicts by at most 
+  // kFloat32ConflictsSlack over double. Return whether the flow runs in 
+  // float32.
+  bool check_float32(const KVT* kvs, uint32_t size) {
+    if (!flow_->set_float32(true)) {
+      return false;
+    }
+    uint32_t num_blocks = std::min(kFloat32CheckBlocks, 
+      (size + kFloat32CheckBlockSize - 1) / kFloat32CheckBlockSize);
+    std::vector<KVT> sample;
+    for (uint32_t b = 0; b < num_blocks; ++ b) {
+      uint32_t l = static_cast<uint64_t>(size) * b / num_blocks;
+      uint32_t r = std::min(l + kFloat32CheckBlockSize, size);
+      sample.insert(sample.end(), kvs + l, kvs + r);
+    }
+    uint32_t n = sample.size();
+    std::vector<KKVT> tran(n);
+    uint32_t tail_conflicts[2];
+    for (int f = 0; f < 2; ++ f) {
+      flow_->set_float32(f == 1);
+      flow_->transform(sample.data(), n, tran.data());
+      std::sort(tran.begin(), tran.end(), [](const KKVT& a, const KKVT& b) {
+        return a.first < b.first;
+      });
+      tail_conflicts[f] = compute_tail_conflicts<double, KVT>(tran.data(), n, 
+                            kSizeAmplification, kTailPercent);
+    }
+    bool accept = tail_conflicts[1] 
+      <= std::ceil(tail_conflicts[0] * (1 + kFloat32ConflictsSlack));
+    flow_->set_float32(accept);
+    return accept;
+  }
+
+  // Whether the transformed keys of the sorted kvs are strictly increasing 
+  // inside every partition, which scan relies on
+  bool keeps_order(const KVT* kvs, const KKVT* tran_kvs, uint32_t size) {
+    for (uint32_t i = 1; i < size; ++ i) {
+      if (kvs[i - 1].first < kvs[i].first 
+          && !(tran_kvs[i - 1].first < tran_kvs[i].first)
+          && flow_->partition(kvs[i - 1].first) 
+            == flow_->partition(kvs[i].first)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Whether distinct keys have distinct transformed keys in the sorted 
+  // tran_kvs. The partitions share the transformed key space, so float32 may 
+  // also merge keys of different partitions, which would be found as each 
+  // other.
+  bool distinct(const KKVT* tran_kvs, uint32_t size) {
+    for (uint32_t i = 1; i < size; ++ i) {
+      if (tran_kvs[i - 1].first == tran_kvs[i].first 
+          && tran_kvs[i - 1].second.first != tran_kvs[i].second.first) {
+        return false;
+      }
+    }
+    return true;
+  }
 };
 
 }
@@ -5,6 +5,7 @@
 #define unlikely(x) __builtin_expect((x),0)
 
 #include <algorithm>
+#include <atomic>
 #include <boost/optional.hpp>
 #include <cassert>
 #include <chrono>
@@ -17,12 +18,18 @@
 #include <iostream>
 #include <limits>
 #include <map>
+#include <mutex>
+#include <new>
+#include <omp.h>
 #include <pthread.h>
 #include <queue>
 #include <random>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
 #include <vector>
 
 const long long kSEED = 1e9 + 7;
@@ -53,13 +60,36 @@ inline void assert_p(bool condition, const std::string& error_msg) {
 
 template<typename T>
 inline bool compare(const T& a, const T& b) {
-  if (std::numeric_limits<T>::is_integer) {
+  if constexpr (std::numeric_limits<T>::is_integer) {
     return a == b;
   } else {
     return std::fabs(a - b) < std::numeric_limits<T>::epsilon();
   }
 }
 
+// Return the next representable value after a in the direction of b
+template<typename T>
+inline T next_toward(T a, T b) {
+  if constexpr (std::numeric_limits<T>::is_integer) {
+    return a < b ? a + 1 : (b < a ? a - 1 : a);
+  } else {
+    return std::nextafter(a, b);
+  }
+}
+
+// Mix the bits of a key with the finalizer of MurmurHash3
+template<typename T>
+inline uint64_t hash_key(T key) {
+  uint64_t x = 0;
+  std::memcpy(&x, &key, std::min(sizeof(T), sizeof(uint64_t)));
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
 template<typename T>
 std::string str(T n) {
   std::stringstream ss;
@@ -215,26 +245,30 @@ struct TreeStat {
 
 struct RunStat {
   // # num_data
-  uint32_t num_data_ = 0;
+  uint64_t num_data_ = 0;
   // # requests
-  uint32_t num_queries_ = 0;
-  uint32_t num_inserts_ = 0;
-  uint32_t num_updates_ = 0;
-  uint32_t num_query_depth_ = 0;
-  uint32_t num_query_model_ = 0;
-  uint32_t num_query_bucket_ = 0;
-  uint32_t num_query_dense_ = 0;
-  uint32_t num_update_model_ = 0;
-  uint32_t num_update_bucket_ = 0;
-  uint32_t num_update_dense_ = 0;
-  uint32_t num_insert_model_ = 0;
-  uint32_t num_insert_bucket_ = 0;
-  uint32_t num_insert_dense_ = 0;
-  uint32_t num_predictions_ = 0;
-  uint32_t num_comparisons_ = 0;
+  uint64_t num_queries_ = 0;
+  uint64_t num_inserts_ = 0;
+  uint64_t num_updates_ = 0;
+  uint64_t num_removes_ = 0;
+  uint64_t num_query_depth_ = 0;
+  uint64_t num_query_model_ = 0;
+  uint64_t num_query_bucket_ = 0;
+  uint64_t num_query_dense_ = 0;
+  uint64_t num_update_model_ = 0;
+  uint64_t num_update_bucket_ = 0;
+  uint64_t num_update_dense_ = 0;
+  uint64_t num_insert_model_ = 0;
+  uint64_t num_insert_bucket_ = 0;
+  uint64_t num_insert_dense_ = 0;
+  uint64_t num_remove_model_ = 0;
+  uint64_t num_remove_bucket_ = 0;
+  uint64_t num_remove_dense_ = 0;
+  uint64_t num_predictions_ = 0;
+  uint64_t num_comparisons_ = 0;
   // # internal operations
-  uint32_t num_rebuilds_ = 0;
-  uint32_t num_data_rebuild_ = 0;
+  uint64_t num_rebuilds_ = 0;
+  uint64_t num_data_rebuild_ = 0;
   // Internal statistics
   uint32_t bucket_threshold_ = 0;
   // Space statistics
@@ -245,8 +279,34 @@ struct RunStat {
   uint32_t sum_len_cont_conflicts_ = 0;
   uint32_t max_len_cont_conflicts_ = 0;
 
-  uint32_t num_requests() {
-    return num_queries_ + num_inserts_ + num_updates_;
+  uint64_t num_requests() {
+    return num_queries_ + num_inserts_ + num_updates_ + num_removes_;
+  }
+
+  // Add the counters of another run, e.g., of another thread
+  void merge(const RunStat& rs) {
+    num_data_ += rs.num_data_;
+    num_queries_ += rs.num_queries_;
+    num_inserts_ += rs.num_inserts_;
+    num_updates_ += rs.num_updates_;
+    num_removes_ += rs.num_removes_;
+    num_query_depth_ += rs.num_query_depth_;
+    num_query_model_ += rs.num_query_model_;
+    num_query_bucket_ += rs.num_query_bucket_;
+    num_query_dense_ += rs.num_query_dense_;
+    num_update_model_ += rs.num_update_model_;
+    num_update_bucket_ += rs.num_update_bucket_;
+    num_update_dense_ += rs.num_update_dense_;
+    num_insert_model_ += rs.num_insert_model_;
+    num_insert_bucket_ += rs.num_insert_bucket_;
+    num_insert_dense_ += rs.num_insert_dense_;
+    num_remove_model_ += rs.num_remove_model_;
+    num_remove_bucket_ += rs.num_remove_bucket_;
+    num_remove_dense_ += rs.num_remove_dense_;
+    num_predictions_ += rs.num_predictions_;
+    num_comparisons_ += rs.num_comparisons_;
+    num_rebuilds_ += rs.num_rebuilds_;
+    num_data_rebuild_ += rs.num_data_rebuild_;
   }
 
   void show() {
@@ -258,7 +318,8 @@ struct RunStat {
               << "\tModel [" << num_query_model_ 
               << "] Bucket [" << num_query_bucket_ 
               << "] Dense [" << num_query_dense_ << "]\nAverage Depth\t" 
-              << num_query_depth_ * 1. / num_queries_ << std::endl;
+              << (num_queries_ ? num_query_depth_ * 1. / num_queries_ : 0) 
+              << std::endl;
     std::cout << "Number of Updates\t" << num_updates_ 
               << "\tModel [" << num_update_model_ 
               << "] Bucket [" << num_update_bucket_ 
@@ -267,6 +328,10 @@ struct RunStat {
               << "\tModel [" << num_insert_model_ 
               << "] Bucket [" << num_insert_bucket_ 
               << "] Dense [" << num_insert_dense_ << "]" << std::endl;
+    std::cout << "Number of Removes\t" << num_removes_ 
+              << "\tModel [" << num_remove_model_ 
+              << "] Bucket [" << num_remove_bucket_ 
+              << "] Dense [" << num_remove_dense_ << "]" << std::endl;
     std::cout << "Number of Predictions\t" << num_predictions_ << std::endl;
     std::cout << "Number of Comparisons\t" << num_comparisons_ << std::endl;
     std::cout << "Number of Rebuilding Times\t" << num_rebuilds_ << std::endl;
@@ -181,6 +181,10 @@ int main(int argc, char* argv[]) {
       std::string source_path = path_join(data_dir, workload_name + ".bin");
       if (key_type == "float64") {
         generate_requests<double, long long>(output_path, source_path, dist_name, batch_size, init_frac, read_frac, kks_frac);
+      } else if (key_type == "int64") {
+        generate_requests<int64_t, long long>(output_path, source_path, dist_name, batch_size, init_frac, read_frac, kks_frac);
+      } else if (key_type == "uint64") {
+        generate_requests<uint64_t, long long>(output_path, source_path, dist_name, batch_size, init_frac, read_frac, kks_frac);
       } else {
         std::cout << "Unsupported key type [" << key_type << "]" << std::endl;
         exit(-1);
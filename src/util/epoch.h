@@ -0,0 +1,173 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include "util/common.h"
+
+namespace nfl {
+
+// Epoch-based memory reclamation. Every operation runs inside an EpochGuard 
+// that publishes the global epoch it started in. Retired memory is tagged 
+// with the global epoch at the time of retiring and freed once every active 
+// thread has moved past that epoch, so no reader can still hold a pointer to 
+// it. A slot is given back when its thread exits and taken by the next new 
+// thread, so any number of threads may come and go as long as at most 
+// kMaxThreads run at once.
+class EpochManager {
+public:
+  static const uint32_t kMaxThreads = 256;
+  static const uint32_t kReclaimThreshold = 64;
+
+private:
+  static const uint64_t kIdle = std::numeric_limits<uint64_t>::max();
+
+  struct Retired {
+    uint64_t epoch_;
+    void* ptr_;
+    void (*deleter_)(void*, void*);
+    void* context_;
+  };
+
+  struct alignas(64) ThreadState {
+    std::atomic<uint64_t> epoch_;
+    std::vector<Retired> retired_;
+
+    ThreadState() : epoch_(kIdle) { }
+  };
+
+  std::atomic<uint64_t> global_epoch_;
+  ThreadState* states_;
+
+public:
+  EpochManager() : global_epoch_(0) {
+    states_ = new ThreadState[kMaxThreads];
+    std::lock_guard<std::mutex> lock(registry().mutex_);
+    registry().managers_.push_back(this);
+  }
+
+  ~EpochManager() {
+    {
+      std::lock_guard<std::mutex> lock(registry().mutex_);
+      auto& managers = registry().managers_;
+      managers.erase(std::find(managers.begin(), managers.end(), this));
+    }
+    for (uint32_t i = 0; i < kMaxThreads; ++ i) {
+      for (auto& r : states_[i].retired_) {
+        r.deleter_(r.ptr_, r.context_);
+      }
+    }
+    delete[] states_;
+  }
+
+  // Each thread gets a slot the first time it touches any manager, and keeps 
+  // it until it exits
+  static uint32_t thread_id() {
+    thread_local ThreadSlot slot;
+    return slot.tid_;
+  }
+
+  void enter() {
+    states_[thread_id()].epoch_.store(global_epoch_.load());
+  }
+
+  void exit() {
+    states_[thread_id()].epoch_.store(kIdle, std::memory_order_release);
+  }
+
+  // The deleter is called with the retired pointer and the given context
+  void retire(void* ptr, void (*deleter)(void*, void*), 
+              void* context=nullptr) {
+    ThreadState& state = states_[thread_id()];
+    state.retired_.push_back({global_epoch_.load(), ptr, deleter, context});
+    if (state.retired_.size() >= kReclaimThreshold) {
+      reclaim(state);
+    }
+  }
+
+private:
+  // The live managers and the slots of the threads that exited, shared by 
+  // all managers since a thread has one slot in all of them
+  struct Registry {
+    std::mutex mutex_;
+    std::vector<EpochManager*> managers_;
+    std::vector<uint32_t> free_tids_;
+    uint32_t num_tids_ = 0;
+  };
+
+  static Registry& registry() {
+    static Registry registry;
+    return registry;
+  }
+
+  // Takes a slot for its thread and gives it back when the thread exits
+  struct ThreadSlot {
+    uint32_t tid_;
+
+    ThreadSlot() {
+      Registry& reg = registry();
+      std::lock_guard<std::mutex> lock(reg.mutex_);
+      if (!reg.free_tids_.empty()) {
+        tid_ = reg.free_tids_.back();
+        reg.free_tids_.pop_back();
+      } else {
+        assert_p(reg.num_tids_ < kMaxThreads, 
+                  "Too many threads for the epoch manager");
+        tid_ = reg.num_tids_ ++;
+      }
+    }
+
+    ~ThreadSlot() {
+      Registry& reg = registry();
+      std::lock_guard<std::mutex> lock(reg.mutex_);
+      for (EpochManager* manager : reg.managers_) {
+        manager->release(tid_);
+      }
+      reg.free_tids_.push_back(tid_);
+    }
+  };
+
+  // The slot of an exiting thread holds no epoch. What it retired and cannot 
+  // be freed yet stays in the slot, and the next thread that takes the slot 
+  // frees it with its own.
+  void release(uint32_t tid) {
+    ThreadState& state = states_[tid];
+    state.epoch_.store(kIdle, std::memory_order_release);
+    if (!state.retired_.empty()) {
+      reclaim(state);
+    }
+  }
+
+  void reclaim(ThreadState& state) {
+    global_epoch_.fetch_add(1);
+    uint64_t min_epoch = kIdle;
+    for (uint32_t i = 0; i < kMaxThreads; ++ i) {
+      min_epoch = std::min(min_epoch, states_[i].epoch_.load());
+    }
+    uint32_t j = 0;
+    for (uint32_t i = 0; i < state.retired_.size(); ++ i) {
+      if (state.retired_[i].epoch_ < min_epoch) {
+        state.retired_[i].deleter_(state.retired_[i].ptr_, 
+                                    state.retired_[i].context_);
+      } else {
+        state.retired_[j ++] = state.retired_[i];
+      }
+    }
+    state.retired_.resize(j);
+  }
+};
+
+class EpochGuard {
+private:
+  EpochManager& manager_;
+
+public:
+  explicit EpochGuard(EpochManager& manager) : manager_(manager) {
+    manager_.enter();
+  }
+
+  ~EpochGuard() {
+    manager_.exit();
+  }
+};
+
+}
+#endif
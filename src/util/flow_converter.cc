@@ -0,0 +1,61 @@
+#include "benchmark/workload.h"
+#include "models/numerical_flow.h"
+#include "util/common.h"
+
+using namespace nfl;
+
+// Compile the flow on the sorted keys of the data into a piecewise-linear
+// approximation, see NumericalFlow::compile
+template<typename KT>
+void compile_flow(std::string weights_path, std::string piecewise_path,
+                  std::string data_path, double max_error) {
+  std::vector<std::pair<KT, long long>> kvs;
+  load_source_data(data_path, kvs);
+  std::sort(kvs.begin(), kvs.end(), [](auto const& a, auto const& b) {
+    return a.first < b.first;
+  });
+  NumericalFlow<KT, long long> flow(weights_path, 256);
+  flow.compile(kvs.data(), kvs.size(), max_error);
+  flow.save_piecewise(piecewise_path);
+  std::cout << "Compile the flow of [" << weights_path << "] on ["
+            << data_path << "] into " << flow.piecewise()->num_knots()
+            << " knots within " << max_error << " to [" << piecewise_path
+            << "]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3 || (argc > 3 && argc < 6)) {
+    std::cout << "No enough parameters" << std::endl;
+    std::cout << "Please input: flow_convert (text weights path) "
+              << "(flow file path)" << std::endl;
+    std::cout << "          or: flow_convert (weights path) "
+              << "(piecewise flow path) (data path) (key type) (max error)"
+              << std::endl;
+    exit(-1);
+  }
+  std::string weights_path = std::string(argv[1]);
+  if (argc >= 6) {
+    std::string piecewise_path = std::string(argv[2]);
+    std::string data_path = std::string(argv[3]);
+    std::string key_type = std::string(argv[4]);
+    double max_error = std::stod(argv[5]);
+    if (key_type == "float64") {
+      compile_flow<double>(weights_path, piecewise_path, data_path, max_error);
+    } else if (key_type == "int64") {
+      compile_flow<int64_t>(weights_path, piecewise_path, data_path, max_error);
+    } else if (key_type == "uint64") {
+      compile_flow<uint64_t>(weights_path, piecewise_path, data_path, max_error);
+    } else {
+      std::cout << "Unsupported key type [" << key_type << "]" << std::endl;
+      exit(-1);
+    }
+    return 0;
+  }
+  std::string flow_path = std::string(argv[2]);
+  // The weights do not depend on the key type
+  NumericalFlow<double, long long> flow(weights_path, 1);
+  flow.save(flow_path);
+  std::cout << "Write the flow of [" << weights_path << "] to ["
+            << flow_path << "]" << std::endl;
+  return 0;
+}
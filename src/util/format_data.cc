@@ -30,6 +30,19 @@ T cut_key(T key, size_t len, bool verbose=false) {
   return ston<std::string, T>(key_cut_str);
 }
 
+// Whether the keys of type T must be cut to be held by the type P. Integer 
+// outputs hold integer keys exactly unless they are too wide.
+template<typename T, typename P>
+bool need_cut() {
+  if (std::numeric_limits<P>::is_integer) {
+    assert_p(std::numeric_limits<T>::is_integer, 
+              "Cannot convert the non-integer type to an integer type");
+    return std::numeric_limits<T>::digits > std::numeric_limits<P>::digits;
+  }
+  return sizeof(T) > sizeof(P) 
+        || (sizeof(T) == sizeof(P) && !std::numeric_limits<T>::is_signed);
+}
+
 template<typename T, typename P>
 void format(std::string data_dir, std::string data_name, std::string suffix, int num_keys = 0) {
   std::string source_path = path_join(data_dir, data_name + suffix);
@@ -50,14 +63,16 @@ void format(std::string data_dir, std::string data_name, std::string suffix, int
   std::vector<T> origin_keys;
   std::vector<P> double_keys;
   if (num_keys == 0) {
-    in.read((char*)&num_keys, sizeof(T));
+    uint64_t num_stored_keys = 0;
+    in.read((char*)&num_stored_keys, sizeof(uint64_t));
+    num_keys = num_stored_keys;
   }
   std::cout << "[" << num_keys << "] keys found in " << data_name << std::endl;
   origin_keys.resize(num_keys);
   in.read((char*)origin_keys.data(), num_keys * sizeof(T));
   in.close();
 
-  if (sizeof(T) > sizeof(P) || (sizeof(T) == sizeof(P) && !std::numeric_limits<T>::is_signed)) {
+  if (need_cut<T, P>()) {
     std::cout << "Cut keys" << std::endl;
     assert_p(std::numeric_limits<T>::is_integer, "Cannot cut the non-integer type");
     size_t key_len = std::numeric_limits<P>::digits10;
@@ -77,27 +92,43 @@ void format(std::string data_dir, std::string data_name, std::string suffix, int
   std::cout << "[" << num_unique << "] unique keys in " << data_name << std::endl;
   std::ofstream out(output_path, std::ios::binary | std::ios::out);
   out.write((char*)&num_unique, sizeof(int));
-  out.write((char*)double_keys.data(), num_keys * sizeof(P));
+  out.write((char*)double_keys.data(), num_unique * sizeof(P));
   out.close();
 }
 
+template<typename T>
+void format_as(std::string output_type, std::string data_dir, 
+                std::string data_name, std::string suffix, int num_keys = 0) {
+  if (output_type == "float64") {
+    format<T, double>(data_dir, data_name, suffix, num_keys);
+  } else if (output_type == "int64") {
+    format<T, int64_t>(data_dir, data_name, suffix, num_keys);
+  } else if (output_type == "uint64") {
+    format<T, uint64_t>(data_dir, data_name, suffix, num_keys);
+  } else {
+    std::cout << "Unspported output type [" << output_type << "]" << std::endl;
+    exit(-1);
+  }
+}
+
 int main(int argc, char* argv[]) {
   if (argc < 4) {
       std::cout << "No enough parameters for formatting workloads\n"
-                << "Please input: format (base path) (workload) (data type)" << std::endl;
+                << "Please input: format (base path) (workload) (data type) [output type]" << std::endl;
       exit(-1);
   }
   std::string base_dir = std::string(argv[1]);
   std::string data_name = std::string(argv[2]);
   std::string data_type = std::string(argv[3]);
+  std::string output_type = argc > 4 ? std::string(argv[4]) : "float64";
   if (data_type == "uint64") {
-    format<uint64_t, double>(path_join(base_dir, "data"), data_name, std::string("_") + data_type);
+    format_as<uint64_t>(output_type, path_join(base_dir, "data"), data_name, std::string("_") + data_type);
   } else if (data_type == "float64") {
     int num_keys = get_num_keys(data_name);
-    format<double, double>(path_join(base_dir, "data"), data_name, ".bin.data", num_keys);
+    format_as<double>(output_type, path_join(base_dir, "data"), data_name, ".bin.data", num_keys);
   } else if (data_type == "int64") {
     int num_keys = get_num_keys(data_name);
-    format<long long, double>(path_join(base_dir, "data"), data_name, ".bin.data", num_keys);
+    format_as<long long>(output_type, path_join(base_dir, "data"), data_name, ".bin.data", num_keys);
   } else {
     std::cout << "Unspported data type [" << data_type << "]" << std::endl;
     exit(-1);
@@ -43,6 +43,10 @@ int main(int argc, char* argv[]) {
   std::string flow_input_dir = std::string(argv[4]);
   if (key_type == "float64") {
     write_workload_keys<double, long long>(workload_path, flow_input_dir, prop);
+  } else if (key_type == "int64") {
+    write_workload_keys<int64_t, long long>(workload_path, flow_input_dir, prop);
+  } else if (key_type == "uint64") {
+    write_workload_keys<uint64_t, long long>(workload_path, flow_input_dir, prop);
   } else {
     std::cout << "Unsupported key type [" << key_type << "]" << std::endl;
     exit(-1);
@@ -0,0 +1,237 @@
+#ifndef PARALLEL_SORT_H
+#define PARALLEL_SORT_H
+
+#include "util/common.h"
+
+namespace nfl {
+
+// Sorting of pairs by their double member first. The work is split into
+// num_tasks tasks on disjoint ranges, which run in parallel inside an
+// OpenMP parallel region.
+
+// The range of elements [l, r) that the t-th of num_tasks tasks works on
+inline void sort_task_range(uint32_t size, uint32_t num_tasks, uint32_t t,
+                            uint32_t& l, uint32_t& r) {
+  l = static_cast<uint64_t>(size) * t / num_tasks;
+  r = static_cast<uint64_t>(size) * (t + 1) / num_tasks;
+}
+
+// The bits of a double whose unsigned order is the order of the doubles
+inline uint64_t double_order_bits(double x) {
+  uint64_t bits;
+  std::memcpy(&bits, &x, sizeof(double));
+  return (bits >> 63) ? ~bits : bits | (1ULL << 63);
+}
+
+const uint32_t kRadixBits = 16;
+const uint32_t kRadixSize = 1 << kRadixBits;
+const uint32_t kRadixPasses = 64 / kRadixBits;
+
+// Stable LSD radix sort with buffer as scratch of size elements. One read 
+// of the data first counts the digits of all passes, and a pass whose digit 
+// is the same for every key is skipped.
+template<typename T>
+void radix_sort_by_first(T* data, T* buffer, uint32_t size,
+                          uint32_t num_tasks) {
+  // counts[(t * kRadixPasses + p) * kRadixSize + d]: the keys with digit d 
+  // in pass p in the range of task t
+  std::vector<uint32_t> counts(num_tasks * kRadixPasses * kRadixSize, 0);
+  #pragma omp taskloop grainsize(1) shared(counts)
+  for (uint32_t t = 0; t < num_tasks; ++ t) {
+    uint32_t l, r;
+    sort_task_range(size, num_tasks, t, l, r);
+    uint32_t* cnt = &counts[t * kRadixPasses * kRadixSize];
+    for (uint32_t i = l; i < r; ++ i) {
+      uint64_t bits = double_order_bits(data[i].first);
+      for (uint32_t p = 0; p < kRadixPasses; ++ p) {
+        cnt[p * kRadixSize + ((bits >> (p * kRadixBits)) & (kRadixSize - 1))] ++;
+      }
+    }
+  }
+  std::vector<bool> trivial(kRadixPasses, false);
+  for (uint32_t p = 0; p < kRadixPasses; ++ p) {
+    for (uint32_t d = 0; d < kRadixSize; ++ d) {
+      uint32_t cnt = 0;
+      for (uint32_t t = 0; t < num_tasks; ++ t) {
+        cnt += counts[(t * kRadixPasses + p) * kRadixSize + d];
+      }
+      trivial[p] = trivial[p] || cnt == size;
+    }
+  }
+  counts.resize(num_tasks * kRadixSize);
+  T* src = data;
+  T* dst = buffer;
+  for (uint32_t p = 0; p < kRadixPasses; ++ p) {
+    if (trivial[p]) {
+      continue;
+    }
+    uint32_t shift = p * kRadixBits;
+    // counts[t * kRadixSize + d] of the keys of this pass, since the ranges 
+    // of the tasks hold other keys after every pass
+    std::fill(counts.begin(), counts.end(), 0);
+    #pragma omp taskloop grainsize(1) shared(counts)
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      uint32_t l, r;
+      sort_task_range(size, num_tasks, t, l, r);
+      uint32_t* cnt = &counts[t * kRadixSize];
+      for (uint32_t i = l; i < r; ++ i) {
+        cnt[(double_order_bits(src[i].first) >> shift) & (kRadixSize - 1)] ++;
+      }
+    }
+    // The first position of every task and digit, digits first so that the
+    // pass is stable
+    uint32_t pos = 0;
+    for (uint32_t d = 0; d < kRadixSize; ++ d) {
+      for (uint32_t t = 0; t < num_tasks; ++ t) {
+        uint32_t cnt = counts[t * kRadixSize + d];
+        counts[t * kRadixSize + d] = pos;
+        pos += cnt;
+      }
+    }
+    #pragma omp taskloop grainsize(1) shared(counts)
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      uint32_t l, r;
+      sort_task_range(size, num_tasks, t, l, r);
+      uint32_t* off = &counts[t * kRadixSize];
+      for (uint32_t i = l; i < r; ++ i) {
+        uint64_t bits = double_order_bits(src[i].first);
+        dst[off[(bits >> shift) & (kRadixSize - 1)] ++] = src[i];
+      }
+    }
+    std::swap(src, dst);
+  }
+  if (src != data) {
+    #pragma omp taskloop grainsize(1)
+    for (uint32_t t = 0; t < num_tasks; ++ t) {
+      uint32_t l, r;
+      sort_task_range(size, num_tasks, t, l, r);
+      std::copy(src + l, src + r, data + l);
+    }
+  }
+}
+
+// Merge the sorted a and b into out. Every task merges an equal share of
+// out, whose sources it finds by a binary search along its first diagonal.
+template<typename T>
+void merge_by_first(const T* a, uint32_t size_a, const T* b, uint32_t size_b,
+                    T* out, uint32_t num_tasks) {
+  uint32_t size = size_a + size_b;
+  #pragma omp taskloop grainsize(1)
+  for (uint32_t t = 0; t < num_tasks; ++ t) {
+    uint32_t l, r;
+    sort_task_range(size, num_tasks, t, l, r);
+    // The number of elements of a among the first l of out
+    uint32_t lo = l > size_b ? l - size_b : 0;
+    uint32_t hi = std::min(l, size_a);
+    while (lo < hi) {
+      uint32_t i = (lo + hi) / 2;
+      if (b[l - i - 1].first < a[i].first) {
+        hi = i;
+      } else {
+        lo = i + 1;
+      }
+    }
+    uint32_t i = lo;
+    uint32_t j = l - lo;
+    for (uint32_t k = l; k < r; ++ k) {
+      if (j == size_b || (i < size_a && !(b[j].first < a[i].first))) {
+        out[k] = a[i ++];
+      } else {
+        out[k] = b[j ++];
+      }
+    }
+  }
+}
+
+// Sort data whose disorder is confined to a part of its elements. The
+// elements that are not below any element before them form a sorted
+// sequence and stay in order. If the others are at most max_unsorted of
+// all, only they are sorted and merged back, otherwise all elements are
+// radix sorted.
+template<typename T>
+void sort_nearly_sorted_by_first(T* data, uint32_t size, double max_unsorted,
+                                  uint32_t num_tasks) {
+  // The largest key before the range of every task
+  std::vector<double> maxs(num_tasks, -std::numeric_limits<double>::infinity());
+  #pragma omp taskloop grainsize(1) shared(maxs)
+  for (uint32_t t = 0; t < num_tasks; ++ t) {
+    uint32_t l, r;
+    sort_task_range(size, num_tasks, t, l, r);
+    for (uint32_t i = l; i < r; ++ i) {
+      maxs[t] = std::max(maxs[t], data[i].first);
+    }
+  }
+  for (uint32_t t = num_tasks - 1; t > 0; -- t) {
+    maxs[t] = maxs[t - 1];
+  }
+  maxs[0] = -std::numeric_limits<double>::infinity();
+  for (uint32_t t = 1; t < num_tasks; ++ t) {
+    maxs[t] = std::max(maxs[t], maxs[t - 1]);
+  }
+  std::vector<uint32_t> num_sorted(num_tasks, 0);
+  #pragma omp taskloop grainsize(1) shared(maxs, num_sorted)
+  for (uint32_t t = 0; t < num_tasks; ++ t) {
+    uint32_t l, r;
+    sort_task_range(size, num_tasks, t, l, r);
+    double max_key = maxs[t];
+    for (uint32_t i = l; i < r; ++ i) {
+      if (!(data[i].first < max_key)) {
+        max_key = data[i].first;
+        num_sorted[t] ++;
+      }
+    }
+  }
+  uint32_t size_sorted = 0;
+  std::vector<uint32_t> sorted_offsets(num_tasks);
+  for (uint32_t t = 0; t < num_tasks; ++ t) {
+    sorted_offsets[t] = size_sorted;
+    size_sorted += num_sorted[t];
+  }
+  uint32_t size_unsorted = size - size_sorted;
+  if (size_unsorted == 0) {
+    return;
+  }
+  auto less = [](const T& a, const T& b) { return a.first < b.first; };
+  if (size_unsorted > size * max_unsorted) {
+    // A single task scatters slower than it sorts by comparisons
+    if (num_tasks == 1) {
+      std::sort(data, data + size, less);
+    } else {
+      T* buffer = new T[size];
+      radix_sort_by_first(data, buffer, size, num_tasks);
+      delete[] buffer;
+    }
+    return;
+  }
+  T* buffer = new T[size];
+  // The sorted elements go to the front of buffer and the others behind them
+  #pragma omp taskloop grainsize(1) shared(maxs, sorted_offsets)
+  for (uint32_t t = 0; t < num_tasks; ++ t) {
+    uint32_t l, r;
+    sort_task_range(size, num_tasks, t, l, r);
+    double max_key = maxs[t];
+    T* sorted = buffer + sorted_offsets[t];
+    T* unsorted = buffer + size_sorted + (l - sorted_offsets[t]);
+    for (uint32_t i = l; i < r; ++ i) {
+      if (!(data[i].first < max_key)) {
+        max_key = data[i].first;
+        *(sorted ++) = data[i];
+      } else {
+        *(unsorted ++) = data[i];
+      }
+    }
+  }
+  T* unsorted = buffer + size_sorted;
+  if (num_tasks == 1) {
+    std::sort(unsorted, unsorted + size_unsorted, less);
+  } else {
+    radix_sort_by_first(unsorted, data, size_unsorted, num_tasks);
+  }
+  merge_by_first(buffer, size_sorted, unsorted, size_unsorted, data,
+                  num_tasks);
+  delete[] buffer;
+}
+
+}
+
+#endif